@@ -1662,6 +1662,64 @@ $1=`echo "$2" | \
 		-e 's/-[[UD]]'"$3"'\(=[[^ 	]]*\)\?[$]//g'`
 ])dnl
 dnl ---------------------------------------------------------------------------
+dnl CF_SO_PEERCRED version: 1 updated: 2026/10/19 08:00:00
+dnl --------------
+dnl Check if getsockopt() returns the credentials of the peer of a local
+dnl socket with SO_PEERCRED, as on Linux.  The glibc headers declare struct
+dnl ucred only if _GNU_SOURCE is defined, which may conflict with the choice
+dnl made by CF_XOPEN_SOURCE, so try that only if the first check fails.
+AC_DEFUN([CF_SO_PEERCRED],
+[
+AC_CACHE_CHECK(for SO_PEERCRED,cf_cv_so_peercred,[
+cf_cv_so_peercred=no
+for cf_so_peercred in yes _GNU_SOURCE
+do
+	case "$cf_so_peercred" in
+	(_GNU_SOURCE)
+		cf_so_peercred_define="#define _GNU_SOURCE 1"
+		;;
+	(*)
+		cf_so_peercred_define=
+		;;
+	esac
+	AC_COMPILE_IFELSE([AC_LANG_PROGRAM([
+$cf_so_peercred_define
+#include <sys/types.h>
+#include <sys/socket.h>],
+	[struct ucred cred; socklen_t len = sizeof(cred);
+	 (void) getsockopt(0, SOL_SOCKET, SO_PEERCRED, &cred, &len);
+	 (void) cred.uid])],
+		[cf_cv_so_peercred=$cf_so_peercred; break])
+done
+])
+case "$cf_cv_so_peercred" in
+(_GNU_SOURCE)
+	AC_DEFINE(_GNU_SOURCE,1,[Define to 1 if we should define _GNU_SOURCE])
+	AC_DEFINE(HAVE_SO_PEERCRED,1,[Define to 1 if getsockopt has SO_PEERCRED])
+	;;
+(yes)
+	AC_DEFINE(HAVE_SO_PEERCRED,1,[Define to 1 if getsockopt has SO_PEERCRED])
+	;;
+esac
+])dnl
+dnl ---------------------------------------------------------------------------
+dnl CF_STAT_MTIM version: 1 updated: 2026/10/19 08:00:00
+dnl ------------
+dnl Check if struct stat provides the nanoseconds of the modification time,
+dnl as st_mtim (POSIX.1-2008).
+AC_DEFUN([CF_STAT_MTIM],
+[
+AC_CACHE_CHECK(for st_mtim in struct stat,cf_cv_stat_mtim,[
+AC_COMPILE_IFELSE([AC_LANG_PROGRAM([$ac_includes_default],
+	[struct stat sb; long ns = (long) sb.st_mtim.tv_nsec; (void) ns])],
+	[cf_cv_stat_mtim=yes],
+	[cf_cv_stat_mtim=no])
+	])
+if test "$cf_cv_stat_mtim" = yes; then
+	AC_DEFINE(HAVE_STAT_MTIM,1,[Define to 1 if struct stat has st_mtim])
+fi
+])dnl
+dnl ---------------------------------------------------------------------------
 dnl CF_STDIO_UNLOCKED version: 10 updated: 2026/04/14 19:55:24
 dnl -----------------
 dnl The four functions getc_unlocked(), getchar_unlocked(), putc_unlocked(),
@@ -34,6 +34,41 @@ static const char *Id = "$Id: diffstat.c,v 1.69 2026/04/15 00:32:18 tom Exp $";
  * Author:	T.E.Dickey
  * Created:	02 Feb 1992
  * Modified:
+ *		19 Oct 2026, add --commits option.
+ *		19 Oct 2026, add --batch options.
+ *		19 Oct 2026, add --serve and --client options.
+ *		19 Oct 2026, add push-style parsing to libdiffstat.
+ *		19 Oct 2026, add libdiffstat, with a reentrant context.
+ *		19 Oct 2026, add --estimate-unchanged option.
+ *		19 Oct 2026, add --compare option.
+ *		19 Oct 2026, accept a tar archive for -S/-D.
+ *		19 Oct 2026, add --gitignore and --ignore-file options.
+ *		19 Oct 2026, use a hash-set to check if files found for -S/-D
+ *			     are in the diff.
+ *		19 Oct 2026, find the -S/-D directory once per directory in diff.
+ *		19 Oct 2026, use io_uring for counting -S/-D files on Linux.
+ *		19 Oct 2026, count -S/-D reference files with threads.
+ *		19 Oct 2026, implement -O option.
+ *		19 Oct 2026, add --build-manifest option, and allow a manifest
+ *			     in place of the -S/-D directories.
+ *		19 Oct 2026, add --cache option.
+ *		19 Oct 2026, use d_type and openat/fstatat when walking the -D
+ *			     directory.
+ *		19 Oct 2026, add --jobs option, to walk the -S/-D directories
+ *			     with a pool of threads.
+ *		19 Oct 2026, compare files for -S/-D by block rather than by
+ *			     character, checking first if they are the same file.
+ *		19 Oct 2026, count lines for -S/-D using mmap and word-sized
+ *			     tests for newlines.
+ *		19 Oct 2026, add --include and --exclude options.
+ *		19 Oct 2026, use a hash-table rather than sorting the data when
+ *			     only the summary is shown.
+ *		19 Oct 2026, skip the body of unified-diff chunks without
+ *			     copying each line.
+ *		19 Oct 2026, prefetch queued input files and -S/-D reference
+ *			     files with posix_fadvise().
+ *		19 Oct 2026, read input in large blocks, and check standard
+ *			     input for compression without ungetc().
  *		14 Apr 2026, fixes for compiler-warnings.
  *		24 Apr 2025, correct len parameter of mbsrtowcs.
  *		11 Nov 2024, add decompression for zstd
@@ -225,6 +260,27 @@ static const char *Id = "$Id: diffstat.c,v 1.69 2026/04/15 00:32:18 tom Exp $";
 
 #include <stdio.h>
 #include <ctype.h>
+#include <errno.h>
+#include <time.h>
+
+#include <diffstat.h>
+
+/* the long options, by shorter names */
+#define optBatch		DIFFSTAT_OPT_BATCH
+#define optBatchList		DIFFSTAT_OPT_BATCH_LIST
+#define optBatchTotal		DIFFSTAT_OPT_BATCH_TOTAL
+#define optBuildManifest	DIFFSTAT_OPT_BUILD_MANIFEST
+#define optCache		DIFFSTAT_OPT_CACHE
+#define optClient		DIFFSTAT_OPT_CLIENT
+#define optCommits		DIFFSTAT_OPT_COMMITS
+#define optCompare		DIFFSTAT_OPT_COMPARE
+#define optEstimate		DIFFSTAT_OPT_ESTIMATE
+#define optExclude		DIFFSTAT_OPT_EXCLUDE
+#define optGitignore		DIFFSTAT_OPT_GITIGNORE
+#define optIgnoreFile		DIFFSTAT_OPT_IGNORE_FILE
+#define optInclude		DIFFSTAT_OPT_INCLUDE
+#define optJobs			DIFFSTAT_OPT_JOBS
+#define optServe		DIFFSTAT_OPT_SERVE
 
 #ifdef HAVE_STRING_H
 #include <string.h>
@@ -244,10 +300,72 @@ extern int atoi(const char *);
 #include <unistd.h>
 #else
 extern int isatty(int);
+#if defined(WIN32)
+#include <io.h>
+#endif
+#endif
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifndef O_NONBLOCK
+#define O_NONBLOCK 0
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+#include <sys/mman.h>
+#else
+#undef HAVE_MMAP
+#endif
+
+/* Linux allows resizing pipes, but the symbol is visible only with GNU_SOURCE */
+#if defined(__linux__) && defined(F_GETFL) && !defined(F_SETPIPE_SZ)
+#define F_SETPIPE_SZ 1031	/* F_LINUX_SPECIFIC_BASE + 7 */
 #endif
 
 #ifdef HAVE_OPENDIR
 #include <dirent.h>
+#if defined(DT_DIR) && defined(DT_REG) && defined(DT_LNK) && defined(DT_UNKNOWN)
+#define USE_D_TYPE 1		/* readdir tells the type of most entries */
+#endif
+#if defined(HAVE_OPENAT) && defined(HAVE_FSTATAT) && defined(HAVE_FDOPENDIR) \
+ && defined(HAVE_DIRFD) && defined(O_DIRECTORY) && defined(AT_SYMLINK_NOFOLLOW)
+#define USE_OPENAT 1		/* look up entries relative to the directory */
+#endif
+#endif
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD) && defined(HAVE_OPENDIR)
+#include <pthread.h>
+#define USE_THREADS 1
+#else
+#define USE_THREADS 0
+#endif
+
+/* contexts may be used on several threads at once if each has its own */
+#if USE_THREADS && defined(__GNUC__)
+#define THREAD_LOCAL __thread
+#elif USE_THREADS && defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L) \
+ && !defined(__STDC_NO_THREADS__)
+#define THREAD_LOCAL _Thread_local
+#else
+#define THREAD_LOCAL		/* nothing */
+#endif
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_SYSCALL_H) \
+ && defined(HAVE_MMAP) && defined(AT_FDCWD) && defined(__ATOMIC_ACQUIRE)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) \
+ && defined(IORING_FEAT_SINGLE_MMAP) && defined(IORING_FEAT_RW_CUR_POS)
+#define USE_IO_URING 1		/* read the -S/-D files with io_uring */
+#endif
+#endif
+#ifndef USE_IO_URING
+#define USE_IO_URING 0
 #endif
 
 #ifdef HAVE_MALLOC_H
@@ -295,6 +413,19 @@ extern int optind;
 #endif
 #endif /* HAVE_TERMIOS_H */
 
+#if defined(HAVE_SYS_SOCKET_H) && defined(HAVE_SYS_UN_H) \
+ && defined(HAVE_FORK) && defined(HAVE_SOCKET)
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#if defined(SCM_RIGHTS) && defined(CMSG_SPACE)
+#define USE_SERVER 1		/* --serve and --client, over a local socket */
+#endif
+#endif
+#ifndef USE_SERVER
+#define USE_SERVER 0
+#endif
+
 #if defined(HAVE_POPEN) && !defined(HAVE_POPEN_PROTOTYPE)
 extern FILE *popen(const char *, const char *);
 extern int pclose(FILE *);
@@ -379,7 +510,7 @@ extern int pclose(FILE *);
 #endif
 
 #if OPT_TRACE
-#define TRACE(p) if (trace_opt) printf p
+#define TRACE(p) if (ds->trace_opt) printf p
 #else
 #define TRACE(p)		/*nothing */
 #endif
@@ -399,6 +530,13 @@ extern int pclose(FILE *);
 #define FMT_FILLED   2
 #define FMT_VERBOSE  4
 
+#define READ_BLOCK   (256 * 1024)	/* size of blocks read from input */
+#define PIPE_BLOCK   (1024 * 1024)	/* preferred capacity of input pipe */
+#define MAX_SNIFF    6		/* longest magic-number we check for */
+#define READ_AHEAD   8		/* number of queued files to prefetch */
+#define COUNT_BLOCK  (64 * 1024)	/* larger files are counted with mmap */
+#define SAMPLE_BLOCK (16 * 1024)	/* prefix read to estimate line-counts */
+
 typedef enum comment {
     Normal, Only, OnlyLeft, OnlyRight, Binary, Differs, Either
 } Comment;
@@ -418,21 +556,179 @@ typedef enum {
 #define EqlOf(p) (p)->count[cEquals]	/* "=" count unmodified lines */
 
 #define TotalOf(p) (InsOf(p) + DelOf(p) + ModOf(p) + EqlOf(p))
-#define for_each_mark(n) for (n = 0; n < num_marks; ++n)
+#define for_each_mark(n) for (n = 0; n < ds->num_marks; ++n)
 
 typedef struct _data {
     struct _data *link;
+    struct _data *chain;	/* next entry in hash-bucket, for -s option */
     char *original;		/* the original filename */
     char *modified;		/* the modified filename */
     int copy;			/* true if filename is const-literal */
     int base;			/* beginning of name if -p option used */
     Comment cmt;
     int pending;
+    int estimated;		/* true if the unchanged-count is estimated */
     long chunks;		/* total number of chunks */
     long chunk[MARKS];		/* counts for the current chunk */
     long count[MARKS];		/* counts for the file */
 } DATA;
 
+/*
+ * A glob-pattern from the --include or --exclude options.
+ */
+typedef struct _pattern {
+    struct _pattern *link;
+    char *text;			/* the pattern itself */
+    size_t length;		/* strlen(text) */
+    int parts;			/* components matched, or -1 for "**" */
+    int literal;		/* true if the pattern has no wildcards */
+} PATTERN;
+
+/*
+ * Input is read in large blocks using read(), rather than character by
+ * character through stdio.
+ */
+typedef struct {
+    int fd;			/* file descriptor to read from */
+    char *data;			/* buffer for the current block */
+    size_t size;		/* allocated size of data[] */
+    size_t used;		/* number of bytes in data[] */
+    size_t next;		/* offset of the next unread byte */
+} INPUT;
+
+/*
+ * The state of the diff-parser, kept between lines so that it can be resumed
+ * when the input arrives in pieces.
+ */
+typedef struct {
+    DATA dummy;			/* placeholder until a filename is found */
+    DATA *that;			/* the file whose changes are being counted */
+    DATA *prev;			/* the file before that, in case of a misguess */
+    const char *default_name;	/* name for a diff without filename header */
+    char *buffer;		/* the current line */
+    char *b_fname;		/* filename scanned from the current line */
+    size_t length;		/* allocated size of buffer[] */
+    size_t fixed;		/* allocated size of b_fname[] */
+    int ok;			/* HAVE_xxx flags for the current file */
+    int freed;
+    int unified;		/* state of unified-diff header */
+    int old_unify;		/* lines remaining in unified-diff chunk */
+    int new_unify;
+    int expect_unify;
+    long old_dft;
+    long new_dft;
+    int context;		/* state of context-diff header */
+    int either;			/* true if "Files XXX and YYY differ" seen */
+    int git_diff;		/* state of git-diff header */
+    int line_no;
+} PARSER;
+
+/*
+ * The digest of a file's contents is computed over 64-bit little-endian words,
+ * so that it is the same on any machine.
+ */
+#ifdef HAVE_STDINT_H
+typedef uint64_t DIGEST;
+#else
+typedef unsigned long long DIGEST;
+#endif
+
+#define DIGEST_WORD	8	/* bytes in each word of the digest */
+#define DigestHi(d)	((unsigned long) ((d) >> 32) & 0xffffffffUL)
+#define DigestLo(d)	((unsigned long) (d) & 0xffffffffUL)
+#define MakeDigest(hi,lo) (((DIGEST) (hi) << 32) | (DIGEST) (lo))
+
+/*
+ * Size, line-count and digest of a file's contents.
+ */
+typedef struct {
+    long size;
+    long lines;
+    DIGEST digest[2];
+} CONTENTS;
+
+/*
+ * Contents of a file, accumulated as it is read.
+ */
+typedef struct {
+    CONTENTS data;
+    int digesting;		/* true if computing the digest */
+    unsigned char part[DIGEST_WORD];	/* leftover bytes */
+    size_t used;		/* number of bytes in part[] */
+} SCAN;
+
+/*
+ * Entry in the --cache file.
+ */
+typedef struct _cached {
+    struct _cached *link;	/* next in hash-bucket */
+    unsigned long dev;
+    unsigned long ino;
+    long mtime;
+    long mtime_ns;
+    long ctime;
+    CONTENTS data;
+} CACHED;
+
+/*
+ * A rule from a .gitignore file or the --ignore-file option.
+ */
+typedef struct _ignore_rule {
+    struct _ignore_rule *link;	/* the previous rule, which it overrides */
+    char *text;			/* the glob-pattern */
+    int literal;		/* true if the pattern has no wildcards */
+    int negate;			/* true if "!" re-includes matching files */
+    int dir_only;		/* true if a trailing "/" matches directories */
+    int anchored;		/* true if matched from the directory, not leaf */
+} IGNORE_RULE;
+
+/*
+ * The ignore-rules which apply in a directory, from the nearest file first.
+ */
+typedef struct _ignores {
+    struct _ignores *parent;	/* rules from the enclosing directories */
+    IGNORE_RULE *rules;		/* the last rule in the file is first */
+    size_t base;		/* length of the pathname of the directory */
+} IGNORES;
+
+/*
+ * The -S/-D directory in which the files of one directory from the diff are
+ * found.  The reference name of each file is its lead followed by its name.
+ */
+typedef struct _ref_dir {
+    struct _ref_dir *link;	/* next in hash-bucket */
+    char *name;			/* directory part of the name, with separator */
+    size_t length;		/* strlen(name) */
+    char *lead;			/* the text to prepend to names in directory */
+} REF_DIR;
+
+/*
+ * Files collected for --build-manifest.
+ */
+typedef struct {
+    char *name;
+    CONTENTS data;
+} MF_ITEM;
+
+typedef struct {
+    MF_ITEM *items;
+    size_t count;
+    size_t size;
+} MF_LIST;
+
+/*
+ * A manifest made by --build-manifest, mapped into memory.
+ */
+typedef struct {
+    const char *path;		/* the -S or -D option's value */
+    void *data;			/* contents of the manifest file */
+    size_t length;		/* size of data */
+    int mapped;			/* true if data is mapped */
+    unsigned long count;	/* number of entries */
+    const unsigned char *entries;
+    const char *names;
+} MANIFEST;
+
 typedef enum {
     dcNone = 0,
     dcBzip,
@@ -449,45 +745,111 @@ static const char marks[MARKS + 1] = "+-!=";
 static const int colors[MARKS + 1] =
 {2, 1, 6, 4};
 
-static DATA *all_data;
-static char *S_option = NULL;
-static char *D_option = NULL;
-static const char *comment_opt = "";
-static char *path_opt = NULL;
-static int count_files;		/* true if we count added/deleted files */
-static int format_opt = FMT_NORMAL;
-static int max_name_wide;	/* maximum amount reserved for filenames */
-static int max_width = 80;	/* the specified width-limit */
-static int merge_names = 1;	/* true if we merge similar filenames */
-static int merge_opt = 0;	/* true if we merge ins/del as modified */
-static int min_name_wide;	/* minimum amount reserved for filenames */
-static int names_only;		/* true if we list filenames only */
-static int num_marks = 3;	/* 3 or 4, according to "-P" option */
-static int path_dest;		/* true if path_opt is destination (patched) */
-static int plot_width;		/* the amount left over for histogram */
-static int prefix_opt = -1;	/* if positive, controls stripping of PATHSEP */
-static int quiet = 0;		/* -q option */
-static int reverse_opt;		/* true if results are reversed */
-static int round_opt = 0;	/* if nonzero, round data for histogram */
-static int show_colors;		/* true if showing SGR colors */
-static int show_progress;	/* if not writing to tty, show progress */
-static int sort_names = 1;	/* true if we sort filenames */
-static int summary_only = 0;	/* true if only summary line is shown */
-static int suppress_binary = 0;	/* -b option */
-static int trim_escapes = 0;	/* -E option */
-static int table_opt = 0;	/* if 1/2, write table instead/also plot */
-static int trace_opt = 0;	/* if nonzero, write debugging information */
-static int unchanged = 0;	/* special-case for -S vs modified-files */
-static int verbose = 0;		/* -v option */
-static long plot_scale;		/* the effective scale (1:maximum) */
+/*
+ * The state of a run of diffstat, from the options through the data which is
+ * collected and summarized.  The functions in this file work on the current
+ * context, which each thread sets for itself.
+ */
+struct _diffstat {
+    DATA *all_data;
+    char *S_option;
+    char *D_option;
+    const char *comment_opt;
+    char *path_opt;
+    int count_files;		/* true if we count added/deleted files */
+    int format_opt;
+    int jobs_opt;		/* --jobs, threads for -S/-D (0=automatic) */
+    int max_name_wide;		/* maximum amount reserved for filenames */
+    int max_width;		/* the specified width-limit */
+    int merge_names;		/* true if we merge similar filenames */
+    int merge_opt;		/* true if we merge ins/del as modified */
+    int min_name_wide;		/* minimum amount reserved for filenames */
+    int names_only;		/* true if we list filenames only */
+    int only_listed;		/* true if -S/-D ignore files not in diff */
+    int num_marks;		/* 3 or 4, according to "-P" option */
+    int path_dest;		/* true if path_opt is destination (patched) */
+    int plot_width;		/* the amount left over for histogram */
+    int prefix_opt;		/* if positive, controls stripping of PATHSEP */
+    int quiet;			/* -q option */
+    int reverse_opt;		/* true if results are reversed */
+    int round_opt;		/* if nonzero, round data for histogram */
+    int show_colors;		/* true if showing SGR colors */
+    int show_progress;		/* if not writing to tty, show progress */
+    int sort_names;		/* true if we sort filenames */
+    int summary_only;		/* true if only summary line is shown */
+    int suppress_binary;	/* -b option */
+    int trim_escapes;		/* -E option */
+    int table_opt;		/* if 1/2, write table instead/also plot */
+    int trace_opt;		/* if nonzero, write debugging information */
+    int unchanged;		/* special-case for -S vs modified-files */
+    int verbose;		/* -v option */
+    long plot_scale;		/* the effective scale (1:maximum) */
 
 #ifdef HAVE_TSEARCH
-static int use_tsearch;
-static void *sorted_data;
+    int use_tsearch;
+    void *sorted_data;
 #endif
 
-static int number_len = 5;
-static int prefix_len = -1;
+    PATTERN *include_opt;	/* --include patterns */
+    PATTERN *exclude_opt;	/* --exclude patterns */
+    IGNORE_RULE *ignore_opt;	/* --ignore-file rules */
+    int gitignore_opt;		/* true to use .gitignore files for -S/-D */
+    int estimate_opt;		/* true to estimate unchanged-lines for -S/-D */
+    int estimated;		/* true if any unchanged-count is estimated */
+    DATA excluded;		/* collects data for files filtered out */
+
+    int use_hashing;		/* true if unsorted data is hashed (-s) */
+    DATA **hashed_data;		/* buckets of the hash-table */
+    size_t hashed_size;		/* number of buckets, a power of two */
+    size_t hashed_used;		/* number of entries in the hash-table */
+
+    char *cache_opt;		/* --cache file */
+    CACHED **cache_data;	/* buckets of the cache's hash-table */
+    size_t cache_size;		/* number of buckets, a power of two */
+    size_t cache_used;		/* number of entries in the cache */
+    int cache_changed;		/* true if the cache should be written */
+    time_t cache_started;	/* newer files are not cached */
+
+    const char **listed_names;	/* names from the diff, for -S/-D */
+    size_t listed_size;		/* number of slots, a power of two */
+    size_t listed_used;		/* number of names in listed_names[] */
+
+    REF_DIR **ref_dirs;		/* buckets of the reference directories */
+    size_t ref_size;		/* number of buckets, a power of two */
+    size_t ref_used;		/* number of reference directories */
+
+    MANIFEST *S_manifest;	/* manifest given for -S */
+    MANIFEST *D_manifest;	/* manifest given for -D */
+
+    int number_len;
+    int prefix_len;
+
+    int started;		/* true once the options have been applied */
+    int broken;			/* true if the options could not be applied */
+    int finished;		/* true once the data has been summarized */
+    int totals_only;		/* true if diffstat_add_totals() was used */
+    DATA *cursor;		/* the next entry for diffstat_next() */
+    DIFFSTAT_FILE totals;	/* the summary, from diffstat_finish() */
+    int num_files;
+    long files_added;
+    long files_binary;
+    long files_removed;
+    FILE *output;		/* the report is written here */
+
+    PARSER *pushed;		/* parser state for diffstat_push() */
+    char *pushed_name;		/* name for a diff without filename header */
+    INPUT pushed_input;		/* data given to diffstat_push() */
+    DATA *partial;		/* the next entry for diffstat_partial_next() */
+
+    int commits_opt;		/* --commits, to report each commit */
+    char *commit_hash;		/* the commit being read */
+    char *commit_author;	/* ...and its author, if known */
+    int commit_style;		/* the kind of input for --commits */
+    int commit_message;		/* true until the "---" ending a message */
+    int commits_shown;		/* number of commits reported */
+};
+
+static THREAD_LOCAL DIFFSTAT *ds;	/* the current context */
 
 /******************************************************************************/
 
@@ -542,2757 +904,7906 @@ is_dir(const char *name)
     return get_stat(name) == S_IFDIR;
 }
 
-static int
-is_file(const char *name)
+/*
+ * Count the newlines in a buffer.  Rather than testing each byte, test a word
+ * at a time:  after xor'ing with a word full of newlines, the bytes which were
+ * newlines are zero, and a zero byte is the only one whose high bit is not set
+ * after adding 0x7f to its low 7 bits and or'ing with the original.  Those
+ * bits are summed using a multiply, which adds all of the bytes into the
+ * most significant byte.
+ */
+static long
+count_newlines(const char *data, size_t length)
 {
-    return get_stat(name) == S_IFREG;
-}
+#define ONES  (~0UL / 255)
+#define LOWS  (ONES * 0x7f)
+#define HIGH  (ONES * 0x80)
+#define TOP   ((sizeof(unsigned long) - 1) * 8)
+    const unsigned long newlines = ONES * '\n';
+    long result = 0;
+    size_t n = 0;
 
-static int
-same_file(const char *source, const char *target)
-{
-    int rc = 0;
-    struct stat ssb;
-    struct stat dsb;
+    if (length >= sizeof(unsigned long)) {
+	size_t last = length - sizeof(unsigned long);
 
-    if (do_stat(source, &ssb) == 0 && S_ISREG(ssb.st_mode)
-	&& do_stat(target, &dsb) == 0 && S_ISREG(dsb.st_mode)
-	&& ssb.st_size == dsb.st_size) {
-	FILE *ip = fopen(source, "r");
-	if (ip != NULL) {
-	    FILE *op = fopen(target, "r");
-	    if (op != NULL) {
-		int a = EOF;
-		int b = EOF;
-		rc = 1;
-		while (1) {
-		    a = fgetc(ip);
-		    b = fgetc(op);
-		    if (a != b) {
-			rc = 0;
-			break;
-		    }
-		    if (a == EOF) {
-			break;
-		    }
-		}
-		if (a != b) {
-		    rc = 0;
-		}
-		fclose(op);
-	    }
-	    fclose(ip);
+	for (n = 0; n <= last; n += sizeof(unsigned long)) {
+	    unsigned long word;
+	    unsigned long test;
+
+	    memcpy(&word, data + n, sizeof(word));
+	    word ^= newlines;
+	    test = ~(((word & LOWS) + LOWS) | word) & HIGH;
+	    result += (long) (((test >> 7) * ONES) >> TOP);
 	}
     }
-    return rc;
+    while (n < length) {
+	if (data[n++] == '\n')
+	    ++result;
+    }
+    return result;
+#undef ONES
+#undef LOWS
+#undef HIGH
+#undef TOP
 }
 
+/*
+ * Scan the contents of a file, counting its lines.  If the --cache option is
+ * used, also compute a digest of the contents, a word at a time.  This is not
+ * a cryptographic hash, but it detects any change to a single word.
+ */
 static void
-blip(int c)
+begin_scan(SCAN * scan)
 {
-    if (show_progress) {
-	(void) fflush(stdout);
-	(void) fputc(c, stderr);
-	(void) fflush(stderr);
-    }
+    memset(scan, 0, sizeof(*scan));
+    scan->data.digest[0] = MakeDigest(0xcbf29ce4UL, 0x84222325UL);
+    scan->data.digest[1] = MakeDigest(0x6a09e667UL, 0xf3bcc909UL);
+    scan->digesting = (ds->cache_opt != NULL);
 }
 
-#ifdef HAVE_STRDUP
-#define new_string(s) strdup(s)
-#else
-static char *
-new_string(const char *s)
+#define ROTATE(value,bits) (((value) << (bits)) | ((value) >> (64 - (bits))))
+#define MIX_1 MakeDigest(0x9e3779b9UL, 0x7f4a7c15UL)
+#define MIX_2 MakeDigest(0xc2b2ae3dUL, 0x27d4eb4fUL)
+
+static void
+mix_scan(SCAN * scan, DIGEST word)
 {
-    return strcpy((char *) xmalloc((size_t) (strlen(s) + 1)), s);
+    scan->data.digest[0] = (ROTATE(scan->data.digest[0], 5) ^ word) * MIX_1;
+    scan->data.digest[1] = (ROTATE(scan->data.digest[1], 17) + word) * MIX_2;
 }
-#endif
 
-static int
-compare_data(const void *a, const void *b)
+/* load a little-endian word, independent of the machine's byte-order */
+static DIGEST
+get_word(const unsigned char *data)
 {
-    const DATA *p = (const DATA *) a;
-    const DATA *q = (const DATA *) b;
-    return ((p != NULL)
-	    ? ((q != NULL)
-	       ? strcmp(p->modified + p->base, q->modified + q->base)
-	       : 1)
-	    : -1);
+    return (((DIGEST) data[0])
+	    | ((DIGEST) data[1] << 8)
+	    | ((DIGEST) data[2] << 16)
+	    | ((DIGEST) data[3] << 24)
+	    | ((DIGEST) data[4] << 32)
+	    | ((DIGEST) data[5] << 40)
+	    | ((DIGEST) data[6] << 48)
+	    | ((DIGEST) data[7] << 56));
 }
 
 static void
-init_data(DATA * data, const char *original, const char *modified, int copy, int base)
+add_scan(SCAN * scan, const char *data, size_t length)
 {
-    memset(data, 0, sizeof(*data));
-    data->original = (char *) original;
-    data->modified = (char *) modified;
-    data->copy = copy;
-    data->base = base;
-    data->cmt = Normal;
+    scan->data.lines += count_newlines(data, length);
+    scan->data.size += (long) length;
+    if (scan->digesting) {
+	size_t n = 0;
+
+	while (scan->used != 0 && n < length) {
+	    scan->part[scan->used++] = (unsigned char) data[n++];
+	    if (scan->used == DIGEST_WORD) {
+		mix_scan(scan, get_word(scan->part));
+		scan->used = 0;
+	    }
+	}
+	for (; n + DIGEST_WORD <= length; n += DIGEST_WORD) {
+	    mix_scan(scan, get_word((const unsigned char *) data + n));
+	}
+	while (n < length) {
+	    scan->part[scan->used++] = (unsigned char) data[n++];
+	}
+    }
 }
 
-static DATA *
-new_data(const char *original, const char *modified, int base)
+static void
+end_scan(SCAN * scan)
 {
-    DATA *r = (DATA *) xmalloc(sizeof(DATA));
-
-    if (original == NULL) {
-	TRACE(("new_data: no original for %s\n", modified));
-	original = modified;	/* FIXME */
+    if (scan->digesting) {
+	if (scan->used != 0) {
+	    memset(scan->part + scan->used, 0, DIGEST_WORD - scan->used);
+	    mix_scan(scan, get_word(scan->part));
+	}
+	mix_scan(scan, (DIGEST) scan->data.size);
     }
-    init_data(r, new_string(original), new_string(modified), 0, base);
-
-    return r;
 }
 
-#ifdef HAVE_TSEARCH
-static DATA *
-add_tsearch_data(const char *original, const char *modified, int base)
+/*
+ * The --cache option names a file which holds the line-count and digest of
+ * files which were read for the -S/-D options.  Each is found by its device
+ * and inode, and used only if its size, modification time and status-change
+ * time are unchanged.
+ */
+#define CACHE_MAGIC "diffstat-cache 2"
+
+#ifdef HAVE_STAT_MTIM
+#define MtimeNsec(sb) ((long) (sb)->st_mtim.tv_nsec)
+#else
+#define MtimeNsec(sb) 0L
+#endif
+
+#if USE_THREADS
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define LockCache()   pthread_mutex_lock(&cache_mutex)
+#define UnlockCache() pthread_mutex_unlock(&cache_mutex)
+#else
+#define LockCache()		/* nothing */
+#define UnlockCache()		/* nothing */
+#endif
+
+#define CacheOf(dev,ino) \
+	ds->cache_data[((dev) * 31 + (ino)) & (ds->cache_size - 1)]
+
+static CACHED *
+find_cached(const struct stat *sb)
 {
-    DATA find;
-    DATA *result;
-    void *pp;
+    CACHED *result = NULL;
 
-    init_data(&find, NULL, modified, 1, base);
-    if ((pp = tfind(&find, &sorted_data, compare_data)) != NULL) {
-	result = *(DATA **) pp;
-	return result;
-    }
-    result = new_data(original, modified, base);
-    (void) tsearch(result, &sorted_data, compare_data);
-    result->link = all_data;
-    all_data = result;
+    if (ds->cache_size != 0) {
+	unsigned long dev = (unsigned long) sb->st_dev;
+	unsigned long ino = (unsigned long) sb->st_ino;
 
+	for (result = CacheOf(dev, ino); result != NULL; result = result->link) {
+	    if (result->dev == dev && result->ino == ino)
+		break;
+	}
+    }
     return result;
 }
-#endif
 
 static int
-count_prefix(const char *name)
+valid_cached(const CACHED * p, const struct stat *sb)
 {
-    int count = 0;
-    const char *s;
-    while ((s = strchr(name, PATHSEP)) != NULL) {
-	name = s + 1;
-	++count;
-    }
-    return count;
+    return (p != NULL
+	    && p->data.size == (long) sb->st_size
+	    && p->mtime == (long) sb->st_mtime
+	    && p->mtime_ns == MtimeNsec(sb)
+	    && p->ctime == (long) sb->st_ctime);
 }
 
-static const char *
-skip_prefix(const char *name, int prefix, int *base)
+static void
+add_cached(CACHED * p)
 {
-    if (prefix >= 0) {
-	int n;
-	*base = 0;
+    if (ds->cache_used >= ds->cache_size) {
+	size_t old_size = ds->cache_size;
+	CACHED **old_data = ds->cache_data;
+	size_t n;
 
-	for (n = prefix; n > 0; n--) {
-	    const char *s = strchr(name + *base, PATHSEP);
-	    if (s == NULL || *++s == EOS) {
-		name = s;
-		break;
+	ds->cache_size = (old_size != 0) ? (old_size * 2) : 1024;
+	ds->cache_data = (CACHED **) xmalloc(ds->cache_size * sizeof(CACHED *));
+	memset(ds->cache_data, 0, ds->cache_size * sizeof(CACHED *));
+	for (n = 0; n < old_size; ++n) {
+	    CACHED *q;
+	    CACHED *next;
+
+	    for (q = old_data[n]; q != NULL; q = next) {
+		next = q->link;
+		q->link = CacheOf(q->dev, q->ino);
+		CacheOf(q->dev, q->ino) = q;
 	    }
-	    *base = (int) (s - name);
 	}
-	TRACE(("** base set to %d\n", *base));
+	free(old_data);
     }
-    return name;
+    p->link = CacheOf(p->dev, p->ino);
+    CacheOf(p->dev, p->ino) = p;
+    ++ds->cache_used;
 }
 
-static DATA *
-find_data(const char *original, const char *modified)
+/*
+ * Remember the result of scanning a file.  Files changed since we started
+ * may be modified again without changing their timestamps, so we do not
+ * remember those.
+ */
+static void
+store_cached(const struct stat *sb, const SCAN * scan)
 {
-    DATA *r;
-    int base = 0;
-
-    TRACE(("** find_data(%s => %s)\n", NonNull(original), NonNull(modified)));
-
-    /* Compute the base offset if the prefix option is used */
-    if (prefix_opt >= 0) {
-	(void) skip_prefix(modified, prefix_opt, &base);
-    }
-
-    /* Insert into sorted list (usually sorted).  If we are not sorting or
-     * merging names, we fall off the end and link the new entry to the end of
-     * the list.  If the prefix option is used, the prefix is ignored by the
-     * merge and sort operations.
-     *
-     * If we have tsearch(), we will maintain the sorted list using it and
-     * tfind().
-     */
-#ifdef HAVE_TSEARCH
-    if (use_tsearch) {
-	r = add_tsearch_data(original, modified, base);
-    } else
-#endif
-    {
-	DATA *p;
-	DATA find;
-	DATA *q;
-
-	init_data(&find, original, modified, 1, base);
-	for (p = all_data, q = NULL; p != NULL; q = p, p = p->link) {
-	    int cmp = compare_data(p, &find);
-	    if (merge_names && (cmp == 0))
-		return p;
-	    if (sort_names && (cmp > 0))
-		break;
+    if (ds->cache_opt != NULL
+	&& scan->digesting
+	&& (long) sb->st_size == scan->data.size
+	&& sb->st_mtime < ds->cache_started
+	&& sb->st_ctime < ds->cache_started) {
+	CACHED *p;
+
+	LockCache();
+	if ((p = find_cached(sb)) == NULL) {
+	    p = (CACHED *) xmalloc(sizeof(CACHED));
+	    p->dev = (unsigned long) sb->st_dev;
+	    p->ino = (unsigned long) sb->st_ino;
+	    add_cached(p);
 	}
-	r = new_data(original, modified, base);
-	if (q != NULL)
-	    q->link = r;
-	else
-	    all_data = r;
-
-	r->link = p;
+	p->mtime = (long) sb->st_mtime;
+	p->mtime_ns = MtimeNsec(sb);
+	p->ctime = (long) sb->st_ctime;
+	p->data = scan->data;
+	ds->cache_changed = 1;
+	UnlockCache();
     }
-
-    return r;
 }
 
 /*
- * Remove a unneeded data item from the linked list.  Free the name as well.
+ * Get the contents of a file from the cache, returning false if it is not
+ * known.
  */
 static int
-delink(DATA * data)
+cached_contents(const struct stat *sb, CONTENTS * info)
 {
-    DATA *p, *q;
+    int result = 0;
 
-    TRACE(("** delink '%s'\n", data->modified));
+    if (ds->cache_opt != NULL) {
+	CACHED *p;
 
-#ifdef HAVE_TSEARCH
-    if (use_tsearch) {
-	if (tdelete(data, &sorted_data, compare_data) == NULL)
-	    return 0;
-    }
-#endif
-    for (p = all_data, q = NULL; p != NULL; q = p, p = p->link) {
-	if (p == data) {
-	    if (q != NULL)
-		q->link = p->link;
-	    else
-		all_data = p->link;
-	    if (!p->copy) {
-		free(p->original);
-		free(p->modified);
-	    }
-	    free(p);
-	    return 1;
+	LockCache();
+	if (valid_cached(p = find_cached(sb), sb)) {
+	    *info = p->data;
+	    result = 1;
 	}
+	UnlockCache();
     }
-    return 0;
+    return result;
+}
+
+static int
+same_contents(const CONTENTS * p, const CONTENTS * q)
+{
+    return (p->size == q->size
+	    && p->lines == q->lines
+	    && p->digest[0] == q->digest[0]
+	    && p->digest[1] == q->digest[1]);
 }
 
 /*
- * Compare string 's' against a constant, returning either a pointer just
- * past the matched part of 's' if it matches exactly, or null if a mismatch
- * was found.
+ * Return true if both files are cached with the same contents, false if they
+ * are cached with different contents, or -1 if either is not known.
  */
-static char *
-match(char *s, const char *p)
+static int
+cached_same(const struct stat *ssb, const struct stat *dsb)
 {
-    int ok = 0;
+    CONTENTS s_info;
+    CONTENTS d_info;
 
-    while (*s != EOS) {
-	if (*p == EOS) {
-	    ok = 1;
-	    break;
+    return ((cached_contents(ssb, &s_info) && cached_contents(dsb, &d_info))
+	    ? same_contents(&s_info, &d_info)
+	    : -1);
+}
+
+static void
+load_cache(void)
+{
+    FILE *fp;
+
+    ds->cache_started = time((time_t *) 0);
+    if ((fp = fopen(ds->cache_opt, "r")) != NULL) {
+	char buffer[BUFSIZ];
+
+	if (fgets(buffer, (int) sizeof(buffer), fp) != NULL
+	    && !strncmp(buffer, CACHE_MAGIC "\n", sizeof(CACHE_MAGIC))) {
+	    CACHED item;
+	    unsigned long digest[4];
+
+	    while (fgets(buffer, (int) sizeof(buffer), fp) != NULL) {
+		if (sscanf(buffer, "%lu %lu %ld %ld %ld %ld %ld %8lx%8lx %8lx%8lx",
+			   &item.dev,
+			   &item.ino,
+			   &item.data.size,
+			   &item.mtime,
+			   &item.mtime_ns,
+			   &item.ctime,
+			   &item.data.lines,
+			   &digest[0],
+			   &digest[1],
+			   &digest[2],
+			   &digest[3]) == 11) {
+		    CACHED *p = (CACHED *) xmalloc(sizeof(CACHED));
+		    item.data.digest[0] = MakeDigest(digest[0], digest[1]);
+		    item.data.digest[1] = MakeDigest(digest[2], digest[3]);
+		    *p = item;
+		    add_cached(p);
+		}
+	    }
 	}
-	if (*s++ != *p++)
-	    break;
-	if (*s == EOS && *p == EOS) {
-	    ok = 1;
-	    break;
+	(void) fclose(fp);
+	TRACE(("loaded %lu entries from cache %s\n",
+	       (unsigned long) ds->cache_used, ds->cache_opt));
+    }
+}
+
+/*
+ * Write the cache to a temporary file, and rename that, so that a concurrent
+ * run of diffstat does not read a partly-written cache.
+ */
+static void
+save_cache(void)
+{
+    if (ds->cache_changed) {
+	char *temp = xmalloc(strlen(ds->cache_opt) + 50);
+	FILE *fp;
+
+	/* several contexts may save the cache at once, e.g., for --batch */
+	sprintf(temp, "%s.%ld.%p", ds->cache_opt, (long) getpid(), (void *) ds);
+	if ((fp = fopen(temp, "w")) != NULL) {
+	    size_t n;
+	    int ok;
+
+	    fprintf(fp, "%s\n", CACHE_MAGIC);
+	    for (n = 0; n < ds->cache_size; ++n) {
+		const CACHED *p;
+
+		for (p = ds->cache_data[n]; p != NULL; p = p->link) {
+		    fprintf(fp, "%lu %lu %ld %ld %ld %ld %ld %08lx%08lx %08lx%08lx\n",
+			    p->dev,
+			    p->ino,
+			    p->data.size,
+			    p->mtime,
+			    p->mtime_ns,
+			    p->ctime,
+			    p->data.lines,
+			    DigestHi(p->data.digest[0]),
+			    DigestLo(p->data.digest[0]),
+			    DigestHi(p->data.digest[1]),
+			    DigestLo(p->data.digest[1]));
+		}
+	    }
+	    ok = !ferror(fp);
+	    if (fclose(fp) != 0 || !ok || rename(temp, ds->cache_opt) != 0) {
+		(void) unlink(temp);
+		fp = NULL;
+	    }
+	}
+	if (fp == NULL) {
+	    (void) fflush(stdout);
+	    fprintf(stderr, "Cannot write cache \"%s\"\n", ds->cache_opt);
 	}
+	free(temp);
     }
-    return ok ? s : NULL;
 }
 
-static int
-version_num(const char *s)
+static void
+free_cache(void)
 {
-    int main_ver, sub_ver;
-    char temp[2];
-    return (sscanf(s, "%d.%d%c", &main_ver, &sub_ver, temp) == 2);
+    size_t n;
+
+    for (n = 0; n < ds->cache_size; ++n) {
+	CACHED *p;
+	CACHED *next;
+
+	for (p = ds->cache_data[n]; p != NULL; p = next) {
+	    next = p->link;
+	    free(p);
+	}
+    }
+    free(ds->cache_data);
 }
 
 /*
- * Check for a range of line-numbers, used in editing scripts.
+ * Read until the buffer is full or end-of-file, returning the number of bytes
+ * read.
  */
-static int
-edit_range(const char *s)
+static size_t
+read_block(int fd, char *buffer, size_t want)
 {
-    int first, last;
-    char temp[2];
-    return (sscanf(s, "%d,%d%c", &first, &last, temp) == 2)
-	|| (sscanf(s, "%d%c", &first, temp) == 1);
+    size_t have = 0;
+
+    while (have < want) {
+	ssize_t got = read(fd, buffer + have, want - have);
+	if (got > 0) {
+	    have += (size_t) got;
+	} else if (got == 0 || errno != EINTR) {
+	    break;
+	}
+    }
+    return have;
 }
 
 /*
- * Decode a range for default diff.
+ * A manifest, made by the --build-manifest option, can be given to the -S
+ * or -D option in place of a directory.  It lists the files in a directory
+ * tree, sorted by their relative pathnames, with the size, line-count and
+ * digest of each.  It is used in place, without parsing:
+ *
+ *	header	magic string, the number of entries and the offset of the
+ *		names.
+ *	entries	fixed-size records in the order of their names, holding the
+ *		offset and length of the name, and the file's contents.
+ *	names	null-terminated pathnames.
+ *
+ * Numbers are stored as 32-bit big-endian values, and the 64-bit digests as
+ * pairs of those.  Version 1 used the native words of the machine for the
+ * digests, and is not accepted.
+ */
+#define MF_PREFIX	"diffstat-mf"
+#define MF_MAGIC	MF_PREFIX "2"
+#define MF_HEADER	32	/* size of header */
+#define MF_ENTRY	40	/* size of each entry */
+
+#define MF_COUNT	16	/* offsets within the header */
+#define MF_NAMES	20
+
+#define MF_NAME_AT	0	/* offsets within each entry */
+#define MF_NAME_LEN	4
+#define MF_SIZE_HI	8
+#define MF_SIZE_LO	12
+#define MF_LINES	16
+#define MF_DIGEST	24
+
+static unsigned long
+get_mf32(const unsigned char *data)
+{
+    return (((unsigned long) data[0] << 24)
+	    | ((unsigned long) data[1] << 16)
+	    | ((unsigned long) data[2] << 8)
+	    | ((unsigned long) data[3]));
+}
+
+static const char *
+manifest_name(const MANIFEST * m, unsigned long n)
+{
+    return m->names + get_mf32(m->entries + (n * MF_ENTRY) + MF_NAME_AT);
+}
+
+static void
+manifest_contents(const MANIFEST * m, unsigned long n, CONTENTS * info)
+{
+    const unsigned char *entry = m->entries + (n * MF_ENTRY);
+    int k;
+
+    info->size = (long) ((get_mf32(entry + MF_SIZE_HI) << 16) << 16)
+	+ (long) get_mf32(entry + MF_SIZE_LO);
+    info->lines = (long) get_mf32(entry + MF_LINES);
+    for (k = 0; k < 2; ++k) {
+	const unsigned char *digest = entry + MF_DIGEST + (8 * k);
+	info->digest[k] = MakeDigest(get_mf32(digest), get_mf32(digest + 4));
+    }
+}
+
+/*
+ * Binary-search the manifest for the given pathname.
  */
 static int
-decode_default(const char *s,
-	       long *first, long *first_size,
-	       long *second, long *second_size)
+find_manifest(const MANIFEST * m, const char *name, CONTENTS * info)
 {
-    int rc = 0;
-    char *next;
+    unsigned long lo = 0;
+    unsigned long hi = m->count;
 
-    if (isdigit(UC(*s))) {
-	*first_size = 1;
-	*second_size = 1;
+    while (lo < hi) {
+	unsigned long mid = lo + (hi - lo) / 2;
+	int cmp = strcmp(name, manifest_name(m, mid));
 
-	*first = strtol(s, &next, 10);
-	if (next != NULL && next != s) {
-	    if (*next == ',') {
-		s = ++next;
-		*first_size = strtol(s, &next, 10) + 1 - *first;
-	    }
-	}
-	if (next != NULL && next != s) {
-	    switch (*next++) {
-	    case 'a':
-	    case 'c':
-	    case 'd':
-		s = next;
-		next = NULL;
-		*second = strtol(s, &next, 10);
-		if (next != NULL && next != s) {
-		    if (*next == ',') {
-			s = ++next;
-			*second_size = strtol(s, &next, 10) + 1 - *second;
-		    }
-		}
-		if (next != NULL && next != s && *next == EOS)
-		    rc = 1;
-		break;
-	    }
+	if (cmp == 0) {
+	    manifest_contents(m, mid, info);
+	    return 1;
+	} else if (cmp < 0) {
+	    hi = mid;
+	} else {
+	    lo = mid + 1;
 	}
     }
-    return rc;
+    return 0;
 }
 
 /*
- * Decode a range for unified diff.  Oddly, the comments in diffutils code
- * claim that both numbers are line-numbers.  However, inspection of the output
- * shows that the numbers are a line-number followed by a count.
+ * Check if the pathname refers to a file in a manifest given for -S or -D,
+ * returning the manifest and the name relative to it.
  */
-static char *
-decode_range(char *s, int *first, int *second)
+static MANIFEST *
+manifest_of(const char *pathname, const char **name)
 {
-    if (isdigit(UC(*s))) {
-	int count = 0;
-	int value[2];
+    MANIFEST *result = NULL;
+    int n;
 
-	value[0] = 0;
-	value[1] = 0;
-	while (*s != EOS) {
-	    int ch = UC(*s);
-	    if (isdigit(ch)) {
-		value[count] = (10 * value[count]) + (ch - '0');
-	    } else if (ch == ',') {
-		if (++count > 1) {
-		    s = NULL;
-		    break;
-		}
-		value[count] = 0;
-	    } else {
-		break;
+    for (n = 0; n < 2 && result == NULL; ++n) {
+	MANIFEST *m = n ? ds->D_manifest : ds->S_manifest;
+
+	if (m != NULL) {
+	    size_t len = strlen(m->path);
+
+	    if (!strncmp(pathname, m->path, len) && pathname[len] == PATHSEP) {
+		*name = pathname + len + 1;
+		result = m;
 	    }
-	    ++s;
 	}
-	if (s != NULL) {
-	    *first = value[0];
-	    if (count == 0) {
-		*second = 1;
-	    } else {
-		*second = value[1];
-	    }
-#if OPT_TRACE
-	    if (*second) {
-		TRACE(("** decode_range [%d..%d]\n",
-		       *first, *first + *second - 1));
-	    } else {
-		TRACE(("** decode_range [%d]\n",
-		       *first));
-	    }
+    }
+    return result;
+}
+
+static void
+free_manifest(MANIFEST * m)
+{
+    if (m != NULL) {
+#ifdef HAVE_MMAP
+	if (m->mapped)
+	    (void) munmap(m->data, m->length);
+	else
 #endif
-	}
+	    free(m->data);
+	free(m);
     }
-    return s;
 }
 
 static int
-HadDiffs(const DATA * data)
+bad_manifest(const char *path, const char *why)
 {
-    return InsOf(data) != 0
-	|| DelOf(data) != 0
-	|| ModOf(data) != 0
-	|| data->cmt != Normal;
+    (void) fflush(stdout);
+    fprintf(stderr, "Manifest %s: %s\n", path, why);
+    return -1;
 }
 
 /*
- * If the given path is not one of the "ignore" paths, then return true.
+ * Load a manifest, returning 1 if it was loaded, 0 if the file is not a
+ * manifest, or -1 if it is corrupt.
  */
 static int
-can_be_merged(const char *path)
+load_manifest(const char *path, MANIFEST ** manifest)
 {
-    int result = 0;
-    if (strcmp(path, "")
-	&& strcmp(path, "/dev/null"))
-	result = 1;
-    return result;
+    MANIFEST *result = NULL;
+    struct stat sb;
+    int status = 0;
+    int fd;
+
+    *manifest = NULL;
+    if ((fd = open(path, O_RDONLY)) >= 0) {
+	unsigned char header[MF_HEADER];
+
+	if (fstat(fd, &sb) == 0
+	    && S_ISREG(sb.st_mode)
+	    && read_block(fd, (char *) header, sizeof(header)) == sizeof(header)
+	    && !memcmp(header, MF_PREFIX, sizeof(MF_PREFIX) - 1)) {
+	    size_t length = (size_t) sb.st_size;
+	    unsigned long count = get_mf32(header + MF_COUNT);
+	    unsigned long names = get_mf32(header + MF_NAMES);
+	    unsigned long n;
+
+	    if (memcmp(header, MF_MAGIC, sizeof(MF_MAGIC) - 1)) {
+		(void) close(fd);
+		return bad_manifest(path, "unsupported version");
+	    }
+	    if ((off_t) length != sb.st_size
+		|| names > length
+		|| names < MF_HEADER
+		|| (names - MF_HEADER) / MF_ENTRY < count) {
+		(void) close(fd);
+		return bad_manifest(path, "corrupt header");
+	    }
+
+	    status = 1;
+	    result = (MANIFEST *) xmalloc(sizeof(MANIFEST));
+	    result->path = path;
+	    result->length = length;
+	    result->count = count;
+	    result->mapped = 0;
+#ifdef HAVE_MMAP
+	    result->data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, (off_t) 0);
+	    if (result->data != MAP_FAILED) {
+		result->mapped = 1;
+	    } else
+#endif
+	    {
+		result->data = xmalloc(length);
+		if (lseek(fd, (off_t) 0, SEEK_SET) != 0
+		    || read_block(fd, (char *) result->data, length) != length) {
+		    (void) fflush(stdout);
+		    perror(path);
+		    status = -1;
+		}
+	    }
+	    result->entries = (const unsigned char *) result->data + MF_HEADER;
+	    result->names = (const char *) result->data + names;
+
+	    /* check that the names are within the file, and terminated */
+	    for (n = 0; n < count && status > 0; ++n) {
+		const unsigned char *entry = result->entries + (n * MF_ENTRY);
+		unsigned long at = get_mf32(entry + MF_NAME_AT);
+		unsigned long len = get_mf32(entry + MF_NAME_LEN);
+
+		if (at >= length - names
+		    || len >= length - names - at
+		    || result->names[at + len] != EOS) {
+		    status = bad_manifest(path, "corrupt entry");
+		}
+	    }
+	    if (status < 0) {
+		free_manifest(result);
+		result = NULL;
+	    }
+	    TRACE(("loaded manifest %s with %lu entries\n", path, count));
+	}
+	(void) close(fd);
+    }
+    *manifest = result;
+    return status;
 }
 
 static int
-is_leaf(const char *theLeaf, const char *path)
+compare_mf_items(const void *a, const void *b)
 {
-    const char *s;
-
-    if (strchr(theLeaf, PATHSEP) == NULL
-	&& (s = strrchr(path, PATHSEP)) != NULL
-	&& !strcmp(++s, theLeaf))
-	return 1;
-    return 0;
+    return strcmp(((const MF_ITEM *) a)->name, ((const MF_ITEM *) b)->name);
 }
 
-static char *
-trim_datapath(DATA ** datap, size_t length, int *localp)
+static void
+put_mf32(unsigned char *data, unsigned long value)
 {
-    char *target = (*datap)->modified;
-
-    (void) localp;
-#ifdef HAVE_TSEARCH
-    /*
-     * If we are using tsearch(), make a local copy of the data
-     * so we can trim it without interfering with tsearch's
-     * notion of the ordering of data.  That will create some
-     * spurious empty data, so we add the changed() macro in a
-     * few places to skip over those.
-     */
-    if (use_tsearch) {
-	char *trim = new_string(target);
-	if (trim != NULL) {
-	    trim[length] = EOS;
-	    *datap = add_tsearch_data(NULL, trim, (*datap)->base);
-	    target = (*datap)->modified;
-	    free(trim);
-	    *localp = 1;
-	}
-    } else
-#endif
-	target[length] = EOS;
+    data[0] = UC(value >> 24);
+    data[1] = UC(value >> 16);
+    data[2] = UC(value >> 8);
+    data[3] = UC(value);
+}
 
-    return target;
+/*
+ * Add a file to the list for a manifest, taking ownership of the name.
+ */
+static void
+add_mf_item(MF_LIST * list, char *name, const CONTENTS * data)
+{
+    if (list->count >= list->size) {
+	list->size = (list->size != 0) ? (list->size * 2) : 1024;
+	list->items = (MF_ITEM *) realloc(list->items,
+					  list->size * sizeof(MF_ITEM));
+	if (list->items == NULL)
+	    failed("realloc");
+    }
+    list->items[list->count].name = name;
+    list->items[list->count].data = *data;
+    list->count++;
 }
 
-static size_t
-compare_tails(const char *target, const char *source, int *diff)
+/*
+ * Sort the list of files and return the manifest made from it, freeing the
+ * list.
+ */
+static unsigned char *
+manifest_image(MF_LIST * list, size_t *length)
 {
-    size_t len1 = strlen(target);
-    size_t len2 = strlen(source);
+    unsigned char *result;
+    unsigned char *entry;
+    char *names;
+    size_t names_len = 0;
+    unsigned long offset;
     size_t n;
-    size_t matched = 0;
 
-    *diff = 0;
-    for (n = 1; n <= len1 && n <= len2; n++) {
-	if (target[len1 - n] != source[len2 - n]) {
-	    *diff = (int) n;
-	    break;
-	}
-	if (source[len2 - n] == PATHSEP) {
-	    matched = n;
+    if (list->count != 0)
+	qsort(list->items, list->count, sizeof(MF_ITEM), compare_mf_items);
+    for (n = 0; n < list->count; ++n) {
+	names_len += strlen(list->items[n].name) + 1;
+    }
+    *length = MF_HEADER + (list->count * MF_ENTRY) + names_len;
+    result = (unsigned char *) xmalloc(*length);
+
+    memset(result, 0, MF_HEADER);
+    memcpy(result, MF_MAGIC, sizeof(MF_MAGIC) - 1);
+    put_mf32(result + MF_COUNT, (unsigned long) list->count);
+    put_mf32(result + MF_NAMES,
+	     (unsigned long) (MF_HEADER + (list->count * MF_ENTRY)));
+
+    entry = result + MF_HEADER;
+    names = (char *) (entry + (list->count * MF_ENTRY));
+    for (n = 0, offset = 0; n < list->count; ++n, entry += MF_ENTRY) {
+	const CONTENTS *data = &(list->items[n].data);
+	unsigned long len = (unsigned long) strlen(list->items[n].name);
+	int k;
+
+	memset(entry, 0, (size_t) MF_ENTRY);
+	put_mf32(entry + MF_NAME_AT, offset);
+	put_mf32(entry + MF_NAME_LEN, len);
+	put_mf32(entry + MF_SIZE_HI, ((unsigned long) data->size >> 16) >> 16);
+	put_mf32(entry + MF_SIZE_LO, (unsigned long) data->size & 0xffffffffUL);
+	put_mf32(entry + MF_LINES, (unsigned long) data->lines);
+	for (k = 0; k < 2; ++k) {
+	    unsigned char *digest = entry + MF_DIGEST + (8 * k);
+	    put_mf32(digest, DigestHi(data->digest[k]));
+	    put_mf32(digest + 4, DigestLo(data->digest[k]));
 	}
+	memcpy(names + offset, list->items[n].name, (size_t) len + 1);
+	offset += len + 1;
+	free(list->items[n].name);
     }
-    return matched;
+    free(list->items);
+    memset(list, 0, sizeof(*list));
+    return result;
 }
 
 /*
- * The 'data' parameter points to the first of two markers, while
- * 'path' is the pathname from the second marker.
- *
- * On the first call for
- * a given file, the 'data' parameter stores no differences.
+ * Read an open file, counting its lines and, if needed, computing its digest.
+ * A regular file (whose status is given) is mapped into memory if it is large.
  */
-static char *
-do_merging(DATA * data, char *path, int *freed)
+static void
+scan_file(int fd, const struct stat *sb, SCAN * scan)
 {
-    char *target = reverse_opt ? path : data->modified;
-    char *source = reverse_opt ? data->modified : path;
-    char *result = source;
-    int diff;
-
-    TRACE(("** do_merging(\"%s\" -> \"%s\",\"%s\") diffs:%d\n",
-	   NonNull(data->original),
-	   NonNull(data->modified),
-	   path, HadDiffs(data)));
-
-    *freed = 0;
-    if (!HadDiffs(data)) {
-
-	if (is_leaf(target, source)) {
-	    TRACE(("** is_leaf: \"%s\" vs \"%s\"\n", target, source));
-	    if (reverse_opt) {
-		TRACE((".. no action @%d\n", __LINE__));
-	    } else {
-		TRACE((".. will delink @%d\n", __LINE__));
-		*freed = delink(data);
-	    }
-	} else if (can_be_merged(target)
-		   && can_be_merged(source)) {
-	    size_t len1 = strlen(target);
-	    size_t len2 = strlen(source);
-	    int local = 0;
-
-	    /*
-	     * If the source/target differ only by some suffix, e.g., ".orig"
-	     * or ".bak", strip that off.  The target may may also be a
-	     * temporary filename (which would not be merged since it has no
-	     * apparent relationship to the current).
-	     */
-	    if (len1 > len2) {
-		if (!strncmp(target, source, len2)) {
-		    TRACE(("** trimming data \"%s\" to \"%.*s\"\n",
-			   target, (int) len2, target));
-		    if (reverse_opt) {
-			TRACE((".. no action @%d\n", __LINE__));
-		    } else {
-			target = trim_datapath(&data, len2, &local);
-		    }
-		}
-	    } else if (len1 < len2) {
-		if (!strncmp(target, source, len1)) {
-		    TRACE(("** trimming source \"%s\" to \"%.*s\"\n",
-			   source, (int) len1, source));
-		    if (reverse_opt) {
-			TRACE((".. no action @%d\n", __LINE__));
-		    } else {
-			source[len2 = len1] = EOS;
-		    }
-		}
-	    }
-
-	    /*
-	     * If there was no "-p" option, look for the best match by
-	     * stripping prefixes from both source/target strings.
-	     */
-	    if (prefix_opt < 0) {
-		int matched = 0;
-		/*
-		 * Now (whether or not we trimmed a suffix), scan back from the
-		 * end of source/target strings to find if they happen to share
-		 * a common ending, e.g., a/b/c versus d/b/c.  If the strings
-		 * are not identical, then 'diff' will be set, but if they have
-		 * a common ending then 'matched' will be set.
-		 */
-		diff = 0;
-		matched = (int) compare_tails(target, source, &diff);
-
-		TRACE(("** merge @%d, prefix_opt=%d matched=%d diff=%d\n",
-		       __LINE__, prefix_opt, matched, diff));
-		if (matched != 0 && diff) {
-		    if (reverse_opt) {
-			TRACE((".. no action @%d\n", __LINE__));
-		    } else {
-			result = source + ((int) len2 - matched + 1);
-		    }
-		}
-	    }
-
-	    if (!local) {
-		if (reverse_opt) {
-		    TRACE((".. no action @%d\n", __LINE__));
-		} else {
-		    TRACE((".. will delink @%d\n", __LINE__));
-		    *freed = delink(data);
-		}
-	    }
-	} else if (reverse_opt) {
-	    TRACE((".. no action @%d\n", __LINE__));
-	    if (can_be_merged(source)) {
-		TRACE(("** merge @%d\n", __LINE__));
-	    } else {
-		TRACE(("** do not merge, retain @%d\n", __LINE__));
-		/* must not merge, retain existing name */
-		result = target;
-	    }
-	} else {
-	    if (can_be_merged(source)) {
-		TRACE(("** merge @%d\n", __LINE__));
-		*freed = delink(data);
-	    } else {
-		TRACE(("** do not merge, retain @%d\n", __LINE__));
-		/* must not merge, retain existing name */
-		result = target;
-	    }
+    int done = 0;
+
+#ifdef HAVE_MMAP
+    if (sb != NULL
+	&& sb->st_size > COUNT_BLOCK
+	&& (off_t) (size_t) sb->st_size == sb->st_size) {
+	size_t length = (size_t) sb->st_size;
+	void *addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, (off_t) 0);
+
+	if (addr != MAP_FAILED) {
+	    add_scan(scan, (const char *) addr, length);
+	    (void) munmap(addr, length);
+	    done = 1;
 	}
-    } else if (reverse_opt) {
-	TRACE((".. no action @%d\n", __LINE__));
-	if (can_be_merged(source)) {
-	    TRACE(("** merge @%d\n", __LINE__));
-	    result = target;
-	} else {
-	    TRACE(("** do not merge, retain @%d\n", __LINE__));
-	}
-    } else {
-	if (can_be_merged(source)) {
-	    TRACE(("** %smerge @%d\n", merge_names ? "" : "do not ", __LINE__));
-	    if (merge_names
-		&& *target != EOS
-		&& prefix_opt < 0) {
-		size_t matched = compare_tails(target, source, &diff);
-		if (matched && !diff)
-		    result = target + (int) (strlen(target) - matched);
+    }
+#else
+    (void) sb;
+#endif
+    if (!done) {
+	char buffer[COUNT_BLOCK];
+	ssize_t got;
+
+	for (;;) {
+	    got = read(fd, buffer, sizeof(buffer));
+	    if (got > 0) {
+		add_scan(scan, buffer, (size_t) got);
+	    } else if (got == 0 || errno != EINTR) {
+		break;
 	    }
-	} else {
-	    TRACE(("** do not merge, retain @%d\n", __LINE__));
-	    result = target;
 	}
     }
-    TRACE(("** finish do_merging ->\"%s\"\n", result));
-    return result;
+    end_scan(scan);
 }
 
+#ifdef HAVE_MMAP
+/*
+ * Compare two files of the same size by mapping both into memory.  Return -1
+ * if either cannot be mapped.
+ */
 static int
-begin_data(const DATA * p)
+same_mapped(int ifd, int ofd, size_t length, SCAN * scan)
 {
-    TRACE(("...begin_data(\"%s\" -> \"%s\")\n",
-	   NonNull(p->original),
-	   NonNull(p->modified)));
-
-    if (!can_be_merged(p->modified)
-	&& strchr(p->modified, PATHSEP) != NULL) {
-	TRACE(("** begin_data:HAVE_PATH\n"));
-	return HAVE_PATH;
+    int rc = -1;
+    void *ia = mmap(NULL, length, PROT_READ, MAP_PRIVATE, ifd, (off_t) 0);
+
+    if (ia != MAP_FAILED) {
+	void *oa = mmap(NULL, length, PROT_READ, MAP_PRIVATE, ofd, (off_t) 0);
+	if (oa != MAP_FAILED) {
+	    rc = !memcmp(ia, oa, length);
+	    if (rc && scan != NULL)
+		add_scan(scan, (const char *) ia, length);
+	    (void) munmap(oa, length);
+	}
+	(void) munmap(ia, length);
     }
-    TRACE(("** begin_data:HAVE_GENERIC\n"));
-    return HAVE_GENERIC;
-}
-
-static char *
-skip_blanks(char *s)
-{
-    while (isspace(UC(*s)))
-	++s;
-    return s;
+    return rc;
 }
+#endif
 
 /*
- * Skip a filename, which may be in quotes, to allow embedded blanks in the
- * name.
+ * Compare two open files, a block at a time, stopping at the first block
+ * which differs.
  */
-static char *
-skip_filename(char *s)
+static int
+same_blocks(int ifd, int ofd, SCAN * scan)
 {
-    int delim = (*s == SQUOTE) ? SQUOTE : DQUOTE;
+    char ibuf[COUNT_BLOCK];
+    char obuf[COUNT_BLOCK];
+    int rc = 1;
 
-    if ((*s == delim) && (s[1] != EOS) && (strchr) (s + 1, delim) != NULL) {
-	++s;
-	while (*s != EOS && (*s != delim) && isprint(UC(*s))) {
-	    ++s;
-	}
-	++s;
-    } else {
-	while (*s != EOS && isgraph(UC(*s))) {
-	    ++s;
+    for (;;) {
+	size_t ilen = read_block(ifd, ibuf, sizeof(ibuf));
+	size_t olen = read_block(ofd, obuf, sizeof(obuf));
+
+	if (ilen != olen || memcmp(ibuf, obuf, ilen)) {
+	    rc = 0;
+	    break;
 	}
+	if (scan != NULL)
+	    add_scan(scan, ibuf, ilen);
+	if (ilen < sizeof(ibuf))
+	    break;
     }
-    return s;
+    return rc;
 }
 
-static char *
-skip_options(char *params)
+/*
+ * Get the contents of a regular file from a manifest, the cache, or by reading
+ * it.  Return false if that is not possible.
+ */
+static int
+file_contents(const char *pathname, CONTENTS * info)
 {
-    while (*params != EOS) {
-	params = skip_blanks(params);
-	if (*params == '-') {
-	    while (isgraph(UC(*params)))
-		params++;
-	} else {
-	    break;
+    int result = 0;
+    struct stat sb;
+    const char *name;
+    MANIFEST *m;
+
+    if ((m = manifest_of(pathname, &name)) != NULL) {
+	result = find_manifest(m, name, info);
+    } else if (do_stat(pathname, &sb) == 0 && S_ISREG(sb.st_mode)) {
+	int fd;
+
+	if (cached_contents(&sb, info)) {
+	    result = 1;
+	} else if ((fd = open(pathname, O_RDONLY)) >= 0) {
+	    SCAN scan;
+
+	    begin_scan(&scan);
+	    scan.digesting = 1;
+	    scan_file(fd, &sb, &scan);
+	    (void) close(fd);
+	    store_cached(&sb, &scan);
+	    *info = scan.data;
+	    result = 1;
 	}
     }
-    return skip_blanks(params);
+    return result;
 }
 
-/*
- * Strip single-quotes from a name (needed for recent makepatch versions).
- */
-static void
-dequote(char *s)
+static int
+same_file(const char *source, const char *target)
 {
-    size_t len = strlen(s);
-    int delim = (*s == SQUOTE) ? SQUOTE : DQUOTE;
+    int rc = 0;
+    struct stat ssb;
+    struct stat dsb;
+    const char *name;
 
-    if (*s == delim && len > 2 && s[len - 1] == delim) {
-	int n;
+    if (manifest_of(source, &name) != NULL
+	|| manifest_of(target, &name) != NULL) {
+	CONTENTS s_info;
+	CONTENTS d_info;
 
-	for (n = 0; (s[n] = s[n + 1]) != EOS; ++n) {
-	    ;
+	rc = (file_contents(source, &s_info)
+	      && file_contents(target, &d_info)
+	      && same_contents(&s_info, &d_info));
+    } else if (do_stat(source, &ssb) == 0 && S_ISREG(ssb.st_mode)
+	&& do_stat(target, &dsb) == 0 && S_ISREG(dsb.st_mode)
+	&& ssb.st_size == dsb.st_size) {
+	int ifd;
+	int cached;
+
+	if (ssb.st_dev == dsb.st_dev && ssb.st_ino == dsb.st_ino) {
+	    rc = 1;		/* hard link, or the same file */
+	} else if ((cached = cached_same(&ssb, &dsb)) >= 0) {
+	    rc = cached;
+	} else if ((ifd = open(source, O_RDONLY)) >= 0) {
+	    int ofd = open(target, O_RDONLY);
+	    if (ofd >= 0) {
+		SCAN scan;
+
+		begin_scan(&scan);
+		rc = -1;
+#ifdef HAVE_MMAP
+		if (ssb.st_size > COUNT_BLOCK
+		    && (off_t) (size_t) ssb.st_size == ssb.st_size) {
+		    rc = same_mapped(ifd, ofd, (size_t) ssb.st_size,
+				     scan.digesting ? &scan : NULL);
+		}
+#endif
+		if (rc < 0)
+		    rc = same_blocks(ifd, ofd, scan.digesting ? &scan : NULL);
+		if (rc > 0 && scan.digesting) {
+		    end_scan(&scan);
+		    store_cached(&ssb, &scan);
+		    store_cached(&dsb, &scan);
+		}
+		(void) close(ofd);
+	    }
+	    (void) close(ifd);
 	}
-	s[len - 2] = EOS;
     }
+    return rc;
 }
 
-/*
- * Allocate a fixed-buffer
- */
 static void
-fixed_buffer(char **buffer, size_t want)
+blip(int c)
 {
-    *buffer = (char *) xmalloc(want);
+    if (ds->show_progress) {
+	(void) fflush(stdout);
+	(void) fputc(c, stderr);
+	(void) fflush(stderr);
+    }
 }
 
-/*
- * Reallocate a fixed-buffer
- */
-static void
-adjust_buffer(char **buffer, size_t want)
+#ifdef HAVE_STRDUP
+#define new_string(s) strdup(s)
+#else
+static char *
+new_string(const char *s)
 {
-    if ((*buffer = (char *) realloc(*buffer, want)) == NULL)
-	failed("realloc");
+    return strcpy((char *) xmalloc((size_t) (strlen(s) + 1)), s);
 }
+#endif
 
-/*
- * Read until newline or end-of-file, allocating the line-buffer so it is long
- * enough for the input.
- */
 static int
-get_line(char **buffer, size_t *have, FILE *fp)
+compare_data(const void *a, const void *b)
 {
-    int ch;
-    size_t used = 0;
-
-    while ((ch = MY_GETC(fp)) != EOF) {
-	if (used + 2 > *have) {
-	    adjust_buffer(buffer, *have *= 2);
-	}
-	(*buffer)[used++] = (char) ch;
-	if (ch == '\n')
-	    break;
-    }
-    (*buffer)[used] = EOS;
-    return (used != 0);
+    const DATA *p = (const DATA *) a;
+    const DATA *q = (const DATA *) b;
+    return ((p != NULL)
+	    ? ((q != NULL)
+	       ? strcmp(p->modified + p->base, q->modified + q->base)
+	       : 1)
+	    : -1);
 }
 
-static const char *
-data_filename(const DATA * p)
+static void
+init_data(DATA * data, const char *original, const char *modified, int copy, int base)
 {
-    return p ? (p->modified + (prefix_opt >= 0 ? p->base : prefix_len)) : "";
+    memset(data, 0, sizeof(*data));
+    data->original = (char *) original;
+    data->modified = (char *) modified;
+    data->copy = copy;
+    data->base = base;
+    data->cmt = Normal;
 }
 
-static int
-count_lines2(const char *filename)
+static DATA *
+new_data(const char *original, const char *modified, int base)
 {
-    int result = 0;
-    FILE *fp;
-
-    TRACE(("count_lines \"%s\"\n", filename));
-
-    if ((fp = fopen(filename, "r")) != NULL) {
-	int ch;
+    DATA *r = (DATA *) xmalloc(sizeof(DATA));
 
-	result = 0;
-	while ((ch = MY_GETC(fp)) != EOF) {
-	    if (ch == '\n')
-		++result;
-	}
-	(void) fclose(fp);
-	TRACE(("->%d lines\n", result));
-    } else {
-	(void) fflush(stdout);
-	fprintf(stderr, "Cannot open \"%s\"\n", filename);
+    if (original == NULL) {
+	TRACE(("new_data: no original for %s\n", modified));
+	original = modified;	/* FIXME */
     }
-    return result;
+    init_data(r, new_string(original), new_string(modified), 0, base);
+
+    return r;
 }
 
 /*
- * Count the (new)lines in a file, return -1 if the file is not found.
+ * When only the summary is shown, the data need not be sorted, but we still
+ * must find a filename quickly to merge its counts.  Use a hash-table rather
+ * than tsearch() for that case.
  */
-static int
-count_lines(const DATA * p)
+static size_t
+hash_part(const char *name, size_t length)
 {
-    int result = -1;
-    const char *filetail = data_filename(p);
-    size_t want = strlen(path_opt) + 2 + strlen(filetail) + strlen(p->modified);
-    int merge = 0;
-    char *filename = xmalloc(want);
+    size_t result = 2166136261U;
 
-    if (path_dest && *path_opt != EOS && *filetail != PATHSEP) {
-	size_t path_len = strlen(path_opt);
-	size_t tail_len = strlen(filetail);
-	const char *tail_sep = strchr(filetail, PATHSEP);
-	size_t n;
+    while (length-- != 0) {
+	result ^= UC(*name++);
+	result *= 16777619U;
+    }
+    return result;
+}
 
-	for (n = path_len - 1; (int) n >= 0; --n) {
-	    if ((path_len - n) > tail_len)
+#define hash_name(name) hash_part(name, strlen(name))
+
+#define HashOf(p) hash_name((p)->modified + (p)->base)
+
+static DATA *
+find_hashed(const char *name)
+{
+    DATA *result = NULL;
+
+    if (ds->hashed_size != 0) {
+	for (result = ds->hashed_data[hash_name(name) & (ds->hashed_size - 1)];
+	     result != NULL;
+	     result = result->chain) {
+	    if (!strcmp(result->modified + result->base, name))
 		break;
-	    if ((n == 0 || path_opt[n - 1] == PATHSEP)
-		&& filetail[path_len - n] == PATHSEP) {
-		if (!strncmp(path_opt + n, filetail, path_len - n)) {
-		    merge = 1;
-		    strcpy(filename, path_opt);
-		    strcpy(filename + n, filetail);
-		    break;
-		}
-	    }
 	}
+    }
+    return result;
+}
 
-	if (merge == 0 && tail_sep != NULL) {
-	    tail_len = (size_t) (tail_sep - filetail);
-	    if (tail_len != 0 && tail_len <= path_len) {
-		if (tail_len < path_len
-		    && path_opt[path_len - tail_len - 1] != PATHSEP) {
-		    merge = 0;
-		} else if (!strncmp(path_opt + path_len - tail_len,
-				    filetail,
-				    tail_len - 1)) {
-		    merge = 1;
-		    if (path_len > tail_len) {
-			sprintf(filename, "%.*s%c%s",
-				(int) (path_len - tail_len),
-				path_opt,
-				PATHSEP,
-				filetail);
-		    } else {
-			strcpy(filename, filetail);
-		    }
-		}
+static void
+add_hashed(DATA * data)
+{
+    size_t n;
+
+    if (ds->hashed_used >= ds->hashed_size) {
+	size_t old_size = ds->hashed_size;
+	DATA **old_data = ds->hashed_data;
+
+	ds->hashed_size = old_size ? (old_size * 2) : 1024;
+	ds->hashed_data = (DATA **) xmalloc(ds->hashed_size * sizeof(DATA *));
+	memset(ds->hashed_data, 0, ds->hashed_size * sizeof(DATA *));
+	for (n = 0; n < old_size; ++n) {
+	    DATA *p;
+	    DATA *q;
+
+	    for (p = old_data[n]; p != NULL; p = q) {
+		size_t m = HashOf(p) & (ds->hashed_size - 1);
+		q = p->chain;
+		p->chain = ds->hashed_data[m];
+		ds->hashed_data[m] = p;
 	    }
 	}
+	free(old_data);
     }
-    if (!merge) {
-	if (!path_opt) {
-	    strcpy(filename, p->modified);
-	} else {
-	    sprintf(filename, "%s%c%s", path_opt, PATHSEP, filetail);
+    n = HashOf(data) & (ds->hashed_size - 1);
+    data->chain = ds->hashed_data[n];
+    ds->hashed_data[n] = data;
+    ++ds->hashed_used;
+}
+
+static int
+del_hashed(const DATA * data)
+{
+    if (ds->hashed_size != 0) {
+	DATA **pp = &ds->hashed_data[HashOf(data) & (ds->hashed_size - 1)];
+
+	while (*pp != NULL) {
+	    if (*pp == data) {
+		*pp = data->chain;
+		--ds->hashed_used;
+		return 1;
+	    }
+	    pp = &((*pp)->chain);
 	}
     }
+    return 0;
+}
 
-    result = count_lines2(filename);
-    free(filename);
+/*
+ * Like add_tsearch_data(), new entries are added to the front of the list.
+ */
+static DATA *
+add_hashed_data(const char *original, const char *modified, int base)
+{
+    DATA *result;
+
+    if ((result = find_hashed(modified + base)) == NULL) {
+	result = new_data(original, modified, base);
+	add_hashed(result);
+	result->link = ds->all_data;
+	ds->all_data = result;
+    }
     return result;
 }
 
-static void
-update_chunk(DATA * p, Change change)
+#ifdef HAVE_TSEARCH
+static DATA *
+add_tsearch_data(const char *original, const char *modified, int base)
 {
-    if (merge_opt) {
-	p->pending += 1;
-	p->chunk[change] += 1;
-    } else {
-	p->count[change] += 1;
+    DATA find;
+    DATA *result;
+    void *pp;
+
+    init_data(&find, NULL, modified, 1, base);
+    if ((pp = tfind(&find, &ds->sorted_data, compare_data)) != NULL) {
+	result = *(DATA **) pp;
+	return result;
     }
+    result = new_data(original, modified, base);
+    (void) tsearch(result, &ds->sorted_data, compare_data);
+    result->link = ds->all_data;
+    ds->all_data = result;
+
+    return result;
 }
+#endif
 
-static void
-finish_chunk(DATA * p)
+static int
+count_prefix(const char *name)
 {
-    if (p->pending) {
-	int i;
-
-	p->pending = 0;
-	p->chunks += 1;
-	if (merge_opt) {
-	    /*
-	     * This is crude, but to make it really precise we would have
-	     * to keep an array of line-numbers to which which in a chunk
-	     * are marked as insert/delete.
-	     */
-	    if (p->chunk[cInsert] && p->chunk[cDelete]) {
-		long change;
-		if (p->chunk[cInsert] > p->chunk[cDelete]) {
-		    change = p->chunk[cDelete];
-		} else {
-		    change = p->chunk[cInsert];
-		}
-		p->chunk[cInsert] -= change;
-		p->chunk[cDelete] -= change;
-		p->chunk[cModify] += change;
-	    }
-	}
-	for_each_mark(i) {
-	    p->count[i] += p->chunk[i];
-	    p->chunk[i] = 0;
-	}
+    int count = 0;
+    const char *s;
+    while ((s = strchr(name, PATHSEP)) != NULL) {
+	name = s + 1;
+	++count;
     }
+    return count;
 }
 
-static char *
-copy_notabs(char *target, char *source, size_t limit)
+static const char *
+skip_prefix(const char *name, int prefix, int *base)
 {
-    char *result = NULL;
-    if (limit-- != 0) {		/* count trailing null */
-	char ch;
-	int found = 0;
-	while ((ch = *source) != EOS) {
-	    if (ch == TAB) {
-		if (found)
-		    result = source;
-		break;
-	    } else if (limit-- == 0) {
+    if (prefix >= 0) {
+	int n;
+	*base = 0;
+
+	for (n = prefix; n > 0; n--) {
+	    const char *s = strchr(name + *base, PATHSEP);
+	    if (s == NULL || *++s == EOS) {
+		name = s;
 		break;
 	    }
-	    *target++ = ch;
-	    *target = EOS;
-	    ++source;
-	    found = 1;
+	    *base = (int) (s - name);
 	}
+	TRACE(("** base set to %d\n", *base));
     }
-    return result;
+    return name;
 }
 
-static char *
-copy_graphs(char *target, char *source, size_t limit)
+/*
+ * Match a glob-pattern against the part of a pathname which ends at 'limit'.
+ * A "*" or "?" does not match a PATHSEP, but "**" does.
+ */
+static int
+glob_match(const char *pattern, const char *name, const char *limit)
 {
-    int found = 0;
-    if (limit-- != 0) {		/* count trailing null */
-	char ch;
-	while ((ch = *source) != EOS) {
-	    if (ch == TAB || ch == BLANK) {
-		break;
-	    } else if (limit-- == 0) {
-		found = 0;
-		break;
+    while (*pattern != EOS) {
+	int ch = UC(*pattern++);
+
+	switch (ch) {
+	case '*':
+	    if (*pattern == '*') {
+		while (*pattern == '*')
+		    ++pattern;
+		/* a PATHSEP after "**" may match no directories */
+		if (*pattern == PATHSEP
+		    && glob_match(pattern + 1, name, limit))
+		    return 1;
+		for (;;) {
+		    if (glob_match(pattern, name, limit))
+			return 1;
+		    if (name >= limit)
+			return 0;
+		    ++name;
+		}
 	    }
-	    *target++ = ch;
-	    *target = EOS;
-	    ++source;
-	    found = 1;
+	    for (;;) {
+		if (glob_match(pattern, name, limit))
+		    return 1;
+		if (name >= limit || *name == PATHSEP)
+		    return 0;
+		++name;
+	    }
+	case '?':
+	    if (name >= limit || *name == PATHSEP)
+		return 0;
+	    ++name;
+	    break;
+	case '[':
+	    {
+		int negate = (*pattern == '!' || *pattern == '^');
+		int found = 0;
+		int first = 1;
+
+		if (name >= limit || *name == PATHSEP)
+		    return 0;
+		if (negate)
+		    ++pattern;
+		while (*pattern != EOS && (first || *pattern != ']')) {
+		    int lo = UC(*pattern++);
+		    int hi = lo;
+		    if (*pattern == '-' && pattern[1] != EOS && pattern[1] != ']') {
+			hi = UC(pattern[1]);
+			pattern += 2;
+		    }
+		    if (UC(*name) >= lo && UC(*name) <= hi)
+			found = 1;
+		    first = 0;
+		}
+		if (*pattern++ != ']')
+		    return 0;	/* unterminated bracket */
+		if (found == negate)
+		    return 0;
+		++name;
+	    }
+	    break;
+	case BACKSL:
+	    if (*pattern != EOS)
+		ch = UC(*pattern++);
+	    /* FALLTHRU */
+	default:
+	    if (name >= limit || UC(*name) != ch)
+		return 0;
+	    ++name;
+	    break;
 	}
     }
-    return found ? source : NULL;
+    return (name == limit);
 }
 
 /*
- * Tested with git 2.11:
- * git uses dummy directory-names "a" and "b" rather than the actual working
- * directory.  Also, it allows non-printable characters, encoded in C-style
- * backslash sequences.  When those are used, it double-quotes the string.
+ * Add a pattern to the list, returning false if it is not usable.
  */
-static char *
-copy_git_name(char *target, char *source, size_t limit)
+static int
+add_pattern(PATTERN ** list, const char *text)
 {
-    int found = 0;
-    int quoted = 0;
+    PATTERN *p;
+    size_t length = strlen(text);
 
-    /*
-     * Account for double-quote.
-     */
-    if (*source == DQUOTE) {
-	quoted = 1;
-	++source;
-	limit--;
+    if (length != 0 && text[length - 1] == PATHSEP) {
+	(void) fflush(stdout);
+	fprintf(stderr, "pattern ends with separator: %s\n", text);
+	return 0;
     }
+    p = (PATTERN *) xmalloc(sizeof(PATTERN));
+    p->text = new_string(text);
+    p->length = length;
+    p->literal = !contain_any(text, "*?[\\");
+    p->parts = strstr(text, "**") ? -1 : (1 + count_prefix(text));
+    p->link = *list;
+    *list = p;
+    return 1;
+}
 
-    /*
-     * Check for the dummy directory paths, and quit if not used.
-     */
-    if (limit <= 2 || (strncmp(source, "a/", 2) && strncmp(source, "b/", 2))) {
-	limit = 0;
-    } else {
-	if (path_dest && !strncmp(source, "b/", 2)) {
-	    source += 2;	/* tweak to help with counting lines */
+static void
+free_patterns(PATTERN ** list)
+{
+    while (*list != NULL) {
+	PATTERN *next = (*list)->link;
+	free((*list)->text);
+	free(*list);
+	*list = next;
+    }
+}
+
+/*
+ * A pattern matches a pathname if it matches any sequence of its components.
+ * Patterns which are matched from the leftmost component would not work well
+ * with the prefixes (such as "a/" and "b/") used in different flavors of diff.
+ * Matching a directory matches everything below it.
+ */
+static int
+match_pattern(const PATTERN * p, const char *name)
+{
+    const char *start;
+
+    for (start = name; start != NULL; start = strchr(start, PATHSEP)) {
+	const char *limit = start;
+	int parts = 0;
+
+	if (*start == PATHSEP)
+	    ++start;
+	if (p->literal) {
+	    if (!strncmp(start, p->text, p->length)
+		&& (start[p->length] == EOS || start[p->length] == PATHSEP))
+		return 1;
+	    continue;
 	}
+	/* try the sequences of components beginning at 'start' */
+	do {
+	    if ((limit = strchr(limit + 1, PATHSEP)) == NULL)
+		limit = start + strlen(start);
+	    ++parts;
+	    if ((p->parts < 0 || p->parts == parts)
+		&& glob_match(p->text, start, limit))
+		return 1;
+	} while (*limit != EOS && (p->parts < 0 || parts < p->parts));
     }
+    return 0;
+}
 
-    if (limit-- != 0) {		/* count trailing null */
-	char ch;
-	while ((ch = *source) != EOS) {
-	    if (quoted) {
-		if (ch == DQUOTE) {
-		    if (*++source != EOS)
-			found = 0;
-		    break;
-		} else if (ch == BACKSL) {
-		    int fail = 0;
-		    if ((ch = *++source) == EOS) {
-			fail = 1;
-		    } else if (isoctal(UC(ch))) {
-			int need = 3;
-			int value = 0;
-			/* decode octal escapes into UTF-8 bytes */
-			while (need-- > 0) {
-			    if (isoctal(*source)) {
-				value <<= 3;
-				value |= (UC(*source) - '0');
-				if (need) {
-				    ++source;
-				}
-			    } else {
-				fail = 1;
-				break;
-			    }
-			}
-			ch = (char) value;
-		    } else {
-			--limit;
-			switch (ch) {
-			case BACKSL:
-			    /* FALLTHRU */
-			case DQUOTE:
-			    break;
-			case 'b':
-			    ch = '\b';
-			    break;
-			case 'n':
-			    ch = '\n';
-			    break;
-			case 'r':
-			    ch = '\r';
-			    break;
-			case 't':
-			    ch = '\t';
-			    break;
-			default:
-			    fail = 1;
-			    break;
-			}
-		    }
-		    if (fail) {
-			found = 0;
-			break;
-		    }
-		}
-	    } else if (!isprint(UC(ch))) {
-		break;
-	    }
-	    if (limit-- == 0) {
-		found = 0;
+/*
+ * Return true if the --include and --exclude options reject the pathname.
+ */
+static int
+filtered_out(const char *name)
+{
+    const PATTERN *p;
+    int result = 0;
+
+    if (ds->include_opt != NULL) {
+	result = 1;
+	for (p = ds->include_opt; p != NULL; p = p->link) {
+	    if (match_pattern(p, name)) {
+		result = 0;
 		break;
 	    }
-	    *target++ = ch;
-	    *target = EOS;
-	    ++source;
-	    found = 1;
 	}
     }
-    return found ? source : NULL;
-}
-
-/* perforce */
-static char *
-copy_p4_name(char *target, char *source, size_t limit)
-{
-    int found = 0;
-    if (limit-- != 0) {		/* count trailing null */
-	char ch;
-	while ((ch = *source) != EOS) {
-	    if (ch == TAB || ch == BLANK || ch == '#') {
-		break;
-	    } else if (limit-- == 0) {
-		found = 0;
-		break;
-	    }
-	    *target++ = ch;
-	    *target = EOS;
-	    ++source;
-	    found = 1;
+    for (p = ds->exclude_opt; p != NULL && !result; p = p->link) {
+	if (match_pattern(p, name)) {
+	    TRACE(("** excluded %s by %s\n", name, p->text));
+	    result = 1;
 	}
     }
-    return found ? source : NULL;
+    return result;
 }
 
-static char *
-copy_integer(int *target, const char *source)
+/*
+ * Check a pathname against the --include and --exclude options, after
+ * applying the -p option.
+ */
+static int
+filtered_name(const char *name)
 {
-    char *next = NULL;
-    long value = strtol(source, &next, 10);
-    *target = (int) value;
-    return next;
-}
+    int base = 0;
 
-static char *
-need_blanks(char *source)
-{
-    int found = 0;
-    while (*source != EOS) {
-	char ch = *source++;
-	if (ch == BLANK || ch == TAB)
-	    found = 1;
+    if (ds->prefix_opt >= 0) {
+	(void) skip_prefix(name, ds->prefix_opt, &base);
     }
-    return found ? source : NULL;
+    return filtered_out(name + base);
 }
 
-static char *
-need_graphs(char *source)
+/*
+ * Files which are filtered out share a single entry which is not in the list
+ * of data.  It holds the name so that merging works as if the file had been
+ * counted, but its counts are discarded.
+ */
+static DATA *
+excluded_data(const char *original, const char *modified, int base)
 {
-    char *result = NULL;
-    int found = 0;
-    while (*source != EOS) {
-	char ch = *source;
-	if (ch == BLANK || ch == TAB || ch == EOS) {
-	    if (found)
-		result = source;
-	    break;
-	}
-	++source;
-	found = 1;
-    }
-    return result;
+    char *old_original = ds->excluded.original;
+    char *old_modified = ds->excluded.modified;
+
+    /* the new names may be derived from the old ones */
+    init_data(&ds->excluded,
+	      new_string(original ? original : modified),
+	      new_string(modified),
+	      0,
+	      base);
+    free(old_original);
+    free(old_modified);
+    return &ds->excluded;
 }
 
-static char *
-need_nospcs(char *source)
+static DATA *
+find_data(const char *original, const char *modified)
 {
-    char *result = NULL;
-    int found = 0;
-    while (*source != EOS) {
-	char ch = *source;
-	if (ch == BLANK || ch == EOS) {
-	    if (found)
-		result = source;
-	    break;
-	}
-	++source;
-	found = 1;
+    DATA *r;
+    int base = 0;
+
+    TRACE(("** find_data(%s => %s)\n", NonNull(original), NonNull(modified)));
+
+    /* Compute the base offset if the prefix option is used */
+    if (ds->prefix_opt >= 0) {
+	(void) skip_prefix(modified, ds->prefix_opt, &base);
     }
-    return result;
-}
 
-/* this is used with SVN */
-static char *
-need_parens(char *source)
-{
-    char *result = NULL;
-    if (*source++ == LPAREN) {
-	while (*source != EOS) {
-	    if (*source++ == RPAREN) {
-		result = source;
-		break;
-	    }
-	}
+    if (filtered_out(modified + base)) {
+	return excluded_data(original, modified, base);
     }
-    return result;
-}
 
-#define date_delims(a,b) (((a)=='/' && (b)=='/') || ((a) == '-' && (b) == '-'))
-#define CASE_TRACE() TRACE(("** handle case for '%c' %d:%s\n", *buffer, ok, that ? that->modified : ""))
+    /* Insert into sorted list (usually sorted).  If we are not sorting or
+     * merging names, we fall off the end and link the new entry to the end of
+     * the list.  If the prefix option is used, the prefix is ignored by the
+     * merge and sort operations.
+     *
+     * If we have tsearch(), we will maintain the sorted list using it and
+     * tfind().
+     */
+#ifdef HAVE_TSEARCH
+    if (ds->use_tsearch) {
+	r = add_tsearch_data(original, modified, base);
+    } else
+#endif
+    if (ds->use_hashing) {
+	r = add_hashed_data(original, modified, base);
+    } else {
+	DATA *p;
+	DATA find;
+	DATA *q;
 
-static void
-do_file(FILE *fp, const char *default_name)
-{
-    static const char *only_stars = "***************";
+	init_data(&find, original, modified, 1, base);
+	for (p = ds->all_data, q = NULL; p != NULL; q = p, p = p->link) {
+	    int cmp = compare_data(p, &find);
+	    if (ds->merge_names && (cmp == 0))
+		return p;
+	    if (ds->sort_names && (cmp > 0))
+		break;
+	}
+	r = new_data(original, modified, base);
+	if (q != NULL)
+	    q->link = r;
+	else
+	    ds->all_data = r;
 
-    DATA dummy;
-    DATA *that = &dummy;
-    DATA *prev = NULL;
-    char *buffer = NULL;
-    char *b_fname = NULL;
-    size_t length = 0;
-    size_t fixed = 0;
-    int ok = HAVE_NOTHING;
-    int marker;
-    int freed = 0;
+	r->link = p;
+    }
 
-    int unified = 0;
-    int old_unify = 0;
-    int new_unify = 0;
-    int expect_unify = 0;
+    return r;
+}
 
-    long old_dft = 0;
-    long new_dft = 0;
+/*
+ * Remove a unneeded data item from the linked list.  Free the name as well.
+ */
+static int
+delink(DATA * data)
+{
+    DATA *p, *q;
 
-    int context = 1;
-    int either = 0;
+    TRACE(("** delink '%s'\n", data->modified));
 
-    int first_ch;
-    int git_diff = 0;
+    if (data == &ds->excluded)
+	return 0;
 
-    char *s;
-#if OPT_TRACE
-    int line_no = 0;
+#ifdef HAVE_TSEARCH
+    if (ds->use_tsearch) {
+	if (tdelete(data, &ds->sorted_data, compare_data) == NULL)
+	    return 0;
+    }
 #endif
-
-    init_data(&dummy, "", "", 1, 0);
-
-    fixed_buffer(&buffer, fixed = length = BUFSIZ);
-    fixed_buffer(&b_fname, length);
-
-    while (get_line(&buffer, &length, fp)) {
-	/*
-	 * Adjust size of fixed-buffers so that a sscanf cannot overflow.
-	 */
-	if (length > fixed) {
-	    fixed = length;
-	    adjust_buffer(&b_fname, length);
-	}
-
-	/*
-	 * Trim trailing newline.
-	 */
-	for (s = buffer + strlen(buffer); s != buffer; s--) {
-	    if ((UC(s[-1]) == '\n') || (UC(s[-1]) == '\r'))
-		s[-1] = EOS;
+    if (ds->use_hashing) {
+	if (!del_hashed(data))
+	    return 0;
+    }
+    for (p = ds->all_data, q = NULL; p != NULL; q = p, p = p->link) {
+	if (p == data) {
+	    if (q != NULL)
+		q->link = p->link;
 	    else
-		break;
-	}
-
-	/*
-	 * Trim escapes from colordiff.
-	 */
-#define isFINAL(c) (UC(*s) >= '\140' && UC(*s) <= '\176')
-	if (trim_escapes && (strchr(buffer, '\033') != NULL)) {
-	    char *d = buffer;
-	    s = d;
-	    while (*s != EOS) {
-		if (*s == '\033') {
-		    while (*s != EOS && !isFINAL(*s)) {
-			++s;
-		    }
-		    if (*s != EOS) {
-			++s;
-			continue;
-		    } else {
-			break;
-		    }
-		}
-		*d++ = *s++;
+		ds->all_data = p->link;
+	    if (!p->copy) {
+		free(p->original);
+		free(p->modified);
 	    }
-	    *d = EOS;
+	    free(p);
+	    return 1;
 	}
-	++line_no;
-	TRACE(("[%05d] %s\n", line_no, buffer));
+    }
+    return 0;
+}
 
-	/*
-	 * "patch -U" can create ".rej" files lacking a filename header,
-	 * in unified format.  Check for those.
-	 */
-	if (line_no == 1 && !strncmp(buffer, "@@", (size_t) 2)) {
-	    unified = 2;
-	    that = find_data(default_name, default_name);
-	    ok = begin_data(that);
+/*
+ * Compare string 's' against a constant, returning either a pointer just
+ * past the matched part of 's' if it matches exactly, or null if a mismatch
+ * was found.
+ */
+static char *
+match(char *s, const char *p)
+{
+    int ok = 0;
+
+    while (*s != EOS) {
+	if (*p == EOS) {
+	    ok = 1;
+	    break;
+	}
+	if (*s++ != *p++)
+	    break;
+	if (*s == EOS && *p == EOS) {
+	    ok = 1;
+	    break;
 	}
+    }
+    return ok ? s : NULL;
+}
 
-	/*
-	 * The lines identifying files in a context diff depend on how it was
-	 * invoked.  But after the header, each chunk begins with a line
-	 * containing 15 *'s.  Each chunk may contain a line-range with '***'
-	 * for the "before", and a line-range with '---' for the "after".  The
-	 * part of the chunk depicting the deletion may be absent, though the
-	 * edit line is present.
-	 *
-	 * The markers for unified diff are a little different from the normal
-	 * context-diff.  Also, the edit-lines in a unified diff won't have a
-	 * space in column 2.  Because of the missing space, we have to count
-	 * lines to ensure we do not confuse the marker lines.
-	 */
-	marker = 0;
-	if (that != &dummy && !strcmp(buffer, only_stars)) {
-	    finish_chunk(that);
-	    TRACE(("** begin context chunk\n"));
-	    context = 2;
-	} else if (line_no == 1 && !strcmp(buffer, only_stars)) {
-	    TRACE(("** begin context chunk\n"));
-	    context = 2;
-	    that = find_data(default_name, default_name);
-	    ok = begin_data(that);
-	} else if (context == 2 && match(buffer, "*** ")) {
-	    context = 1;
-	} else if (context == 1 && match(buffer, "--- ")) {
-	    marker = 1;
-	    context = 0;
-	} else if (match(buffer, "*** ")) {
-	} else if ((old_unify + new_unify) == 0 && match(buffer, "==== ")) {
-	    finish_chunk(that);
-	    unified = 2;
-	} else if ((old_unify + new_unify) == 0 && match(buffer, "--- ")) {
-	    finish_chunk(that);
-	    marker = unified = 1;
-	} else if ((old_unify + new_unify) == 0 && match(buffer, "+++ ")) {
-	    marker = unified = 2;
-	} else if (unified == 2
-		   || ((old_unify + new_unify) == 0 && (*buffer == '@'))) {
-	    finish_chunk(that);
-	    unified = 0;
-	    if (*buffer == '@') {
-		int old_base, new_base;
-		int old_size = 0;
-		int new_size = 0;
-		char *sp;
-
-		old_unify = new_unify = 0;
-		if ((sp = match(buffer, "@@ -")) != NULL
-		    && (sp = decode_range(sp, &old_base, &old_size)) != NULL
-		    && (sp = match(sp, " +")) != NULL
-		    && (sp = decode_range(sp, &new_base, &new_size)) != NULL
-		    && match(sp, " @") != NULL) {
-		    old_unify = old_size;
-		    new_unify = new_size;
-		    unified = -1;
-		}
-	    }
-	} else if (unified == 1 && !context) {
-	    /*
-	     * If unified==1, we guessed we would find a "+++" line, but since
-	     * we are here, we did not find that.  The context check ensures
-	     * we do not mistake the "---" for a unified diff with that for
-	     * a context diff's "after" line-range.
-	     *
-	     * If we guessed wrong, then we probably found a data line with
-	     * "--" in the first two columns of the diff'd file.
-	     */
-	    unified = 0;
-	    TRACE(("?? Expected \"+++\" for unified diff\n"));
-	    if (prev != NULL
-		&& prev != that
-		&& InsOf(that) == 0
-		&& DelOf(that) == 0
-		&& strcmp(prev->modified, that->modified)) {
-		TRACE(("?? giveup on %ld/%ld %s\n", InsOf(that),
-		       DelOf(that), that->modified));
-		TRACE(("?? revert to %ld/%ld %s\n", InsOf(prev),
-		       DelOf(prev), prev->modified));
-		(void) delink(that);
-		that = prev;
-		update_chunk(that, cDelete);
+static int
+version_num(const char *s)
+{
+    int main_ver, sub_ver;
+    char temp[2];
+    return (sscanf(s, "%d.%d%c", &main_ver, &sub_ver, temp) == 2);
+}
+
+/*
+ * Check for a range of line-numbers, used in editing scripts.
+ */
+static int
+edit_range(const char *s)
+{
+    int first, last;
+    char temp[2];
+    return (sscanf(s, "%d,%d%c", &first, &last, temp) == 2)
+	|| (sscanf(s, "%d%c", &first, temp) == 1);
+}
+
+/*
+ * Decode a range for default diff.
+ */
+static int
+decode_default(const char *s,
+	       long *first, long *first_size,
+	       long *second, long *second_size)
+{
+    int rc = 0;
+    char *next;
+
+    if (isdigit(UC(*s))) {
+	*first_size = 1;
+	*second_size = 1;
+
+	*first = strtol(s, &next, 10);
+	if (next != NULL && next != s) {
+	    if (*next == ',') {
+		s = ++next;
+		*first_size = strtol(s, &next, 10) + 1 - *first;
 	    }
-	} else if (old_unify + new_unify) {
-	    switch (*buffer) {
-	    case '-':
-		if (old_unify)
-		    --old_unify;
-		break;
-	    case '+':
-		if (new_unify)
-		    --new_unify;
-		break;
-	    case EOS:
-	    case ' ':
-		if (old_unify)
-		    --old_unify;
-		if (new_unify)
-		    --new_unify;
+	}
+	if (next != NULL && next != s) {
+	    switch (*next++) {
+	    case 'a':
+	    case 'c':
+	    case 'd':
+		s = next;
+		next = NULL;
+		*second = strtol(s, &next, 10);
+		if (next != NULL && next != s) {
+		    if (*next == ',') {
+			s = ++next;
+			*second_size = strtol(s, &next, 10) + 1 - *second;
+		    }
+		}
+		if (next != NULL && next != s && *next == EOS)
+		    rc = 1;
 		break;
-	    case BACKSL:
-		if (strstr(buffer, "newline") != NULL) {
+	    }
+	}
+    }
+    return rc;
+}
+
+/*
+ * Decode a range for unified diff.  Oddly, the comments in diffutils code
+ * claim that both numbers are line-numbers.  However, inspection of the output
+ * shows that the numbers are a line-number followed by a count.
+ */
+static char *
+decode_range(char *s, int *first, int *second)
+{
+    if (isdigit(UC(*s))) {
+	int count = 0;
+	int value[2];
+
+	value[0] = 0;
+	value[1] = 0;
+	while (*s != EOS) {
+	    int ch = UC(*s);
+	    if (isdigit(ch)) {
+		value[count] = (10 * value[count]) + (ch - '0');
+	    } else if (ch == ',') {
+		if (++count > 1) {
+		    s = NULL;
 		    break;
 		}
-		/* FALLTHRU */
-	    default:
-		TRACE(("?? expected more in chunk\n"));
-		old_unify = new_unify = 0;
+		value[count] = 0;
+	    } else {
 		break;
 	    }
-	    if (!(old_unify + new_unify)) {
-		expect_unify = 2;
+	    ++s;
+	}
+	if (s != NULL) {
+	    *first = value[0];
+	    if (count == 0) {
+		*second = 1;
+	    } else {
+		*second = value[1];
+	    }
+#if OPT_TRACE
+	    if (*second) {
+		TRACE(("** decode_range [%d..%d]\n",
+		       *first, *first + *second - 1));
+	    } else {
+		TRACE(("** decode_range [%d]\n",
+		       *first));
 	    }
-	} else {
-	    long old_base, new_base;
+#endif
+	}
+    }
+    return s;
+}
+
+static int
+HadDiffs(const DATA * data)
+{
+    return InsOf(data) != 0
+	|| DelOf(data) != 0
+	|| ModOf(data) != 0
+	|| data->cmt != Normal;
+}
+
+/*
+ * If the given path is not one of the "ignore" paths, then return true.
+ */
+static int
+can_be_merged(const char *path)
+{
+    int result = 0;
+    if (strcmp(path, "")
+	&& strcmp(path, "/dev/null"))
+	result = 1;
+    return result;
+}
+
+static int
+is_leaf(const char *theLeaf, const char *path)
+{
+    const char *s;
+
+    if (strchr(theLeaf, PATHSEP) == NULL
+	&& (s = strrchr(path, PATHSEP)) != NULL
+	&& !strcmp(++s, theLeaf))
+	return 1;
+    return 0;
+}
+
+static char *
+trim_datapath(DATA ** datap, size_t length, int *localp)
+{
+    char *target = (*datap)->modified;
+
+    /*
+     * If we are using tsearch(), make a local copy of the data
+     * so we can trim it without interfering with tsearch's
+     * notion of the ordering of data.  That will create some
+     * spurious empty data, so we add the changed() macro in a
+     * few places to skip over those.  The hash-table has the
+     * same constraint.
+     */
+#ifdef HAVE_TSEARCH
+    if (ds->use_tsearch || ds->use_hashing) {
+#else
+    if (ds->use_hashing) {
+#endif
+	char *trim = new_string(target);
+	if (trim != NULL) {
+	    int base = (*datap)->base;
+
+	    trim[length] = EOS;
+	    if ((size_t) base <= length && filtered_out(trim + base))
+		*datap = excluded_data(NULL, trim, base);
+	    else
+#ifdef HAVE_TSEARCH
+	    if (ds->use_tsearch)
+		*datap = add_tsearch_data(NULL, trim, base);
+	    else
+#endif
+		*datap = add_hashed_data(NULL, trim, base);
+	    target = (*datap)->modified;
+	    free(trim);
+	    *localp = 1;
+	}
+    } else {
+	target[length] = EOS;
+    }
+
+    return target;
+}
+
+static size_t
+compare_tails(const char *target, const char *source, int *diff)
+{
+    size_t len1 = strlen(target);
+    size_t len2 = strlen(source);
+    size_t n;
+    size_t matched = 0;
+
+    *diff = 0;
+    for (n = 1; n <= len1 && n <= len2; n++) {
+	if (target[len1 - n] != source[len2 - n]) {
+	    *diff = (int) n;
+	    break;
+	}
+	if (source[len2 - n] == PATHSEP) {
+	    matched = n;
+	}
+    }
+    return matched;
+}
+
+/*
+ * The 'data' parameter points to the first of two markers, while
+ * 'path' is the pathname from the second marker.
+ *
+ * On the first call for
+ * a given file, the 'data' parameter stores no differences.
+ */
+static char *
+do_merging(DATA * data, char *path, int *freed)
+{
+    char *target = ds->reverse_opt ? path : data->modified;
+    char *source = ds->reverse_opt ? data->modified : path;
+    char *result = source;
+    int diff;
+
+    TRACE(("** do_merging(\"%s\" -> \"%s\",\"%s\") diffs:%d\n",
+	   NonNull(data->original),
+	   NonNull(data->modified),
+	   path, HadDiffs(data)));
+
+    *freed = 0;
+    if (!HadDiffs(data)) {
+
+	if (is_leaf(target, source)) {
+	    TRACE(("** is_leaf: \"%s\" vs \"%s\"\n", target, source));
+	    if (ds->reverse_opt) {
+		TRACE((".. no action @%d\n", __LINE__));
+	    } else {
+		TRACE((".. will delink @%d\n", __LINE__));
+		*freed = delink(data);
+	    }
+	} else if (can_be_merged(target)
+		   && can_be_merged(source)) {
+	    size_t len1 = strlen(target);
+	    size_t len2 = strlen(source);
+	    int local = 0;
+
+	    /*
+	     * If the source/target differ only by some suffix, e.g., ".orig"
+	     * or ".bak", strip that off.  The target may may also be a
+	     * temporary filename (which would not be merged since it has no
+	     * apparent relationship to the current).
+	     */
+	    if (len1 > len2) {
+		if (!strncmp(target, source, len2)) {
+		    TRACE(("** trimming data \"%s\" to \"%.*s\"\n",
+			   target, (int) len2, target));
+		    if (ds->reverse_opt) {
+			TRACE((".. no action @%d\n", __LINE__));
+		    } else {
+			target = trim_datapath(&data, len2, &local);
+		    }
+		}
+	    } else if (len1 < len2) {
+		if (!strncmp(target, source, len1)) {
+		    TRACE(("** trimming source \"%s\" to \"%.*s\"\n",
+			   source, (int) len1, source));
+		    if (ds->reverse_opt) {
+			TRACE((".. no action @%d\n", __LINE__));
+		    } else {
+			source[len2 = len1] = EOS;
+		    }
+		}
+	    }
+
+	    /*
+	     * If there was no "-p" option, look for the best match by
+	     * stripping prefixes from both source/target strings.
+	     */
+	    if (ds->prefix_opt < 0) {
+		int matched = 0;
+		/*
+		 * Now (whether or not we trimmed a suffix), scan back from the
+		 * end of source/target strings to find if they happen to share
+		 * a common ending, e.g., a/b/c versus d/b/c.  If the strings
+		 * are not identical, then 'diff' will be set, but if they have
+		 * a common ending then 'matched' will be set.
+		 */
+		diff = 0;
+		matched = (int) compare_tails(target, source, &diff);
+
+		TRACE(("** merge @%d, prefix_opt=%d matched=%d diff=%d\n",
+		       __LINE__, ds->prefix_opt, matched, diff));
+		if (matched != 0 && diff) {
+		    if (ds->reverse_opt) {
+			TRACE((".. no action @%d\n", __LINE__));
+		    } else {
+			result = source + ((int) len2 - matched + 1);
+		    }
+		}
+	    }
+
+	    if (!local) {
+		if (ds->reverse_opt) {
+		    TRACE((".. no action @%d\n", __LINE__));
+		} else {
+		    TRACE((".. will delink @%d\n", __LINE__));
+		    *freed = delink(data);
+		}
+	    }
+	} else if (ds->reverse_opt) {
+	    TRACE((".. no action @%d\n", __LINE__));
+	    if (can_be_merged(source)) {
+		TRACE(("** merge @%d\n", __LINE__));
+	    } else {
+		TRACE(("** do not merge, retain @%d\n", __LINE__));
+		/* must not merge, retain existing name */
+		result = target;
+	    }
+	} else {
+	    if (can_be_merged(source)) {
+		TRACE(("** merge @%d\n", __LINE__));
+		*freed = delink(data);
+	    } else {
+		TRACE(("** do not merge, retain @%d\n", __LINE__));
+		/* must not merge, retain existing name */
+		result = target;
+	    }
+	}
+    } else if (ds->reverse_opt) {
+	TRACE((".. no action @%d\n", __LINE__));
+	if (can_be_merged(source)) {
+	    TRACE(("** merge @%d\n", __LINE__));
+	    result = target;
+	} else {
+	    TRACE(("** do not merge, retain @%d\n", __LINE__));
+	}
+    } else {
+	if (can_be_merged(source)) {
+	    TRACE(("** %smerge @%d\n", ds->merge_names ? "" : "do not ", __LINE__));
+	    if (ds->merge_names
+		&& *target != EOS
+		&& ds->prefix_opt < 0) {
+		size_t matched = compare_tails(target, source, &diff);
+		if (matched && !diff)
+		    result = target + (int) (strlen(target) - matched);
+	    }
+	} else {
+	    TRACE(("** do not merge, retain @%d\n", __LINE__));
+	    result = target;
+	}
+    }
+    TRACE(("** finish do_merging ->\"%s\"\n", result));
+    return result;
+}
+
+static int
+begin_data(const DATA * p)
+{
+    TRACE(("...begin_data(\"%s\" -> \"%s\")\n",
+	   NonNull(p->original),
+	   NonNull(p->modified)));
+
+    if (!can_be_merged(p->modified)
+	&& strchr(p->modified, PATHSEP) != NULL) {
+	TRACE(("** begin_data:HAVE_PATH\n"));
+	return HAVE_PATH;
+    }
+    TRACE(("** begin_data:HAVE_GENERIC\n"));
+    return HAVE_GENERIC;
+}
+
+static char *
+skip_blanks(char *s)
+{
+    while (isspace(UC(*s)))
+	++s;
+    return s;
+}
+
+/*
+ * Skip a filename, which may be in quotes, to allow embedded blanks in the
+ * name.
+ */
+static char *
+skip_filename(char *s)
+{
+    int delim = (*s == SQUOTE) ? SQUOTE : DQUOTE;
+
+    if ((*s == delim) && (s[1] != EOS) && (strchr) (s + 1, delim) != NULL) {
+	++s;
+	while (*s != EOS && (*s != delim) && isprint(UC(*s))) {
+	    ++s;
+	}
+	++s;
+    } else {
+	while (*s != EOS && isgraph(UC(*s))) {
+	    ++s;
+	}
+    }
+    return s;
+}
+
+static char *
+skip_options(char *params)
+{
+    while (*params != EOS) {
+	params = skip_blanks(params);
+	if (*params == '-') {
+	    while (isgraph(UC(*params)))
+		params++;
+	} else {
+	    break;
+	}
+    }
+    return skip_blanks(params);
+}
+
+/*
+ * Strip single-quotes from a name (needed for recent makepatch versions).
+ */
+static void
+dequote(char *s)
+{
+    size_t len = strlen(s);
+    int delim = (*s == SQUOTE) ? SQUOTE : DQUOTE;
+
+    if (*s == delim && len > 2 && s[len - 1] == delim) {
+	int n;
+
+	for (n = 0; (s[n] = s[n + 1]) != EOS; ++n) {
+	    ;
+	}
+	s[len - 2] = EOS;
+    }
+}
+
+/*
+ * Allocate a fixed-buffer
+ */
+static void
+fixed_buffer(char **buffer, size_t want)
+{
+    *buffer = (char *) xmalloc(want);
+}
+
+/*
+ * Reallocate a fixed-buffer
+ */
+static void
+adjust_buffer(char **buffer, size_t want)
+{
+    if ((*buffer = (char *) realloc(*buffer, want)) == NULL)
+	failed("realloc");
+}
+
+static void
+init_input(INPUT * ip, int fd)
+{
+    memset(ip, 0, sizeof(*ip));
+    ip->fd = fd;
+    fixed_buffer(&ip->data, ip->size = READ_BLOCK);
+}
+
+static void
+free_input(INPUT * ip)
+{
+    free(ip->data);
+    ip->data = NULL;
+}
+
+/*
+ * Read another block, appending to any data which has not been used yet.
+ * Return the number of bytes added, which is zero at end-of-file.  There is
+ * no file for the data given by diffstat_push(), so nothing is read.
+ */
+static size_t
+more_input(INPUT * ip)
+{
+    size_t result = 0;
+
+    if (ip->next != 0) {
+	ip->used -= ip->next;
+	memmove(ip->data, ip->data + ip->next, ip->used);
+	ip->next = 0;
+    }
+    if (ip->used < ip->size && ip->fd >= 0) {
+	ssize_t got;
+
+	do {
+	    got = read(ip->fd, ip->data + ip->used, ip->size - ip->used);
+	} while (got < 0 && errno == EINTR);
+	if (got > 0) {
+	    result = (size_t) got;
+	    ip->used += result;
+	}
+    }
+    return result;
+}
+
+/*
+ * Read until newline or end-of-file, allocating the line-buffer so it is long
+ * enough for the input.
+ */
+static int
+get_line(char **buffer, size_t *have, INPUT * ip)
+{
+    size_t used = 0;
+
+    for (;;) {
+	const char *from;
+	const char *eol;
+	size_t take;
+
+	if (ip->next >= ip->used && !more_input(ip))
+	    break;
+	from = ip->data + ip->next;
+	take = ip->used - ip->next;
+	if ((eol = memchr(from, '\n', take)) != NULL)
+	    take = (size_t) (eol + 1 - from);
+	if (used + take + 1 > *have) {
+	    while (used + take + 1 > *have)
+		*have *= 2;
+	    adjust_buffer(buffer, *have);
+	}
+	memcpy(*buffer + used, from, take);
+	used += take;
+	ip->next += take;
+	if (eol != NULL)
+	    break;
+    }
+    (*buffer)[used] = EOS;
+    return (used != 0);
+}
+
+static const char *
+data_filename(const DATA * p)
+{
+    return (p
+	    ? (p->modified + (ds->prefix_opt >= 0 ? p->base : ds->prefix_len))
+	    : "");
+}
+
+/*
+ * Look for the newline-count of a file in a manifest or the cache, returning
+ * true if it is known without reading the file.  If it is not, and the cache
+ * is used, the file's status is left in *sb.
+ */
+static int
+known_file_lines(const char *filename, struct stat *sb, int *result)
+{
+    int found = 0;
+    CONTENTS info;
+    const char *name;
+    MANIFEST *m;
+
+    if ((m = manifest_of(filename, &name)) != NULL) {
+	*result = find_manifest(m, name, &info) ? (int) info.lines : -1;
+	TRACE(("->%d lines (manifest)\n", *result));
+	found = 1;
+    } else if (ds->cache_opt != NULL
+	       && stat(filename, sb) == 0
+	       && cached_contents(sb, &info)) {
+	*result = (int) info.lines;
+	TRACE(("->%d lines (cached)\n", *result));
+	found = 1;
+    }
+    return found;
+}
+
+/*
+ * For --estimate-unchanged, extrapolate the newlines in a large file from
+ * those in its first block.
+ */
+static int
+estimate_lines(int fd, const struct stat *sb)
+{
+    char buffer[SAMPLE_BLOCK];
+    size_t have = read_block(fd, buffer, sizeof(buffer));
+    double lines = 0.0;
+
+    if (have != 0) {
+	long found = count_newlines(buffer, have);
+	lines = (double) found * (double) sb->st_size / (double) have;
+    }
+    return (int) (lines + 0.5);
+}
+
+/*
+ * Count the newlines in a file, returning -1 if it cannot be opened.  Set
+ * *estimated if the count was extrapolated by --estimate-unchanged.
+ */
+static int
+count_file_lines(const char *filename, int *estimated)
+{
+    int result = -1;
+    int fd;
+    struct stat sb;
+
+    *estimated = 0;
+    TRACE(("count_lines \"%s\"\n", filename));
+
+    if (known_file_lines(filename, &sb, &result)) {
+	;
+    } else if ((fd = open(filename, O_RDONLY)) >= 0) {
+	int have_stat = (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode));
+
+	if (ds->estimate_opt && have_stat && sb.st_size > SAMPLE_BLOCK) {
+	    result = estimate_lines(fd, &sb);
+	    *estimated = 1;
+	    TRACE(("->%d lines (estimated)\n", result));
+	} else {
+	    SCAN scan;
+
+	    begin_scan(&scan);
+	    scan_file(fd, have_stat ? &sb : NULL, &scan);
+	    if (have_stat)
+		store_cached(&sb, &scan);
+	    result = (int) scan.data.lines;
+	    TRACE(("->%d lines\n", result));
+	}
+	(void) close(fd);
+    }
+    return result;
+}
+
+static void
+cannot_open(const char *filename)
+{
+    (void) fflush(stdout);
+    fprintf(stderr, "Cannot open \"%s\"\n", filename);
+}
+
+static int
+count_lines2(const char *filename, int *estimated)
+{
+    int result = count_file_lines(filename, estimated);
+
+    if (result < 0) {
+	cannot_open(filename);
+	result = 0;
+    }
+    return result;
+}
+
+/*
+ * Tell the system that we will soon read the given file, so that it can
+ * start fetching the data while we are busy with other files.  Only regular
+ * files are opened, since opening a pipe could block, or lose its reader.
+ */
+static void
+will_need(const char *filename)
+{
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED) && defined(HAVE_FCNTL_H)
+    struct stat sb;
+    int fd;
+
+    if (stat(filename, &sb) == 0
+	&& S_ISREG(sb.st_mode)
+	&& (fd = open(filename, O_RDONLY | O_NONBLOCK)) >= 0) {
+	/* the file may have been replaced since stat() */
+	if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode)) {
+	    TRACE(("will_need \"%s\"\n", filename));
+	    (void) posix_fadvise(fd, (off_t) 0, (off_t) 0, POSIX_FADV_WILLNEED);
+	}
+	(void) close(fd);
+    }
+#else
+    (void) filename;
+#endif
+}
+
+/*
+ * Construct the name of the file in the -S/-D directory which corresponds to
+ * the given data.
+ */
+static char *
+resolve_name(const DATA * p)
+{
+    const char *filetail = data_filename(p);
+    size_t want = (strlen(ds->path_opt) + 2
+		   + strlen(filetail)
+		   + strlen(p->modified));
+    int merge = 0;
+    char *filename = xmalloc(want);
+
+    if (ds->path_dest && *ds->path_opt != EOS && *filetail != PATHSEP) {
+	size_t path_len = strlen(ds->path_opt);
+	size_t tail_len = strlen(filetail);
+	const char *tail_sep = strchr(filetail, PATHSEP);
+	size_t n;
+
+	for (n = path_len - 1; (int) n >= 0; --n) {
+	    if ((path_len - n) > tail_len)
+		break;
+	    if ((n == 0 || ds->path_opt[n - 1] == PATHSEP)
+		&& filetail[path_len - n] == PATHSEP) {
+		if (!strncmp(ds->path_opt + n, filetail, path_len - n)) {
+		    merge = 1;
+		    strcpy(filename, ds->path_opt);
+		    strcpy(filename + n, filetail);
+		    break;
+		}
+	    }
+	}
+
+	if (merge == 0 && tail_sep != NULL) {
+	    tail_len = (size_t) (tail_sep - filetail);
+	    if (tail_len != 0 && tail_len <= path_len) {
+		if (tail_len < path_len
+		    && ds->path_opt[path_len - tail_len - 1] != PATHSEP) {
+		    merge = 0;
+		} else if (!strncmp(ds->path_opt + path_len - tail_len,
+				    filetail,
+				    tail_len - 1)) {
+		    merge = 1;
+		    if (path_len > tail_len) {
+			sprintf(filename, "%.*s%c%s",
+				(int) (path_len - tail_len),
+				ds->path_opt,
+				PATHSEP,
+				filetail);
+		    } else {
+			strcpy(filename, filetail);
+		    }
+		}
+	    }
+	}
+    }
+    if (!merge) {
+	if (!ds->path_opt) {
+	    strcpy(filename, p->modified);
+	} else {
+	    sprintf(filename, "%s%c%s", ds->path_opt, PATHSEP, filetail);
+	}
+    }
+
+    return filename;
+}
+
+#if USE_THREADS
+static pthread_mutex_t refs_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define LockRefs()   pthread_mutex_lock(&refs_mutex)
+#define UnlockRefs() pthread_mutex_unlock(&refs_mutex)
+#else
+#define LockRefs()		/* nothing */
+#define UnlockRefs()		/* nothing */
+#endif
+
+static REF_DIR *
+find_ref_dir(const char *name, size_t length, size_t hash)
+{
+    REF_DIR *result = NULL;
+
+    if (ds->ref_size != 0) {
+	for (result = ds->ref_dirs[hash & (ds->ref_size - 1)];
+	     result != NULL;
+	     result = result->link) {
+	    if (result->length == length
+		&& !memcmp(result->name, name, length))
+		break;
+	}
+    }
+    return result;
+}
+
+static REF_DIR *
+add_ref_dir(const char *name, size_t length, size_t hash, const char *lead)
+{
+    REF_DIR *result = (REF_DIR *) xmalloc(sizeof(REF_DIR));
+    size_t n;
+
+    if (ds->ref_used >= ds->ref_size) {
+	size_t old_size = ds->ref_size;
+	REF_DIR **old_dirs = ds->ref_dirs;
+
+	ds->ref_size = old_size ? (old_size * 2) : 256;
+	ds->ref_dirs = (REF_DIR **) xmalloc(ds->ref_size * sizeof(REF_DIR *));
+	memset(ds->ref_dirs, 0, ds->ref_size * sizeof(REF_DIR *));
+	for (n = 0; n < old_size; ++n) {
+	    REF_DIR *q;
+	    REF_DIR *next;
+
+	    for (q = old_dirs[n]; q != NULL; q = next) {
+		size_t m = hash_part(q->name, q->length) & (ds->ref_size - 1);
+		next = q->link;
+		q->link = ds->ref_dirs[m];
+		ds->ref_dirs[m] = q;
+	    }
+	}
+	free(old_dirs);
+    }
+
+    result->name = xmalloc(length + 1);
+    memcpy(result->name, name, length);
+    result->name[length] = EOS;
+    result->length = length;
+    result->lead = new_string(lead);
+
+    n = hash & (ds->ref_size - 1);
+    result->link = ds->ref_dirs[n];
+    ds->ref_dirs[n] = result;
+    ++ds->ref_used;
+    return result;
+}
+
+static void
+free_ref_dirs(void)
+{
+    size_t n;
+
+    for (n = 0; n < ds->ref_size; ++n) {
+	REF_DIR *p;
+	REF_DIR *next;
+
+	for (p = ds->ref_dirs[n]; p != NULL; p = next) {
+	    next = p->link;
+	    free(p->name);
+	    free(p->lead);
+	    free(p);
+	}
+    }
+    free(ds->ref_dirs);
+}
+
+/*
+ * The matching of path_opt against the name in resolve_name() looks only at
+ * the name's directories, so the files in one directory share a lead.  Find
+ * that once per directory.
+ */
+static char *
+reference_name(const DATA * p)
+{
+    const char *filetail = data_filename(p);
+    const char *leaf;
+    char *result;
+    size_t length;
+    size_t hash;
+    size_t want;
+    REF_DIR *dir;
+
+    if (ds->path_opt == NULL)
+	return resolve_name(p);
+
+    leaf = strrchr(filetail, PATHSEP);
+    length = (leaf != NULL) ? (size_t) (leaf + 1 - filetail) : 0;
+    hash = hash_part(filetail, length);
+
+    LockRefs();
+    if ((dir = find_ref_dir(filetail, length, hash)) == NULL) {
+	char *resolved = resolve_name(p);
+
+	resolved[strlen(resolved) - strlen(filetail)] = EOS;
+	dir = add_ref_dir(filetail, length, hash, resolved);
+	free(resolved);
+    }
+    want = strlen(dir->lead) + strlen(filetail) + 1;
+    result = xmalloc(want);
+    strcpy(result, dir->lead);
+    UnlockRefs();
+    strcat(result, filetail);
+    return result;
+}
+
+/*
+ * Count the (new)lines in a file, return -1 if the file is not found.
+ */
+static int
+count_lines(DATA * p)
+{
+    char *filename = reference_name(p);
+    int result = count_lines2(filename, &p->estimated);
+
+    free(filename);
+    return result;
+}
+
+static void
+update_chunk(DATA * p, Change change)
+{
+    if (ds->merge_opt) {
+	p->pending += 1;
+	p->chunk[change] += 1;
+    } else {
+	p->count[change] += 1;
+    }
+}
+
+static void
+finish_chunk(DATA * p)
+{
+    if (p->pending) {
+	int i;
+
+	p->pending = 0;
+	p->chunks += 1;
+	if (ds->merge_opt) {
+	    /*
+	     * This is crude, but to make it really precise we would have
+	     * to keep an array of line-numbers to which which in a chunk
+	     * are marked as insert/delete.
+	     */
+	    if (p->chunk[cInsert] && p->chunk[cDelete]) {
+		long change;
+		if (p->chunk[cInsert] > p->chunk[cDelete]) {
+		    change = p->chunk[cDelete];
+		} else {
+		    change = p->chunk[cInsert];
+		}
+		p->chunk[cInsert] -= change;
+		p->chunk[cDelete] -= change;
+		p->chunk[cModify] += change;
+	    }
+	}
+	for_each_mark(i) {
+	    p->count[i] += p->chunk[i];
+	    p->chunk[i] = 0;
+	}
+    }
+}
+
+static char *
+copy_notabs(char *target, char *source, size_t limit)
+{
+    char *result = NULL;
+    if (limit-- != 0) {		/* count trailing null */
+	char ch;
+	int found = 0;
+	while ((ch = *source) != EOS) {
+	    if (ch == TAB) {
+		if (found)
+		    result = source;
+		break;
+	    } else if (limit-- == 0) {
+		break;
+	    }
+	    *target++ = ch;
+	    *target = EOS;
+	    ++source;
+	    found = 1;
+	}
+    }
+    return result;
+}
+
+static char *
+copy_graphs(char *target, char *source, size_t limit)
+{
+    int found = 0;
+    if (limit-- != 0) {		/* count trailing null */
+	char ch;
+	while ((ch = *source) != EOS) {
+	    if (ch == TAB || ch == BLANK) {
+		break;
+	    } else if (limit-- == 0) {
+		found = 0;
+		break;
+	    }
+	    *target++ = ch;
+	    *target = EOS;
+	    ++source;
+	    found = 1;
+	}
+    }
+    return found ? source : NULL;
+}
+
+/*
+ * Tested with git 2.11:
+ * git uses dummy directory-names "a" and "b" rather than the actual working
+ * directory.  Also, it allows non-printable characters, encoded in C-style
+ * backslash sequences.  When those are used, it double-quotes the string.
+ */
+static char *
+copy_git_name(char *target, char *source, size_t limit)
+{
+    int found = 0;
+    int quoted = 0;
+
+    /*
+     * Account for double-quote.
+     */
+    if (*source == DQUOTE) {
+	quoted = 1;
+	++source;
+	limit--;
+    }
+
+    /*
+     * Check for the dummy directory paths, and quit if not used.
+     */
+    if (limit <= 2 || (strncmp(source, "a/", 2) && strncmp(source, "b/", 2))) {
+	limit = 0;
+    } else {
+	if (ds->path_dest && !strncmp(source, "b/", 2)) {
+	    source += 2;	/* tweak to help with counting lines */
+	}
+    }
+
+    if (limit-- != 0) {		/* count trailing null */
+	char ch;
+	while ((ch = *source) != EOS) {
+	    if (quoted) {
+		if (ch == DQUOTE) {
+		    if (*++source != EOS)
+			found = 0;
+		    break;
+		} else if (ch == BACKSL) {
+		    int fail = 0;
+		    if ((ch = *++source) == EOS) {
+			fail = 1;
+		    } else if (isoctal(UC(ch))) {
+			int need = 3;
+			int value = 0;
+			/* decode octal escapes into UTF-8 bytes */
+			while (need-- > 0) {
+			    if (isoctal(*source)) {
+				value <<= 3;
+				value |= (UC(*source) - '0');
+				if (need) {
+				    ++source;
+				}
+			    } else {
+				fail = 1;
+				break;
+			    }
+			}
+			ch = (char) value;
+		    } else {
+			--limit;
+			switch (ch) {
+			case BACKSL:
+			    /* FALLTHRU */
+			case DQUOTE:
+			    break;
+			case 'b':
+			    ch = '\b';
+			    break;
+			case 'n':
+			    ch = '\n';
+			    break;
+			case 'r':
+			    ch = '\r';
+			    break;
+			case 't':
+			    ch = '\t';
+			    break;
+			default:
+			    fail = 1;
+			    break;
+			}
+		    }
+		    if (fail) {
+			found = 0;
+			break;
+		    }
+		}
+	    } else if (!isprint(UC(ch))) {
+		break;
+	    }
+	    if (limit-- == 0) {
+		found = 0;
+		break;
+	    }
+	    *target++ = ch;
+	    *target = EOS;
+	    ++source;
+	    found = 1;
+	}
+    }
+    return found ? source : NULL;
+}
+
+/* perforce */
+static char *
+copy_p4_name(char *target, char *source, size_t limit)
+{
+    int found = 0;
+    if (limit-- != 0) {		/* count trailing null */
+	char ch;
+	while ((ch = *source) != EOS) {
+	    if (ch == TAB || ch == BLANK || ch == '#') {
+		break;
+	    } else if (limit-- == 0) {
+		found = 0;
+		break;
+	    }
+	    *target++ = ch;
+	    *target = EOS;
+	    ++source;
+	    found = 1;
+	}
+    }
+    return found ? source : NULL;
+}
+
+static char *
+copy_integer(int *target, const char *source)
+{
+    char *next = NULL;
+    long value = strtol(source, &next, 10);
+    *target = (int) value;
+    return next;
+}
+
+static char *
+need_blanks(char *source)
+{
+    int found = 0;
+    while (*source != EOS) {
+	char ch = *source++;
+	if (ch == BLANK || ch == TAB)
+	    found = 1;
+    }
+    return found ? source : NULL;
+}
+
+static char *
+need_graphs(char *source)
+{
+    char *result = NULL;
+    int found = 0;
+    while (*source != EOS) {
+	char ch = *source;
+	if (ch == BLANK || ch == TAB || ch == EOS) {
+	    if (found)
+		result = source;
+	    break;
+	}
+	++source;
+	found = 1;
+    }
+    return result;
+}
+
+static char *
+need_nospcs(char *source)
+{
+    char *result = NULL;
+    int found = 0;
+    while (*source != EOS) {
+	char ch = *source;
+	if (ch == BLANK || ch == EOS) {
+	    if (found)
+		result = source;
+	    break;
+	}
+	++source;
+	found = 1;
+    }
+    return result;
+}
+
+/* this is used with SVN */
+static char *
+need_parens(char *source)
+{
+    char *result = NULL;
+    if (*source++ == LPAREN) {
+	while (*source != EOS) {
+	    if (*source++ == RPAREN) {
+		result = source;
+		break;
+	    }
+	}
+    }
+    return result;
+}
+
+/*
+ * Unified-diff chunks can be skipped without copying each line, unless we
+ * must look at the whole line.
+ */
+static int
+skip_chunks(void)
+{
+    return !ds->trace_opt && !ds->trim_escapes;
+}
+
+/*
+ * Skip over the body of a unified-diff chunk, using the line-counts from its
+ * "@@" header.  Only the first character of each line is needed to update
+ * the counts, so we search for the end of each line in the input-buffer
+ * rather than copying it.  Stop at any line which needs closer inspection,
+ * leaving that for get_line().  Return the number of lines skipped.
+ */
+static int
+skip_unified(INPUT * ip, DATA * that, int ok, int *old_unify, int *new_unify)
+{
+    int result = 0;
+
+    while (*old_unify + *new_unify) {
+	const char *from;
+	const char *eol;
+
+	if (ip->next >= ip->used && !more_input(ip))
+	    break;
+	from = ip->data + ip->next;
+	if ((eol = memchr(from, '\n', ip->used - ip->next)) == NULL) {
+	    /* get the rest of the line, unless it fills the buffer */
+	    if ((ip->next == 0 && ip->used == ip->size) || !more_input(ip))
+		break;
+	    continue;
+	}
+	switch (*from) {
+	case '-':
+	    if (*old_unify)
+		--(*old_unify);
+	    if (ok)
+		update_chunk(that, cDelete);
+	    break;
+	case '+':
+	    if (*new_unify)
+		--(*new_unify);
+	    if (ok)
+		update_chunk(that, cInsert);
+	    break;
+	case '\n':
+	case ' ':
+	    if (*old_unify)
+		--(*old_unify);
+	    if (*new_unify)
+		--(*new_unify);
+	    break;
+	default:
+	    return result;
+	}
+	ip->next = (size_t) (eol + 1 - ip->data);
+	++result;
+    }
+    return result;
+}
+
+#define date_delims(a,b) (((a)=='/' && (b)=='/') || ((a) == '-' && (b) == '-'))
+#define CASE_TRACE() TRACE(("** handle case for '%c' %d:%s\n", \
+			     *ps->buffer, ps->ok, \
+			     ps->that ? ps->that->modified : ""))
+
+/*
+ * Reset the parser to expect a new diff, keeping its buffers.
+ */
+static void
+reset_parse(PARSER * ps)
+{
+    init_data(&ps->dummy, "", "", 1, 0);
+    ps->that = &ps->dummy;
+    ps->prev = NULL;
+    ps->ok = HAVE_NOTHING;
+    ps->freed = 0;
+    ps->unified = 0;
+    ps->old_unify = 0;
+    ps->new_unify = 0;
+    ps->expect_unify = 0;
+    ps->old_dft = 0;
+    ps->new_dft = 0;
+    ps->context = 1;
+    ps->either = 0;
+    ps->git_diff = 0;
+    ps->line_no = 0;
+}
+
+static void
+begin_parse(PARSER * ps, const char *default_name)
+{
+    memset(ps, 0, sizeof(*ps));
+    reset_parse(ps);
+    ps->default_name = default_name;
+
+    fixed_buffer(&ps->buffer, ps->fixed = ps->length = BUFSIZ);
+    fixed_buffer(&ps->b_fname, ps->length);
+}
+
+/*
+ * Finish counting the diff which was read, e.g., at the end of the input.
+ */
+static void
+finish_parse(PARSER * ps)
+{
+    finish_chunk(ps->that);
+    finish_chunk(&ps->dummy);
+
+    if (ps->either) {
+	int pass;
+	int fixup_diffs = 0;
+
+	for (pass = 0; pass < 2; ++pass) {
+	    DATA *p;
+	    for (p = ds->all_data; p; p = p->link) {
+		switch (p->cmt) {
+		default:
+		    break;
+		case Normal:
+		    fixup_diffs = 1;
+		    break;
+		case Either:
+		    if (pass) {
+			if (fixup_diffs) {
+			    p->cmt = Binary;
+			} else {
+			    p->cmt = Differs;
+			}
+		    }
+		    break;
+		}
+	    }
+	}
+    }
+}
+
+static void show_report(void);
+static void summarize(void);
+
+/*
+ * Return the length of the commit-hash at the beginning of the string, if
+ * it is followed by a blank or the end of the line.
+ */
+static size_t
+commit_hash(const char *s)
+{
+    size_t result = 0;
+
+    while (isxdigit(UC(s[result])))
+	++result;
+    if (result < 7 || (s[result] != EOS && !isspace(UC(s[result]))))
+	result = 0;
+    return result;
+}
+
+/*
+ * Write the report for the commit which was just read, and discard its data
+ * to begin the next.
+ */
+static void
+commit_report(void)
+{
+    int min_name_wide = ds->min_name_wide;
+
+    summarize();
+    show_report();
+    while (ds->all_data != NULL)
+	delink(ds->all_data);
+    ds->cursor = NULL;
+    ds->partial = NULL;
+    ds->min_name_wide = min_name_wide;
+    ds->prefix_len = -1;
+    ds->number_len = 5;
+    ds->unchanged = 0;
+    ds->num_files = 0;
+    ds->files_added = 0;
+    ds->files_binary = 0;
+    ds->files_removed = 0;
+    memset(&ds->totals, 0, sizeof(ds->totals));
+}
+
+/*
+ * The separator which "git format-patch" writes before each message.  Its
+ * date is fixed, so that it is not mistaken for one in a mailbox.
+ */
+#define MBOX_DATE " Mon Sep 17 00:00:00 2001"
+
+typedef enum {
+    csUnknown = 0,
+    csGitLog,			/* "commit <hash>", from "git log -p" */
+    csMailbox			/* "From <hash> <date>", from format-patch */
+} COMMIT_STYLE;
+
+/*
+ * Return the length of the hash if the line begins a commit, accepting only
+ * the style of separator which began the input.  A "git log" message is
+ * indented, but a message in a mailbox is not, and may mention a commit or
+ * quote a separator, so the next one is not looked for until the "---" line
+ * which ends the message.
+ */
+static size_t
+commit_start(char *line, char **hash)
+{
+    size_t len;
+    char *s;
+
+    if (ds->commit_style != csMailbox
+	&& (s = match(line, "commit ")) != NULL
+	&& (len = commit_hash(s)) != 0) {
+	ds->commit_style = csGitLog;
+    } else if (ds->commit_style != csGitLog
+	       && !ds->commit_message
+	       && (s = match(line, "From ")) != NULL
+	       && ((len = commit_hash(s)) == 40 || len == 64)
+	       && !strncmp(s + len, MBOX_DATE, sizeof(MBOX_DATE) - 1)
+	       && *skip_blanks(s + len + sizeof(MBOX_DATE) - 1) == EOS) {
+	ds->commit_style = csMailbox;
+	ds->commit_message = 1;
+    } else {
+	if (ds->commit_message
+	    && (s = match(line, "---")) != NULL
+	    && *skip_blanks(s) == EOS)
+	    ds->commit_message = 0;
+	return 0;
+    }
+    *hash = s;
+    return len;
+}
+
+/*
+ * With --commits, check for the line which begins a commit in "git log -p"
+ * output, or a message in "git format-patch" output, reporting the previous
+ * commit before starting the next.  The author is taken from the header
+ * which follows.  Return true if the line was used.
+ */
+static int
+commit_line(PARSER * ps)
+{
+    char *s;
+    size_t len;
+
+    if ((len = commit_start(ps->buffer, &s)) != 0) {
+	finish_parse(ps);
+	if (ds->commit_hash != NULL || ds->all_data != NULL)
+	    commit_report();
+	reset_parse(ps);
+	free(ds->commit_hash);
+	free(ds->commit_author);
+	ds->commit_hash = (char *) xmalloc(len + 1);
+	strncpy(ds->commit_hash, s, len)[len] = EOS;
+	ds->commit_author = NULL;
+	TRACE(("** begin commit %s\n", ds->commit_hash));
+	return 1;
+    }
+    if (ds->commit_hash != NULL
+	&& ds->commit_author == NULL
+	&& ps->that == &ps->dummy
+	&& (s = match(ps->buffer, ((ds->commit_style == csMailbox)
+				   ? "From: "
+				   : "Author: "))) != NULL) {
+	ds->commit_author = new_string(s);
+	return 1;
+    }
+    return 0;
+}
+
+/*
+ * Parse the line in ps->buffer.  The input is passed along so that the body
+ * of a unified-diff chunk can be skipped without copying its lines.
+ */
+static void
+parse_line(PARSER * ps, INPUT * ip)
+{
+    static const char *only_stars = "***************";
+
+    int marker;
+    int first_ch;
+    char *s;
+
+    /*
+     * Adjust size of fixed-buffers so that a sscanf cannot overflow.
+     */
+    if (ps->length > ps->fixed) {
+	ps->fixed = ps->length;
+	adjust_buffer(&ps->b_fname, ps->length);
+    }
+
+    /*
+     * Trim trailing newline.
+     */
+    for (s = ps->buffer + strlen(ps->buffer); s != ps->buffer; s--) {
+	if ((UC(s[-1]) == '\n') || (UC(s[-1]) == '\r'))
+	    s[-1] = EOS;
+	else
+	    break;
+    }
+
+    /*
+     * Trim escapes from colordiff.
+     */
+#define isFINAL(c) (UC(*s) >= '\140' && UC(*s) <= '\176')
+    if (ds->trim_escapes && (strchr(ps->buffer, '\033') != NULL)) {
+	char *d = ps->buffer;
+	s = d;
+	while (*s != EOS) {
+	    if (*s == '\033') {
+		while (*s != EOS && !isFINAL(*s)) {
+		    ++s;
+		}
+		if (*s != EOS) {
+		    ++s;
+		    continue;
+		} else {
+		    break;
+		}
+	    }
+	    *d++ = *s++;
+	}
+	*d = EOS;
+    }
+    if (ds->commits_opt && commit_line(ps))
+	return;
+    ++ps->line_no;
+    TRACE(("[%05d] %s\n", ps->line_no, ps->buffer));
+
+    /*
+     * "patch -U" can create ".rej" files lacking a filename header,
+     * in unified format.  Check for those.
+     */
+    if (ps->line_no == 1 && !strncmp(ps->buffer, "@@", (size_t) 2)) {
+	ps->unified = 2;
+	ps->that = find_data(ps->default_name, ps->default_name);
+	ps->ok = begin_data(ps->that);
+    }
+
+    /*
+     * The lines identifying files in a context diff depend on how it was
+     * invoked.  But after the header, each chunk begins with a line
+     * containing 15 *'s.  Each chunk may contain a line-range with '***'
+     * for the "before", and a line-range with '---' for the "after".  The
+     * part of the chunk depicting the deletion may be absent, though the
+     * edit line is present.
+     *
+     * The markers for unified diff are a little different from the normal
+     * context-diff.  Also, the edit-lines in a unified diff won't have a
+     * space in column 2.  Because of the missing space, we have to count
+     * lines to ensure we do not confuse the marker lines.
+     */
+    marker = 0;
+    if (ps->that != &ps->dummy && !strcmp(ps->buffer, only_stars)) {
+	finish_chunk(ps->that);
+	TRACE(("** begin context chunk\n"));
+	ps->context = 2;
+    } else if (ps->line_no == 1 && !strcmp(ps->buffer, only_stars)) {
+	TRACE(("** begin context chunk\n"));
+	ps->context = 2;
+	ps->that = find_data(ps->default_name, ps->default_name);
+	ps->ok = begin_data(ps->that);
+    } else if (ps->context == 2 && match(ps->buffer, "*** ")) {
+	ps->context = 1;
+    } else if (ps->context == 1 && match(ps->buffer, "--- ")) {
+	marker = 1;
+	ps->context = 0;
+    } else if (match(ps->buffer, "*** ")) {
+    } else if ((ps->old_unify + ps->new_unify) == 0
+	       && match(ps->buffer, "==== ")) {
+	finish_chunk(ps->that);
+	ps->unified = 2;
+    } else if ((ps->old_unify + ps->new_unify) == 0
+	       && match(ps->buffer, "--- ")) {
+	finish_chunk(ps->that);
+	marker = ps->unified = 1;
+    } else if ((ps->old_unify + ps->new_unify) == 0
+	       && match(ps->buffer, "+++ ")) {
+	marker = ps->unified = 2;
+    } else if (ps->unified == 2
+	       || ((ps->old_unify + ps->new_unify) == 0 && (*ps->buffer == '@'))) {
+	finish_chunk(ps->that);
+	ps->unified = 0;
+	if (*ps->buffer == '@') {
+	    int old_base, new_base;
+	    int old_size = 0;
+	    int new_size = 0;
+	    char *sp;
+
+	    ps->old_unify = ps->new_unify = 0;
+	    if ((sp = match(ps->buffer, "@@ -")) != NULL
+		&& (sp = decode_range(sp, &old_base, &old_size)) != NULL
+		&& (sp = match(sp, " +")) != NULL
+		&& (sp = decode_range(sp, &new_base, &new_size)) != NULL
+		&& match(sp, " @") != NULL) {
+		ps->old_unify = old_size;
+		ps->new_unify = new_size;
+		ps->unified = -1;
+		if (ps->context == 0 && ps->git_diff != 3 && skip_chunks()) {
+		    int skipped = skip_unified(ip, ps->that, ps->ok,
+					       &ps->old_unify, &ps->new_unify);
+		    ps->line_no += skipped;
+		    if (skipped && !(ps->old_unify + ps->new_unify)) {
+			ps->expect_unify = 2;
+		    }
+		}
+	    }
+	}
+    } else if (ps->unified == 1 && !ps->context) {
+	/*
+	 * If unified==1, we guessed we would find a "+++" line, but since
+	 * we are here, we did not find that.  The context check ensures
+	 * we do not mistake the "---" for a unified diff with that for
+	 * a context diff's "after" line-range.
+	 *
+	 * If we guessed wrong, then we probably found a data line with
+	 * "--" in the first two columns of the diff'd file.
+	 */
+	ps->unified = 0;
+	TRACE(("?? Expected \"+++\" for unified diff\n"));
+	if (ps->prev != NULL
+	    && ps->prev != ps->that
+	    && InsOf(ps->that) == 0
+	    && DelOf(ps->that) == 0
+	    && strcmp(ps->prev->modified, ps->that->modified)) {
+	    TRACE(("?? giveup on %ld/%ld %s\n", InsOf(ps->that),
+		   DelOf(ps->that), ps->that->modified));
+	    TRACE(("?? revert to %ld/%ld %s\n", InsOf(ps->prev),
+		   DelOf(ps->prev), ps->prev->modified));
+	    (void) delink(ps->that);
+	    ps->that = ps->prev;
+	    update_chunk(ps->that, cDelete);
+	}
+    } else if (ps->old_unify + ps->new_unify) {
+	switch (*ps->buffer) {
+	case '-':
+	    if (ps->old_unify)
+		--ps->old_unify;
+	    break;
+	case '+':
+	    if (ps->new_unify)
+		--ps->new_unify;
+	    break;
+	case EOS:
+	case ' ':
+	    if (ps->old_unify)
+		--ps->old_unify;
+	    if (ps->new_unify)
+		--ps->new_unify;
+	    break;
+	case BACKSL:
+	    if (strstr(ps->buffer, "newline") != NULL) {
+		break;
+	    }
+	    /* FALLTHRU */
+	default:
+	    TRACE(("?? expected more in chunk\n"));
+	    ps->old_unify = ps->new_unify = 0;
+	    break;
+	}
+	if (!(ps->old_unify + ps->new_unify)) {
+	    ps->expect_unify = 2;
+	}
+    } else {
+	long old_base, new_base;
+
+	ps->unified = 0;
+
+	if (ps->line_no == 1
+	    && decode_default(ps->buffer,
+			      &old_base, &ps->old_dft,
+			      &new_base, &ps->new_dft)) {
+	    TRACE(("DFT %ld,%ld -> %ld,%ld\n",
+		   old_base, old_base + ps->old_dft - 1,
+		   new_base, new_base + ps->new_dft - 1));
+	    finish_chunk(ps->that);
+	    ps->that = find_data("unknown", "unknown");
+	    ps->ok = begin_data(ps->that);
+	}
+    }
+
+    /*
+     * If the previous line ended a chunk of a unified diff, we may begin
+     * another chunk, or begin another type of diff.  If neither, do not
+     * continue to accumulate counts for the unified diff which has ended.
+     */
+    if (ps->expect_unify != 0) {
+	if (ps->expect_unify-- == 1) {
+	    if (ps->unified == 0) {
+		TRACE(("?? did not get chunk\n"));
+		finish_chunk(ps->that);
+		ps->that = &ps->dummy;
+	    }
+	}
+    }
+
+    /*
+     * Override the beginning of the line to simplify the case statement
+     * below.
+     */
+    if (marker > 0) {
+	TRACE(("** have marker=%d, override %s\n", marker, ps->buffer));
+	(void) memcpy(ps->buffer, "***", (size_t) 3);
+    }
+
+    first_ch = *ps->buffer;
+
+    /*
+     * GIT binary diffs can contain blocks of data that might be confused
+     * with the ordinary line-oriented sections in diff output.  Skip the
+     * case statement if we are processing a GIT binary diff.
+     */
+    switch (ps->git_diff) {
+    default:
+	break;
+    case 1:
+	/* expect "index" */
+	if (match(ps->buffer, "index") != NULL
+	    || match(ps->buffer, "rename") != NULL
+	    || match(ps->buffer, "similarity") != NULL) {
+	    ps->git_diff = 2;
+	    return;
+	} else {
+	    ps->git_diff = 0;
+	}
+	break;
+    case 2:
+	/* perhaps "GIT binary patch" */
+	if (match(ps->buffer, "GIT binary patch") != NULL) {
+	    ps->git_diff = 3;
+	    ps->that->cmt = Binary;
+	    return;
+	} else if (match(ps->buffer, "Binary files ") != NULL) {
+	    ps->git_diff = 0;
+	    ps->that->cmt = Binary;
+	    return;
+	}
+	break;
+    case 3:
+	/* had "GIT binary patch", wait for next "diff" line */
+	if (first_ch != 'd')
+	    return;
+	break;
+    }
+
+    /*
+     * Use the first character of the input line to determine its
+     * type:
+     */
+    switch (first_ch) {
+    case 'O':		/* Only */
+	CASE_TRACE();
+	if (match(ps->buffer, "Only in ")) {
+	    char *path = ps->buffer + 8;
+	    int found = 0;
+	    for (s = path; *s != EOS; s++) {
+		if (match(s, ": ")) {
+		    found = 1;
+		    if ((s - path) >= 2 && s[-1] == PATHSEP) {
+			while ((s[0] = s[2]) != EOS)
+			    s++;
+		    } else {
+			*s++ = PATHSEP;
+			while ((s[0] = s[1]) != EOS)
+			    s++;
+		    }
+		    break;
+		}
+	    }
+	    if (found) {
+		blip('.');
+		finish_chunk(ps->that);
+		ps->that = find_data(NULL, path);
+		ps->that->cmt = Only;
+		ps->ok = HAVE_NOTHING;
+	    }
+	}
+	break;
+
+	/*
+	 * Several different scripts produce "Index:" lines
+	 * (e.g., "makepatch").  Not all bother to put the
+	 * pathname of the files; some put only the leaf names.
+	 */
+    case 'I':
+	CASE_TRACE();
+	if ((s = match(ps->buffer, "Index: ")) != NULL) {
+	    s = skip_blanks(s);
+	    dequote(s);
+	    blip('.');
+	    finish_chunk(ps->that);
+	    s = do_merging(ps->that, s, &ps->freed);
+	    ps->that = find_data(NULL, s);
+	    ps->ok = begin_data(ps->that);
+	}
+	break;
+
+    case 'd':		/* diff command trace */
+	CASE_TRACE();
+	if ((s = match(ps->buffer, "diff ")) != NULL
+	    && *(s = skip_options(s)) != EOS) {
+	    char *original = NULL;
+	    char *modified = NULL;
+	    char *to_blank = NULL;
+	    if (ds->reverse_opt) {
+		modified = s;
+		to_blank = skip_filename(s);
+		original = skip_blanks(to_blank);
+		*to_blank = EOS;
+	    } else {
+		original = s;
+		to_blank = skip_filename(s);
+		s = skip_blanks(to_blank);
+		modified = s;
+		*to_blank = EOS;
+	    }
+	    if (match(ps->buffer, "diff --git ") != NULL) {
+		size_t old_len = strlen(original);
+		size_t new_len = strlen(modified);
+		char *temp = xmalloc(old_len + new_len + 1);
+		ps->git_diff = 1;
+		if (copy_git_name(temp, original, old_len) != NULL)
+		    original = new_string(temp);
+		if (copy_git_name(temp, modified, new_len) != NULL)
+		    modified = new_string(temp);
+		free(temp);
+	    } else {
+		ps->git_diff = 0;
+		dequote(original);
+		dequote(modified);
+	    }
+	    blip('.');
+	    finish_chunk(ps->that);
+	    modified = do_merging(ps->that, modified, &ps->freed);
+	    ps->that = find_data(original, modified);
+	    ps->ok = begin_data(ps->that);
+	}
+	break;
+
+    case '*':
+	CASE_TRACE();
+	if (!(ps->ok & HAVE_PATH)) {
+	    int ddd, hour, minute, second;
+	    int day, month, year;
+	    char yrmon, monday;
+	    char *stars = match(ps->buffer, "*** ");
+	    char *sp;
+
+	    if (stars == NULL)
+		break;	/* ignore */
+
+	    /* check for tab-delimited first, so we can
+	     * accept filenames containing spaces.
+	     */
+	    if (((sp = copy_notabs(ps->b_fname, stars, ps->length)) != NULL
+		 && (sp = match(sp, "\t")) != NULL
+		 && (sp = need_nospcs(sp)) != NULL
+		 && (sp = match(sp, " ")) != NULL
+		 && (sp = need_nospcs(sp)) != NULL
+		 && sscanf(sp,
+			   " %d %d:%d:%d %d",
+			   &ddd,
+			   &hour, &minute, &second, &year) == 5)
+		|| ((sp = copy_notabs(ps->b_fname, stars, ps->length)) != NULL
+		    && sscanf(sp,
+			      "\t%d%c%d%c%d %d:%d:%d",
+			      &year, &yrmon, &month, &monday, &day,
+			      &hour, &minute, &second) == 8
+		    && date_delims(yrmon, monday)
+		    && !version_num(ps->b_fname))
+		|| ((sp = copy_notabs(ps->b_fname, stars, ps->length)) != NULL
+		    && (sp = match(sp, "\t")) != NULL
+		    && (sp = need_parens(sp)) != NULL
+		    && (sp = match(sp, "\t")) != NULL
+		    && need_parens(sp) != NULL
+		    && !version_num(ps->b_fname))
+		|| ((sp = copy_notabs(ps->b_fname, stars, ps->length)) != NULL
+		    && (sp = match(sp, "\t")) != NULL
+		    && (sp = need_parens(sp)) != NULL
+		    && (*skip_blanks(sp) == EOS))
+		|| ((sp = copy_graphs(ps->b_fname, stars, ps->length)) != NULL
+		    && (sp = need_blanks(sp)) != NULL
+		    && (sp = need_nospcs(sp)) != NULL
+		    && (sp = match(sp, " ")) != NULL
+		    && (sp = need_nospcs(sp)) != NULL
+		    && sscanf(sp,
+			      " %d %d:%d:%d %d",
+			      &ddd, &hour, &minute, &second, &year) == 5)
+		|| ((sp = copy_graphs(ps->b_fname, stars, ps->length)) != NULL
+		    && (sp = need_blanks(sp)) != NULL
+		    && sscanf(sp,
+			      "%d%c%d%c%d %d:%d:%d",
+			      &year, &yrmon, &month, &monday, &day,
+			      &hour, &minute, &second) == 8
+		    && date_delims(yrmon, monday)
+		    && !version_num(ps->b_fname))
+		|| ((sp = copy_git_name(ps->b_fname, stars, ps->length)) != NULL
+		    && *skip_blanks(sp) == EOS)
+		|| ((sp = copy_graphs(ps->b_fname, stars, ps->length)) != NULL
+		    && (*sp == EOS || *sp == BLANK || *sp == TAB)
+		    && !version_num(ps->b_fname)
+		    && !contain_any(ps->b_fname, "*")
+		    && !edit_range(ps->b_fname))
+		) {
+		char *git_source = NULL;
+
+		ps->prev = ps->that;
+		finish_chunk(ps->that);
+		dequote(ps->b_fname);
+
+		/*
+		 * Git diff's may reflect a renamed file.  For this case,
+		 * we want to keep track of the original file, for the
+		 * -S/-D comparison.
+		 */
+		if ((marker > 1) && ps->git_diff) {
+		    char *tt = ps->that->original;
+		    if (strlen(tt) > 2
+			&& (!strncmp("a/", tt, 2)
+			    || !strncmp("b/", tt, 2))) {
+			tt += 2;
+		    }
+		    git_source = new_string(tt);
+		}
+
+		s = do_merging(ps->that, ps->b_fname, &ps->freed);
+		if (ps->freed)
+		    ps->prev = NULL;
+		ps->that = find_data(git_source, s);
+		free(git_source);	/* find_data() makes its own copy */
+		ps->ok = begin_data(ps->that);
+		TRACE(("** after merge:%d:%s\n", ps->ok, s));
+	    }
+	}
+	break;
+
+    case '=':
+	CASE_TRACE();
+	if (!(ps->ok & HAVE_PATH)) {
+	    int rev;
+	    char *bars, *sp;
+
+	    if ((bars = match(ps->buffer, "==== ")) != NULL
+		&& (bars = copy_p4_name(ps->b_fname, bars, ps->length)) != NULL
+		&& (bars = match(bars, "#")) != NULL
+		&& (bars = copy_integer(&rev, bars)) != NULL
+		&& (((sp = match(bars, " - ")) != NULL
+		     && need_graphs(sp) != NULL)
+		    || (((sp = match(bars, " ")) != NULL
+			 && (sp = need_parens(sp)) != NULL
+			 && (sp = match(sp, " - ")) != NULL
+			 && need_graphs(sp) != NULL)))
+		&& !version_num(ps->b_fname)
+		&& !contain_any(ps->b_fname, "*")
+		&& !edit_range(ps->b_fname)) {
+		TRACE(("** found p4-diff\n"));
+		ps->prev = ps->that;
+		finish_chunk(ps->that);
+		dequote(ps->b_fname);
+		s = do_merging(ps->that, ps->b_fname, &ps->freed);
+		if (ps->freed)
+		    ps->prev = NULL;
+		ps->that = find_data(NULL, s);
+		ps->ok = begin_data(ps->that);
+		TRACE(("** after merge:%d:%s\n", ps->ok, s));
+	    }
+	}
+	break;
+
+    case '+':
+	/* FALL-THRU */
+    case '>':
+	CASE_TRACE();
+	if (ps->ok) {
+	    update_chunk(ps->that, cInsert);
+	}
+	break;
+
+    case '-':
+	if (!ps->ok) {
+	    CASE_TRACE();
+	    break;
+	}
+	if (!ps->unified && !strcmp(ps->buffer, "---")) {
+	    CASE_TRACE();
+	    break;
+	}
+	/* fall-thru */
+    case '<':
+	CASE_TRACE();
+	if (ps->ok) {
+	    update_chunk(ps->that, cDelete);
+	}
+	break;
+
+    case '!':
+	CASE_TRACE();
+	if (ps->ok) {
+	    update_chunk(ps->that, cModify);
+	}
+	break;
+
+	/* Expecting "Files XXX and YYY differ" */
+    case 'F':		/* FALL-THRU */
+    case 'f':
+	CASE_TRACE();
+	if ((s = match(ps->buffer + 1, "iles ")) != NULL) {
+	    char *first = skip_blanks(s);
+	    /* blindly assume the first filename does not contain " and " */
+	    char *at_and = strstr(s, " and ");
+	    s = strrchr(ps->buffer, BLANK);
+	    if ((at_and != NULL) && !strcmp(s, " differ")) {
+		char *second = skip_blanks(at_and + 5);
+
+		if (ds->reverse_opt) {
+		    *at_and = EOS;
+		    s = first;
+		} else {
+		    *s = EOS;
+		    s = second;
+		}
+		blip('.');
+		finish_chunk(ps->that);
+		ps->that = find_data(NULL, s);
+		ps->that->cmt = Either;
+		ps->ok = HAVE_NOTHING;
+		ps->either = 1;
+	    }
+	}
+	break;
+	/* Expecting "Binary files XXX and YYY differ" */
+    case 'B':		/* FALL-THRU */
+    case 'b':
+	CASE_TRACE();
+	if ((s = match(ps->buffer + 1, "inary files ")) != NULL) {
+	    char *first = skip_blanks(s);
+	    /* blindly assume the first filename does not contain " and " */
+	    char *at_and = strstr(s, " and ");
+	    s = strrchr(ps->buffer, BLANK);
+	    if ((at_and != NULL) && !strcmp(s, " differ")) {
+		char *second = skip_blanks(at_and + 5);
+
+		if (ds->reverse_opt) {
+		    *at_and = EOS;
+		    s = first;
+		} else {
+		    *s = EOS;
+		    s = second;
+		}
+		blip('.');
+		finish_chunk(ps->that);
+		ps->that = find_data(NULL, s);
+		ps->that->cmt = Binary;
+		ps->ok = HAVE_NOTHING;
+	    }
+	}
+	break;
+    }
+}
+
+static void
+end_parse(PARSER * ps)
+{
+    blip('\n');
+    finish_parse(ps);
+
+    free(ps->buffer);
+    free(ps->b_fname);
+}
+
+static void
+do_file(INPUT * ip, const char *default_name)
+{
+    PARSER parser;
+
+    begin_parse(&parser, default_name);
+    while (get_line(&parser.buffer, &parser.length, ip)) {
+	parse_line(&parser, ip);
+    }
+    end_parse(&parser);
+}
+
+/*
+ * Copy the next complete line of the data given by diffstat_push() to the
+ * parser's buffer.  At the end of the data, a line lacking a newline is
+ * complete as well.
+ */
+static int
+take_line(PARSER * ps, INPUT * ip, int at_end)
+{
+    const char *from = ip->data + ip->next;
+    size_t take = ip->used - ip->next;
+    const char *eol = memchr(from, '\n', take);
+
+    if (eol != NULL)
+	take = (size_t) (eol + 1 - from);
+    else if (!at_end || take == 0)
+	return 0;
+    if (take + 1 > ps->length) {
+	while (take + 1 > ps->length)
+	    ps->length *= 2;
+	adjust_buffer(&ps->buffer, ps->length);
+    }
+    memcpy(ps->buffer, from, take);
+    ps->buffer[take] = EOS;
+    ip->next += take;
+    return 1;
+}
+
+/*
+ * Parse the differences from a stdio stream, e.g., a pipe from popen().
+ */
+static void
+do_stream(FILE *fp, const char *default_name)
+{
+    INPUT input;
+
+    init_input(&input, fileno(fp));
+    do_file(&input, default_name);
+    free_input(&input);
+}
+
+static void
+show_color(int color)
+{
+    if (color >= 0)
+	fprintf(ds->output, "\033[%dm", color + 30);
+    else
+	fprintf(ds->output, "\033[0;39m");
+}
+
+static long
+plot_bar(long count, int c, int color)
+{
+    long result = count;
+
+    if (ds->show_colors && result != 0)
+	show_color(color);
+
+    while (--count >= 0)
+	(void) fputc(c, ds->output);
+
+    if (ds->show_colors && result != 0)
+	show_color(-1);
+
+    return result;
+}
+
+/*
+ * Each call to 'plot_num()' prints a scaled bar of 'c' characters.  The
+ * 'extra' parameter is used to keep the accumulated error in the bar's total
+ * length from getting large.
+ */
+static long
+plot_num(long num_value, int c, int color, long *extra)
+{
+    long result = 0;
+
+    /* the value to plot */
+    /* character to display in the bar */
+    /* accumulated error in the bar */
+    if (num_value) {
+	long product = (ds->plot_width * num_value);
+	result = ((product + *extra) / ds->plot_scale);
+	*extra = product - (result * ds->plot_scale) - *extra;
+	plot_bar(result, c, color);
+    }
+    return result;
+}
+
+static long
+plot_round1(const long num[MARKS])
+{
+    long result = 0;
+    long scaled[MARKS];
+    long remain[MARKS];
+    long want = 0;
+    long have = 0;
+    long half = (ds->plot_scale / 2);
+    int i;
+
+    memset(scaled, 0, sizeof(scaled));
+    memset(remain, 0, sizeof(remain));
+
+    for_each_mark(i) {
+	long product = (ds->plot_width * num[i]);
+	scaled[i] = (product / ds->plot_scale);
+	remain[i] = (product % ds->plot_scale);
+	want += product;
+	have += product - remain[i];
+    }
+    while (want > have) {
+	int j = -1;
+	for_each_mark(i) {
+	    if (remain[i] != 0
+		&& (remain[i] > (j >= 0 ? remain[j] : half))) {
+		j = i;
+	    }
+	}
+	if (j >= 0) {
+	    have += remain[j];
+	    remain[j] = 0;
+	    scaled[j] += 1;
+	} else {
+	    break;
+	}
+    }
+    for_each_mark(i) {
+	plot_bar(scaled[i], marks[i], colors[i]);
+	result += scaled[i];
+    }
+    return result;
+}
+
+/*
+ * Print a scaled bar of characters, where c[0] is for insertions, c[1]
+ * for deletions and c[2] for modifications. The num array contains the
+ * count for each type of change, in the same order.
+ */
+static long
+plot_round2(const long num[MARKS])
+{
+    long result = 0;
+    long scaled[MARKS];
+    long remain[MARKS];
+    long total = 0;
+    int i;
+
+    for (i = 0; i < MARKS; i++)
+	total += num[i];
+
+    if (total == 0)
+	return result;
+
+    total = (total * ds->plot_width + (ds->plot_scale / 2)) / ds->plot_scale;
+    /* display at least one character */
+    if (total == 0)
+	total++;
+
+    for_each_mark(i) {
+	scaled[i] = num[i] * ds->plot_width / ds->plot_scale;
+	remain[i] = num[i] * ds->plot_width - scaled[i] * ds->plot_scale;
+	total -= scaled[i];
+    }
+
+    /* assign the missing chars using the largest remainder algo */
+    while (total) {
+	int largest, largest_count;	/* largest is a bit field */
+	long max_remain;
+
+	/* search for the largest remainder */
+	largest = largest_count = 0;
+	max_remain = 0;
+	for_each_mark(i) {
+	    if (remain[i] > max_remain) {
+		largest = 1 << i;
+		largest_count = 1;
+		max_remain = remain[i];
+	    } else if (remain[i] == max_remain) {	/* ex aequo */
+		largest |= 1 << i;
+		largest_count++;
+	    }
+	}
+
+	/* if there are more greatest remainders than characters
+	   missing, don't assign them at all */
+	if (total < largest_count)
+	    break;
+
+	/* allocate the extra characters */
+	for_each_mark(i) {
+	    if (largest & (1 << i)) {
+		scaled[i]++;
+		total--;
+		remain[i] -= ds->plot_width;
+	    }
+	}
+    }
+
+    for_each_mark(i) {
+	result += plot_bar(scaled[i], marks[i], colors[i]);
+    }
+
+    return result;
+}
+
+static void
+plot_numbers(const DATA * p)
+{
+    long temp = 0;
+    int i;
+
+    fprintf(ds->output, "%5ld ", TotalOf(p));
+
+    if (ds->format_opt & FMT_VERBOSE) {
+	fprintf(ds->output, "%5ld ", InsOf(p));
+	fprintf(ds->output, "%5ld ", DelOf(p));
+	fprintf(ds->output, "%5ld ", ModOf(p));
+	if (ds->path_opt)
+	    fprintf(ds->output, "%5ld ", EqlOf(p));
+    }
+
+    if (ds->format_opt == FMT_CONCISE) {
+	for_each_mark(i) {
+	    fprintf(ds->output, "\t%ld %c", p->count[i], marks[i]);
+	}
+    } else {
+	long used = 0;
+
+	switch (ds->round_opt) {
+	default:
+	    for_each_mark(i) {
+		used += plot_num(p->count[i], marks[i], colors[i], &temp);
+	    }
+	    break;
+	case 1:
+	    used = plot_round1(p->count);
+	    break;
+
+	case 2:
+	    used = plot_round2(p->count);
+	    break;
+	}
+
+	if ((ds->format_opt & FMT_FILLED) != 0) {
+	    if (used > ds->plot_width)
+		fprintf(ds->output, "%ld", used - ds->plot_width);	/* oops */
+	    else
+		plot_bar(ds->plot_width - used, '.', 0);
+	}
+    }
+}
+
+static int
+columns_of(const char *value)
+{
+    int result;
+    int n;
+    int ch;
+#ifdef HAVE_MBSTOWCWIDTH
+    int fixup = 0;
+    for (n = 0; (ch = UC(value[n])) != EOS; ++n) {
+	if (ch >= DEL || ch < BLANK) {
+	    fixup = 1;
+	    break;
+	}
+    }
+    result = (int) strlen(value);
+    if (fixup) {
+	size_t needed;
+	mbstate_t state;
+	const char *source;
+	size_t length = strlen(value);
+
+	memset(&state, 0, sizeof(state));
+	source = value;
+	needed = mbsrtowcs(NULL, &source, length, &state);
+	if (needed != (size_t) (-1)) {
+	    wchar_t *target = calloc(1 + needed, sizeof(wchar_t));
+	    memset(&state, 0, sizeof(state));
+	    if (mbsrtowcs(target, &value, needed, &state) == needed) {
+		size_t n2;
+		result = 0;
+		for (n2 = 0; n2 < needed; ++n2) {
+		    int nw = wcwidth(target[n2]);
+		    if (nw > 0)
+			result += nw;
+		    else if (target[n2] < BLANK || target[n2] == DEL)
+			result += 2;
+		    else
+			result += 4;	/* show as octal */
+		}
+	    }
+	    free(target);
+	}
+    }
+#else
+    result = (int) strlen(value);
+    for (n = 0; (ch = UC(value[n])) != EOS; ++n) {
+	if (ch == DEL || ch < BLANK) {
+	    result += 1;
+	} else if (ch > DEL) {
+	    result += 3;	/* show as octal */
+	}
+    }
+#endif
+    return result;
+}
+
+#define adjustwide(width,name) width += (int) strlen(name) - columns_of(name)
+
+static void
+show_quoted(const char *value)
+{
+    int ch;
+
+    fputc(DQUOTE, ds->output);
+    while ((ch = UC(*value++)) != EOS) {
+	if (ch == DQUOTE)
+	    fputc(DQUOTE, ds->output);
+	fputc(ch, ds->output);
+    }
+    fputc(DQUOTE, ds->output);
+}
+
+static void
+show_unquoted(const char *value, int limit)
+{
+    int ch;
+    while ((ch = UC(*value++)) != EOS) {
+	if (ch < BLANK) {
+	    if (strchr("\b\n\r\t\\\"", ch) != NULL) {
+		fputc(BACKSL, ds->output);
+		switch (ch) {
+		case '\b':
+		    ch = 'b';
+		    break;
+		case '\n':
+		    ch = 'n';
+		    break;
+		case '\r':
+		    ch = 'r';
+		    break;
+		case '\t':
+		    ch = 't';
+		    break;
+		}
+	    } else {
+		fputc('^', ds->output);
+		ch |= '@';
+	    }
+	} else if (ch == DEL) {
+	    fputc('^', ds->output);
+	    ch = '?';
+	}
+#ifndef HAVE_MBSTOWCWIDTH
+	else if (ch > DEL) {
+	    char temp[5];
+	    sprintf(temp, "\\%03o", ch & 0xff);
+	    ch = temp[3];
+	    temp[3] = EOS;
+	    fputs(temp, ds->output);
+	}
+#endif
+	fputc(ch, ds->output);
+	--limit;
+    }
+    while (limit-- > 0) {
+	fputc(BLANK, ds->output);
+    }
+}
+
+#define changed(p) (!ds->merge_names \
+		    || (p)->cmt != Normal \
+		    || (TotalOf(p)) != 0)
+
+static void
+show_data(const DATA * p)
+{
+    const char *name = data_filename(p);
+
+    if (ds->summary_only) {
+	;
+    } else if (!changed(p)) {
+	;
+    } else if (p->cmt == Binary && ds->suppress_binary == 1) {
+	;
+    } else if (ds->table_opt == 1) {
+	if (ds->commits_opt) {
+	    fprintf(ds->output, "%s,",
+		    ds->commit_hash ? ds->commit_hash : "");
+	    show_quoted(ds->commit_author ? ds->commit_author : "");
+	    fputc(',', ds->output);
+	}
+	if (ds->names_only) {
+	    show_quoted(name);
+	} else {
+	    fprintf(ds->output, "%ld,%ld,%ld,",
+		   InsOf(p),
+		   DelOf(p),
+		   ModOf(p));
+	    if (ds->path_opt)
+		fprintf(ds->output, "%ld,", EqlOf(p));
+	    if (ds->count_files && !ds->reverse_opt)
+		fprintf(ds->output, "%d,%d,%d,",
+		       (p->cmt == OnlyRight),
+		       (p->cmt == OnlyLeft),
+		       (p->cmt == Binary));
+	    show_quoted(name);
+	}
+	fprintf(ds->output, "\n");
+    } else if (ds->names_only) {
+	fprintf(ds->output, "%s\n", name);
+    } else {
+	int width;
+
+	fprintf(ds->output, "%s ", ds->comment_opt);
+	if (ds->max_name_wide > 0
+	    && ds->max_name_wide < ds->min_name_wide
+	    && ds->max_name_wide < ((width = (int) columns_of(name)))) {
+	    fprintf(ds->output, "%.*s", ds->max_name_wide,
+		    name + (width - ds->max_name_wide));
+	} else {
+	    width = ((ds->max_name_wide > 0 && ds->max_name_wide < ds->min_name_wide)
+		     ? ds->max_name_wide
+		     : ds->min_name_wide);
+	    adjustwide(width, name);
+	    show_unquoted(name, width);
+	}
+	if (ds->table_opt == 2) {
+	    fputc('|', ds->output);
+	    if (ds->path_opt)
+		fprintf(ds->output, "%s%*ld ",
+			(ds->estimate_opt
+			 ? (p->estimated ? "~" : " ")
+			 : ""),
+			ds->number_len, EqlOf(p));
+	    fprintf(ds->output, "%*ld ", ds->number_len, InsOf(p));
+	    fprintf(ds->output, "%*ld ", ds->number_len, DelOf(p));
+	    fprintf(ds->output, "%*ld", ds->number_len, ModOf(p));
+	}
+	fputc('|', ds->output);
+	switch (p->cmt) {
+	default:
+	case Normal:
+	    plot_numbers(p);
+	    break;
+	case Binary:
+	    fprintf(ds->output, "binary");
+	    break;
+	case Differs:
+	    fprintf(ds->output, "differ");
+	    break;
+	case Only:
+	    fprintf(ds->output, "only");
+	    break;
+	case OnlyLeft:
+	    fprintf(ds->output, ds->count_files ? "deleted" : "only");
+	    break;
+	case OnlyRight:
+	    fprintf(ds->output, ds->count_files ? "added" : "only");
+	    break;
+	}
+	fprintf(ds->output, "\n");
+    }
+}
+
+#ifdef HAVE_TSEARCH
+static void
+show_tsearch(const void *nodep, const VISIT which, const int depth)
+{
+    const DATA *p = *(DATA * const *) nodep;
+    (void) depth;
+    if (which == postorder || which == leaf)
+	show_data(p);
+}
+#endif
+
+static int
+ignore_data(DATA * p)
+{
+    return ((!changed(p))
+	    || (p->cmt == Binary && ds->suppress_binary));
+}
+
+/*
+ * Return the length of any directory-prefix from the given path.
+ */
+static size_t
+path_length(const char *path)
+{
+    size_t result = 0;
+    const char *mark = strrchr(path, PATHSEP);
+    if (mark != NULL && mark != path)
+	result = (size_t) (mark + 1 - path);
+    return result;
+}
+
+/*
+ * If we have an "only" filename, we can guess whether it was added or removed
+ * by looking at its directory and comparing that to other files' directories.
+ *
+ * TODO: -K -R combination is not yet supported because that relies on storing
+ * both left-/right-paths for each file; only the right-path is currently used.
+ */
+static Comment
+resolve_only(const DATA * p)
+{
+    Comment result = p->cmt;
+    if (result == Only && !ds->reverse_opt) {
+	const DATA *q;
+	size_t len1 = path_length(p->modified);
+	if (len1 != 0) {
+	    for (q = ds->all_data; q; q = q->link) {
+		result = OnlyLeft;
+		if (q->cmt == Normal || q->cmt == Binary) {
+		    size_t len2 = path_length(q->modified);
+		    if (len2 >= len1) {
+			if (!strncmp(p->modified, q->modified, len1)) {
+			    result = OnlyRight;
+			    break;
+			}
+		    }
+		}
+	    }
+	}
+    }
+    return result;
+}
+
+/*
+ * Version-control directories are not part of the -S/-D trees.
+ */
+static int
+is_vcs_dir(const char *leaf)
+{
+    return (!strcmp(leaf, ".git")
+	    || !strcmp(leaf, ".svn")
+	    || !strcmp(leaf, "CVS")
+	    || !strcmp(leaf, "RCS"));
+}
+
+#ifdef HAVE_OPENDIR
+
+/*
+ * Ignore-files use the syntax of .gitignore:  blank lines and comments are
+ * skipped, "!" negates a rule, a trailing "/" matches only directories, and
+ * a pattern containing "/" is matched from the directory of the file rather
+ * than against the last component of a pathname.
+ */
+#define IGNORE_NAME ".gitignore"
+
+static void
+add_ignore_rule(IGNORE_RULE ** rules, char *text)
+{
+    size_t length = strlen(text);
+    IGNORE_RULE *r;
+    int negate = 0;
+    int dir_only = 0;
+    int anchored;
+
+    while (length != 0 && (text[length - 1] == '\n' || text[length - 1] == '\r'))
+	text[--length] = EOS;
+    /* trailing blanks are ignored unless quoted with a backslash */
+    while (length != 0 && text[length - 1] == ' '
+	   && (length < 2 || text[length - 2] != BACKSL))
+	text[--length] = EOS;
+    if (*text == EOS || *text == '#')
+	return;
+    if (*text == '!') {
+	negate = 1;
+	++text;
+	--length;
+    }
+    if (length != 0 && text[length - 1] == PATHSEP) {
+	dir_only = 1;
+	text[--length] = EOS;
+    }
+    anchored = (strchr(text, PATHSEP) != NULL);
+    if (*text == PATHSEP)
+	++text;
+    if (*text == EOS)
+	return;
+
+    r = (IGNORE_RULE *) xmalloc(sizeof(IGNORE_RULE));
+    r->text = new_string(text);
+    r->literal = !contain_any(text, "*?[\\");
+    r->negate = negate;
+    r->dir_only = dir_only;
+    r->anchored = anchored;
+    r->link = *rules;
+    *rules = r;
+}
+
+/*
+ * Read the rules from an ignore-file, returning false if it cannot be opened.
+ */
+static int
+load_ignores(const char *filename, IGNORE_RULE ** rules)
+{
+    FILE *fp;
+    int result = 0;
+
+    if ((fp = fopen(filename, "r")) != NULL) {
+	char buffer[BUFSIZ];
+
+	TRACE(("load_ignores \"%s\"\n", filename));
+	while (fgets(buffer, (int) sizeof(buffer), fp) != NULL) {
+	    add_ignore_rule(rules, buffer);
+	}
+	(void) fclose(fp);
+	result = 1;
+    }
+    return result;
+}
+
+static void
+free_ignore_rules(IGNORE_RULE * rules)
+{
+    while (rules != NULL) {
+	IGNORE_RULE *next = rules->link;
+	free(rules->text);
+	free(rules);
+	rules = next;
+    }
+}
+
+/*
+ * The --ignore-file rules apply from the top of the -D directory, with lower
+ * priority than any .gitignore file.
+ */
+static IGNORES *
+root_ignores(const char *pathname, IGNORES * storage)
+{
+    IGNORES *result = NULL;
+
+    if (ds->ignore_opt != NULL) {
+	storage->parent = NULL;
+	storage->rules = ds->ignore_opt;
+	storage->base = strlen(pathname);
+	result = storage;
+    }
+    return result;
+}
+
+/*
+ * Return the rules which apply in a directory, adding its .gitignore file if
+ * it has one.  Free the result with free_ignores().
+ */
+static IGNORES *
+dir_ignores(const char *pathname, IGNORES * parent)
+{
+    IGNORES *result = parent;
+
+    if (ds->gitignore_opt) {
+	char *filename = xmalloc(strlen(pathname) + sizeof(IGNORE_NAME) + 1);
+	IGNORE_RULE *rules = NULL;
+
+	sprintf(filename, "%s%c%s", pathname, PATHSEP, IGNORE_NAME);
+	if (load_ignores(filename, &rules) && rules != NULL) {
+	    result = (IGNORES *) xmalloc(sizeof(IGNORES));
+	    result->parent = parent;
+	    result->rules = rules;
+	    result->base = strlen(pathname);
+	}
+	free(filename);
+    }
+    return result;
+}
+
+static void
+free_ignores(IGNORES * ignores, const IGNORES * parent)
+{
+    if (ignores != parent) {
+	free_ignore_rules(ignores->rules);
+	free(ignores);
+    }
+}
+
+/*
+ * Check if a file or directory found in the -D directory is ignored.  The
+ * last rule which matches decides, and a directory which is ignored is not
+ * read, so that its whole subtree is pruned.
+ */
+static int
+ignored_path(const IGNORES * ignores, const char *pathname, int is_dir)
+{
+    const char *leaf = strrchr(pathname, PATHSEP);
+
+    leaf = (leaf != NULL) ? (leaf + 1) : pathname;
+    for (; ignores != NULL; ignores = ignores->parent) {
+	const char *name = pathname + ignores->base;
+	const IGNORE_RULE *r;
+
+	while (*name == PATHSEP)
+	    ++name;
+	for (r = ignores->rules; r != NULL; r = r->link) {
+	    const char *subject = r->anchored ? name : leaf;
+
+	    if (r->dir_only && !is_dir)
+		continue;
+	    if (r->literal
+		? !strcmp(r->text, subject)
+		: glob_match(r->text, subject, subject + strlen(subject))) {
+		TRACE(("** ignored %s by %s%s\n",
+		       pathname, r->negate ? "!" : "", r->text));
+		return !r->negate;
+	    }
+	}
+    }
+    return 0;
+}
+
+/*
+ * Given the pathname from the (-D) source directory, derive a corresponding
+ * name for the list of files, and the path for the (-S) source directory.
+ */
+static char *
+unmodified_name(const char *pathname, char **source)
+{
+    const char *ref_name = ((ds->all_data && !ds->unchanged)
+			    ? ds->all_data->modified
+			    : pathname);
+    char *name;
+
+    *source = NULL;
+    if (ref_name == NULL)
+	return NULL;
+
+    if (ds->prefix_opt >= 0) {
+	int level_s = count_prefix(ds->path_opt);
+	int base_s = 0;
+	int base_d = 0;
+
+	(void) skip_prefix(pathname, level_s + 1, &base_s);
+	(void) skip_prefix(ref_name, level_s + 1, &base_d);
+	name = xmalloc(2 + strlen(pathname) + strlen(ref_name));
+	sprintf(name, "%.*s%s", base_d, ref_name, base_s + pathname);
+	*source = xmalloc(strlen(ref_name) + 2 + strlen(pathname) +
+			  strlen(ds->S_option));
+	sprintf(*source, "%s%c%s",
+		ds->S_option,
+		PATHSEP,
+		base_s + pathname);
+    } else {
+	const char *mark = ds->unchanged ? ref_name : data_filename(ds->all_data);
+	int skip = 1 + (int) strlen(ds->path_opt);
+
+	name = xmalloc(strlen(ref_name) + 2 + strlen(pathname));
+	sprintf(name, "%.*s%s",
+		(int) (mark - ref_name),
+		ref_name,
+		pathname + skip);
+	*source = xmalloc(strlen(ref_name) + 2 + strlen(pathname) +
+			  strlen(ds->S_option));
+	sprintf(*source, "%s%c%.*s%s",
+		ds->S_option,
+		PATHSEP,
+		(int) (mark - ref_name),
+		ref_name,
+		pathname + skip);
+    }
+    return name;
+}
+
+/*
+ * The names in the list of modified files are kept in a hash-set while the
+ * -D directory is walked, so that each file found can be checked against the
+ * list without scanning it.  The set uses open addressing, pointing to the
+ * names in the data.
+ */
+static size_t
+listed_slot(const char *name)
+{
+    size_t n = hash_name(name) & (ds->listed_size - 1);
+
+    while (ds->listed_names[n] != NULL && strcmp(ds->listed_names[n], name))
+	n = (n + 1) & (ds->listed_size - 1);
+    return n;
+}
+
+static void
+add_listed(const char *name)
+{
+    size_t n;
+
+    if ((ds->listed_used + 1) * 2 > ds->listed_size) {
+	size_t old_size = ds->listed_size;
+	const char **old_names = ds->listed_names;
+
+	ds->listed_size = old_size ? (old_size * 2) : 1024;
+	ds->listed_names = (const char **) xmalloc(ds->listed_size * sizeof(char *));
+	memset(ds->listed_names, 0, ds->listed_size * sizeof(char *));
+	for (n = 0; n < old_size; ++n) {
+	    if (old_names[n] != NULL)
+		ds->listed_names[listed_slot(old_names[n])] = old_names[n];
+	}
+	free(old_names);
+    }
+    n = listed_slot(name);
+    if (ds->listed_names[n] == NULL) {
+	ds->listed_names[n] = name;
+	++ds->listed_used;
+    }
+}
+
+static void
+init_listed(void)
+{
+    const DATA *p;
+
+    for (p = ds->all_data; p != NULL; p = p->link) {
+	add_listed(p->modified);
+    }
+}
+
+static void
+free_listed(void)
+{
+    free(ds->listed_names);
+    ds->listed_names = NULL;
+    ds->listed_size = 0;
+    ds->listed_used = 0;
+}
+
+/*
+ * Check if the name appears in the list of modified files.
+ */
+static int
+listed_name(const char *name)
+{
+    return (ds->listed_size != 0
+	    && ds->listed_names[listed_slot(name)] != NULL);
+}
+
+/*
+ * Add an unmodified file to the list of files, given its line-count.
+ */
+static void
+add_unmodified(DATA * p, int count, long *files, long *lines)
+{
+    *files += 1;
+    EqlOf(p) = count;
+    *lines += EqlOf(p);
+
+    if (ds->unchanged) {
+	int len = columns_of(p->modified);
+	if (ds->min_name_wide < (len - p->base))
+	    ds->min_name_wide = (len - p->base);
+    }
+}
+
+/*
+ * The pathname of the directory being walked is kept in a buffer, appending
+ * each entry's name in turn, rather than allocating a string for each entry.
+ */
+typedef struct {
+    char *text;
+    size_t used;
+    size_t size;
+} PATH_BUF;
+
+static void
+init_path(PATH_BUF * path, const char *pathname)
+{
+    path->used = strlen(pathname);
+    path->size = path->used + 256;
+    path->text = strcpy((char *) xmalloc(path->size), pathname);
+}
+
+/*
+ * Append a name to the buffer, returning the length to which it should be
+ * restored afterward.
+ */
+static size_t
+append_path(PATH_BUF * path, const char *leaf)
+{
+    size_t mark = path->used;
+    size_t need = mark + 2 + strlen(leaf);
+
+    if (need > path->size) {
+	path->size = need * 2;
+	path->text = (char *) realloc(path->text, path->size);
+	if (path->text == NULL)
+	    failed("realloc");
+    }
+    path->text[path->used++] = PATHSEP;
+    strcpy(path->text + path->used, leaf);
+    path->used += strlen(leaf);
+    return mark;
+}
+
+static void
+restore_path(PATH_BUF * path, size_t mark)
+{
+    path->text[path->used = mark] = EOS;
+}
+
+/*
+ * Return the type of a directory entry, like get_stat().  Most filesystems
+ * give the type in the entry itself, otherwise stat it relative to the
+ * directory, falling back to the pathname.
+ */
+static mode_t
+entry_type(DIR *dp, const struct dirent *de, const char *pathname)
+{
+#ifdef USE_D_TYPE
+    switch (de->d_type) {
+    case DT_DIR:
+	return S_IFDIR;
+    case DT_REG:
+	return S_IFREG;
+    case DT_UNKNOWN:
+	break;
+#ifndef HAVE_LSTAT
+    case DT_LNK:
+	break;
+#endif
+    default:
+	return 0;
+    }
+#endif
+#ifdef USE_OPENAT
+    {
+	struct stat sb;
+#ifdef HAVE_LSTAT
+	int flags = AT_SYMLINK_NOFOLLOW;
+#else
+	int flags = 0;
+#endif
+	(void) pathname;
+	return ((fstatat(dirfd(dp), de->d_name, &sb, flags) == 0)
+		? (sb.st_mode & S_IFMT)
+		: 0);
+    }
+#else
+    (void) dp;
+    (void) de;
+    return get_stat(pathname);
+#endif
+}
+
+/*
+ * Open a subdirectory, relative to its parent if we can.
+ */
+static DIR *
+open_subdir(DIR *parent, const char *leaf, const char *pathname)
+{
+#ifdef USE_OPENAT
+    DIR *result = NULL;
+    int fd = openat(dirfd(parent), leaf, O_RDONLY | O_DIRECTORY);
+
+    (void) pathname;
+    if (fd >= 0 && (result = fdopendir(fd)) == NULL)
+	(void) close(fd);
+    return result;
+#else
+    (void) parent;
+    (void) leaf;
+    return opendir(pathname);
+#endif
+}
+
+static void
+count_unmodified_file(const char *pathname, long *files, long *lines)
+{
+    /*
+     * Given the pathname from the (-D) source directory, derive a
+     * corresponding path for the source directory.  Then check if
+     * that path appears in the list of modified files.
+     */
+    char *source;
+    char *name;
+
+    TRACE(("count_unmodified_file \"%s\"\n", pathname));
+    if ((name = unmodified_name(pathname, &source)) == NULL)
+	return;
+
+    if (!filtered_name(name)
+	&& same_file(source, pathname)
+	&& !listed_name(name)) {
+	DATA *p = find_data(NULL, name);
+	add_listed(p->modified);
+	add_unmodified(p, count_lines(p), files, lines);
+    }
+    free(name);
+    free(source);
+}
+
+static void
+count_unmodified_dir(DIR *dp, PATH_BUF * path, IGNORES * parent,
+		     long *files, long *lines)
+{
+    const struct dirent *de;
+    IGNORES *ignores = dir_ignores(path->text, parent);
+
+    TRACE(("count_unmodified_dir \"%s\"\n", path->text));
+    while ((de = readdir(dp)) != NULL) {
+	size_t mark;
+	mode_t mode;
+
+	if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+	    continue;
+	mark = append_path(path, de->d_name);
+	mode = entry_type(dp, de, path->text);
+	if (ignores != NULL
+	    && ignored_path(ignores, path->text, mode == S_IFDIR)) {
+	    ;
+	} else if (mode == S_IFDIR) {
+	    if (!is_vcs_dir(de->d_name)) {
+		DIR *subdir = open_subdir(dp, de->d_name, path->text);
+		if (subdir != NULL) {
+		    count_unmodified_dir(subdir, path, ignores, files, lines);
+		    closedir(subdir);
+		}
+	    }
+	} else if (mode == S_IFREG) {
+	    count_unmodified_file(path->text, files, lines);
+	}
+	restore_path(path, mark);
+    }
+    free_ignores(ignores, parent);
+}
+
+/*
+ * A manifest given for -D lists the files which we would find by walking the
+ * directory.
+ */
+static void
+count_manifest_files(const MANIFEST * m, long *files, long *lines)
+{
+    PATH_BUF path;
+    unsigned long n;
+
+    init_path(&path, m->path);
+    for (n = 0; n < m->count; ++n) {
+	size_t mark = append_path(&path, manifest_name(m, n));
+	count_unmodified_file(path.text, files, lines);
+	restore_path(&path, mark);
+    }
+    free(path.text);
+}
+
+static void
+count_unmodified_files(const char *pathname, long *files, long *lines)
+{
+    mode_t mode = get_stat(pathname);
+
+    if (ds->D_manifest != NULL && !strcmp(pathname, ds->D_manifest->path)) {
+	count_manifest_files(ds->D_manifest, files, lines);
+    } else if (mode == S_IFDIR) {
+	DIR *dp = opendir(pathname);
+
+	if (dp != NULL) {
+	    PATH_BUF path;
+	    IGNORES root;
+
+	    init_path(&path, pathname);
+	    count_unmodified_dir(dp, &path, root_ignores(pathname, &root),
+				 files, lines);
+	    free(path.text);
+	    closedir(dp);
+	}
+    } else if (mode == S_IFREG) {
+	count_unmodified_file(pathname, files, lines);
+    }
+}
+
+/*
+ * Walk a directory for --build-manifest or --compare, collecting its regular
+ * files.  Only a manifest needs their contents.
+ */
+static void
+list_dir(DIR *dp, PATH_BUF * path, size_t skip, IGNORES * parent,
+	 MF_LIST * list, int contents)
+{
+    const struct dirent *de;
+    IGNORES *ignores = dir_ignores(path->text, parent);
+
+    while ((de = readdir(dp)) != NULL) {
+	size_t mark;
+	mode_t mode;
+
+	if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+	    continue;
+	mark = append_path(path, de->d_name);
+	mode = entry_type(dp, de, path->text);
+	if (ignores != NULL
+	    && ignored_path(ignores, path->text, mode == S_IFDIR)) {
+	    ;
+	} else if (mode == S_IFDIR) {
+	    if (!is_vcs_dir(de->d_name)) {
+		DIR *subdir = open_subdir(dp, de->d_name, path->text);
+		if (subdir != NULL) {
+		    list_dir(subdir, path, skip, ignores, list, contents);
+		    closedir(subdir);
+		}
+	    }
+	} else if (mode == S_IFREG) {
+	    int fd;
+
+	    if (!contents) {
+		CONTENTS none;
+
+		memset(&none, 0, sizeof(none));
+		add_mf_item(list, new_string(path->text + skip), &none);
+	    } else if ((fd = open(path->text, O_RDONLY)) >= 0) {
+		struct stat sb;
+		SCAN scan;
+
+		begin_scan(&scan);
+		scan.digesting = 1;
+		scan_file(fd, (fstat(fd, &sb) == 0) ? &sb : NULL, &scan);
+		(void) close(fd);
+
+		add_mf_item(list, new_string(path->text + skip), &scan.data);
+	    } else {
+		cannot_open(path->text);
+	    }
+	}
+	restore_path(path, mark);
+    }
+    free_ignores(ignores, parent);
+}
+
+/*
+ * Write a manifest of the given directory to the standard output.
+ */
+static int
+build_manifest(const char *pathname)
+{
+    DIR *dp;
+    MF_LIST list;
+    PATH_BUF path;
+    IGNORES root;
+    unsigned char *image;
+    size_t length;
+
+    if (get_stat(pathname) != S_IFDIR || (dp = opendir(pathname)) == NULL) {
+	(void) fflush(stdout);
+	fprintf(stderr, "Not a directory:%s\n", pathname);
+	return EXIT_FAILURE;
+    }
+    if (isatty(fileno(stdout))) {
+	fprintf(stderr, "The manifest should be redirected to a file\n");
+	closedir(dp);
+	return EXIT_FAILURE;
+    }
+
+    memset(&list, 0, sizeof(list));
+    init_path(&path, pathname);
+    list_dir(dp, &path, path.used + 1,
+	     root_ignores(pathname, &root), &list, 1);
+    closedir(dp);
+    free(path.text);
+    image = manifest_image(&list, &length);
+    (void) fwrite(image, length, (size_t) 1, stdout);
+    free(image);
+
+    if (fflush(stdout) != 0 || ferror(stdout)) {
+	perror("stdout");
+	return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+#if USE_THREADS
+/*
+ * With threads, the -D tree is walked by a pool of workers.  Each worker has
+ * a deque of directories.  It takes the newest directory from its own deque,
+ * and when that is empty, steals the oldest from another worker.  Comparing
+ * and counting the files is done by the workers, which record the unmodified
+ * files in each directory's list in the order they were read.  After the walk,
+ * those lists are added to the data in the same order as the serial walk.
+ */
+typedef struct _walk_item {
+    struct _walk_item *link;
+    struct _walk_dir *subdir;	/* if non-null, the item is a directory */
+    char *name;			/* name for the list of files */
+    char *counted;		/* the file which could not be counted */
+    int lines;			/* line-count, or -1 if it could not be opened */
+    int estimated;		/* true if the line-count is estimated */
+} WALK_ITEM;
+
+typedef struct _walk_dir {
+    char *path;
+    IGNORES *parent;		/* ignore-rules from the enclosing directory */
+    IGNORES *ignores;		/* ignore-rules used in this directory */
+    WALK_ITEM *items;
+    WALK_ITEM *last;
+} WALK_DIR;
+
+typedef struct {
+    pthread_mutex_t lock;
+    WALK_DIR **tasks;
+    size_t head;		/* oldest task, which may be stolen */
+    size_t tail;		/* past the newest task */
+    size_t size;
+} WALK_DEQUE;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    size_t queued;		/* directories waiting in a deque */
+    size_t pending;		/* directories waiting or being read */
+    int workers;
+    WALK_DEQUE *deques;
+    DIFFSTAT *context;		/* the context of the thread which started */
+} WALK_POOL;
+
+typedef struct {
+    WALK_POOL *pool;
+    int index;
+} WALK_WORKER;
+
+static int
+walk_threads(void)
+{
+    long result = ds->jobs_opt;
+
+#if defined(HAVE_SYSCONF) && defined(_SC_NPROCESSORS_ONLN)
+    if (result <= 0)
+	result = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return (result > 1) ? (int) result : 1;
+}
+
+static WALK_DIR *
+new_walk_dir(char *path, IGNORES * parent)
+{
+    WALK_DIR *result = (WALK_DIR *) xmalloc(sizeof(WALK_DIR));
+
+    result->path = path;
+    result->parent = parent;
+    result->ignores = parent;
+    result->items = NULL;
+    result->last = NULL;
+    return result;
+}
+
+/*
+ * Only the worker which reads a directory adds items to it.
+ */
+static WALK_ITEM *
+new_walk_item(WALK_DIR * dir)
+{
+    WALK_ITEM *result = (WALK_ITEM *) xmalloc(sizeof(WALK_ITEM));
+
+    memset(result, 0, sizeof(*result));
+    if (dir->last != NULL)
+	dir->last->link = result;
+    else
+	dir->items = result;
+    dir->last = result;
+    return result;
+}
+
+static void
+push_walk(WALK_WORKER * me, WALK_DIR * dir)
+{
+    WALK_POOL *pool = me->pool;
+    WALK_DEQUE *dq = &pool->deques[me->index];
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail >= dq->size) {
+	if (dq->head != 0) {
+	    memmove(dq->tasks, dq->tasks + dq->head,
+		    (dq->tail - dq->head) * sizeof(WALK_DIR *));
+	    dq->tail -= dq->head;
+	    dq->head = 0;
+	} else {
+	    dq->size = (dq->size != 0) ? (dq->size * 2) : 64;
+	    dq->tasks = (WALK_DIR **) realloc(dq->tasks,
+					      dq->size * sizeof(WALK_DIR *));
+	    if (dq->tasks == NULL)
+		failed("realloc");
+	}
+    }
+    dq->tasks[dq->tail++] = dir;
+    pthread_mutex_unlock(&dq->lock);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->queued++;
+    pool->pending++;
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static WALK_DIR *
+pop_walk(WALK_WORKER * me)
+{
+    WALK_POOL *pool = me->pool;
+    WALK_DIR *result = NULL;
+    int n;
+
+    for (n = 0; n < pool->workers && result == NULL; ++n) {
+	WALK_DEQUE *dq = &pool->deques[(me->index + n) % pool->workers];
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail > dq->head) {
+	    result = ((n == 0)
+		      ? dq->tasks[--(dq->tail)]
+		      : dq->tasks[(dq->head)++]);
+	    if (dq->head == dq->tail)
+		dq->head = dq->tail = 0;
+	}
+	pthread_mutex_unlock(&dq->lock);
+    }
+    if (result != NULL) {
+	pthread_mutex_lock(&pool->lock);
+	pool->queued--;
+	pthread_mutex_unlock(&pool->lock);
+    }
+    return result;
+}
+
+/*
+ * Compare a file, and if it is unmodified, record its line-count.  The data
+ * is not changed during the walk.
+ */
+static void
+walk_file(WALK_DIR * dir, const char *pathname)
+{
+    char *source;
+    char *name;
+
+    if ((name = unmodified_name(pathname, &source)) != NULL) {
+	if (!filtered_name(name)
+	    && same_file(source, pathname)
+	    && !listed_name(name)) {
+	    WALK_ITEM *item = new_walk_item(dir);
+	    DATA find;
+	    int base = 0;
+
+	    if (ds->prefix_opt >= 0) {
+		(void) skip_prefix(name, ds->prefix_opt, &base);
+	    }
+	    init_data(&find, NULL, name, 1, base);
+	    item->counted = reference_name(&find);
+	    if ((item->lines = count_file_lines(item->counted,
+						&item->estimated)) >= 0) {
+		free(item->counted);
+		item->counted = NULL;
+	    }
+	    item->name = name;
+	    name = NULL;
+	}
+	free(name);
+	free(source);
+    }
+}
+
+static void
+walk_directory(WALK_WORKER * me, WALK_DIR * dir)
+{
+    DIR *dp = opendir(dir->path);
+
+    if (dp != NULL) {
+	const struct dirent *de;
+	PATH_BUF path;
+
+	dir->ignores = dir_ignores(dir->path, dir->parent);
+	init_path(&path, dir->path);
+	while ((de = readdir(dp)) != NULL) {
+	    size_t mark;
+	    mode_t mode;
+
+	    if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+		continue;
+	    mark = append_path(&path, de->d_name);
+	    mode = entry_type(dp, de, path.text);
+	    if (dir->ignores != NULL
+		&& ignored_path(dir->ignores, path.text, mode == S_IFDIR)) {
+		;
+	    } else if (mode == S_IFDIR) {
+		if (!is_vcs_dir(de->d_name)) {
+		    WALK_DIR *subdir = new_walk_dir(new_string(path.text),
+						    dir->ignores);
+		    new_walk_item(dir)->subdir = subdir;
+		    push_walk(me, subdir);
+		}
+	    } else if (mode == S_IFREG) {
+		walk_file(dir, path.text);
+	    }
+	    restore_path(&path, mark);
+	}
+	free(path.text);
+	closedir(dp);
+    }
+}
+
+static void *
+walk_worker(void *arg)
+{
+    WALK_WORKER *me = (WALK_WORKER *) arg;
+    WALK_POOL *pool = me->pool;
+
+    ds = pool->context;
+    for (;;) {
+	WALK_DIR *dir = pop_walk(me);
+
+	if (dir != NULL) {
+	    walk_directory(me, dir);
+	    pthread_mutex_lock(&pool->lock);
+	    if (--(pool->pending) == 0)
+		pthread_cond_broadcast(&pool->wake);
+	    pthread_mutex_unlock(&pool->lock);
+	} else {
+	    int done;
+
+	    pthread_mutex_lock(&pool->lock);
+	    while (pool->queued == 0 && pool->pending != 0)
+		pthread_cond_wait(&pool->wake, &pool->lock);
+	    done = (pool->pending == 0);
+	    pthread_mutex_unlock(&pool->lock);
+	    if (done)
+		break;
+	}
+    }
+    return NULL;
+}
+
+/*
+ * Add the files found by the workers, in the order of the serial walk.
+ */
+static void
+merge_walk(WALK_DIR * dir, long *files, long *lines)
+{
+    WALK_ITEM *item;
+    WALK_ITEM *next;
+
+    for (item = dir->items; item != NULL; item = next) {
+	next = item->link;
+	if (item->subdir != NULL) {
+	    merge_walk(item->subdir, files, lines);
+	} else {
+	    DATA *p = find_data(NULL, item->name);
+	    int count = item->lines;
+
+	    if (strcmp(p->modified, item->name)) {
+		count = count_lines(p);		/* merged with another name */
+	    } else if (count < 0) {
+		cannot_open(item->counted);
+		count = 0;
+	    } else {
+		p->estimated = item->estimated;
+	    }
+	    add_unmodified(p, count, files, lines);
+	    free(item->name);
+	    free(item->counted);
+	}
+	free(item);
+    }
+    free_ignores(dir->ignores, dir->parent);
+    free(dir->path);
+    free(dir);
+}
+
+static void
+walk_unmodified_files(const char *pathname, long *files, long *lines)
+{
+    int workers = walk_threads();
+
+    if (workers > 1 && !ds->trace_opt && get_stat(pathname) == S_IFDIR) {
+	WALK_POOL pool;
+	WALK_WORKER *worker;
+	WALK_DIR *root;
+	IGNORES ignores;
+	pthread_t *threads;
+	int started;
+	int n;
+
+	TRACE(("walk_unmodified_files \"%s\" with %d threads\n",
+	       pathname, workers));
+	memset(&pool, 0, sizeof(pool));
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.wake, NULL);
+	pool.workers = workers;
+	pool.context = ds;
+	pool.deques = (WALK_DEQUE *) xmalloc((size_t) workers * sizeof(WALK_DEQUE));
+	worker = (WALK_WORKER *) xmalloc((size_t) workers * sizeof(WALK_WORKER));
+	threads = (pthread_t *) xmalloc((size_t) workers * sizeof(pthread_t));
+	for (n = 0; n < workers; ++n) {
+	    memset(&pool.deques[n], 0, sizeof(WALK_DEQUE));
+	    pthread_mutex_init(&pool.deques[n].lock, NULL);
+	    worker[n].pool = &pool;
+	    worker[n].index = n;
+	}
+
+	root = new_walk_dir(new_string(pathname),
+			    root_ignores(pathname, &ignores));
+	push_walk(&worker[0], root);
+
+	/* this thread is the first worker */
+	for (started = 1; started < workers; ++started) {
+	    if (pthread_create(&threads[started], NULL,
+			       walk_worker, &worker[started]) != 0)
+		break;
+	}
+	(void) walk_worker(&worker[0]);
+	for (n = 1; n < started; ++n) {
+	    pthread_join(threads[n], NULL);
+	}
+
+	merge_walk(root, files, lines);
+
+	for (n = 0; n < workers; ++n) {
+	    pthread_mutex_destroy(&pool.deques[n].lock);
+	    free(pool.deques[n].tasks);
+	}
+	pthread_cond_destroy(&pool.wake);
+	pthread_mutex_destroy(&pool.lock);
+	free(pool.deques);
+	free(worker);
+	free(threads);
+    } else {
+	count_unmodified_files(pathname, files, lines);
+    }
+}
+#else
+#define walk_unmodified_files(pathname, files, lines) \
+	count_unmodified_files(pathname, files, lines)
+#endif /* USE_THREADS */
+
+/*
+ * The --compare option reads no diff.  Instead it lists the -S and -D trees,
+ * and compares the files which differ line by line, counting the inserts and
+ * deletes as if they were read from "diff -ruN" of the two trees.
+ */
+#define CMP_CONTEXT	3	/* lines of context, as in "diff -u" */
+
+typedef struct {
+    char *name;			/* pathname relative to -S and -D */
+    int in_old;			/* true if the file is in the -S tree */
+    int in_new;			/* true if the file is in the -D tree */
+    int binary;			/* true if either file contains a null */
+    long *hunks;		/* inserts and deletes for each hunk */
+    size_t count;		/* number of hunks */
+    size_t size;
+} CMP_FILE;
+
+typedef struct {
+    size_t hash;
+    const char *text;
+    size_t length;		/* including the newline, if any */
+} LINE_KEY;
+
+/*
+ * Lines are compared by number, giving equal lines the same number, which is
+ * the index of the first such line in the table.
+ */
+typedef struct {
+    LINE_KEY *keys;
+    size_t used;
+    int *slots;			/* hash-table of indices into keys[] */
+    size_t mask;
+} LINE_TABLE;
+
+typedef struct {
+    const int *a;		/* line-numbers of the old file */
+    const int *b;		/* line-numbers of the new file */
+    char *a_changed;		/* true for each deleted line */
+    char *b_changed;		/* true for each inserted line */
+    int *fdiag;			/* furthest point on each diagonal, forward */
+    int *bdiag;			/* ...and backward */
+} LINE_DIFF;
+
+/*
+ * Read a whole file into memory, returning null if it cannot be read.
+ */
+static char *
+read_text(const char *filename, size_t *length)
+{
+    char *result = NULL;
+    int fd;
+
+    *length = 0;
+    if ((fd = open(filename, O_RDONLY)) >= 0) {
+	struct stat sb;
+
+	if (fstat(fd, &sb) == 0
+	    && (off_t) (size_t) sb.st_size == sb.st_size) {
+	    size_t want = (size_t) sb.st_size;
+
+	    result = (char *) xmalloc(want + 1);
+	    *length = read_block(fd, result, want);
+	}
+	(void) close(fd);
+    }
+    if (result == NULL)
+	cannot_open(filename);
+    return result;
+}
+
+static size_t
+count_text_lines(const char *text, size_t length)
+{
+    const char *last = text + length;
+    size_t result = 0;
+
+    while (text < last) {
+	const char *next = memchr(text, '\n', (size_t) (last - text));
+	++result;
+	if (next == NULL)
+	    break;
+	text = next + 1;
+    }
+    return result;
+}
+
+/*
+ * Number the lines of a file, using the table to give equal lines the same
+ * number.
+ */
+static int *
+number_lines(LINE_TABLE * table, const char *text, size_t length, size_t *count)
+{
+    const char *last = text + length;
+    int *result = (int *) xmalloc((count_text_lines(text, length) + 1)
+				  * sizeof(int));
+
+    *count = 0;
+    while (text < last) {
+	const char *next = memchr(text, '\n', (size_t) (last - text));
+	size_t size = (next != NULL) ? (size_t) (next + 1 - text)
+	: (size_t) (last - text);
+	size_t hash = hash_part(text, size);
+	size_t n = hash & table->mask;
+	int *slot;
+
+	while (*(slot = &table->slots[n]) >= 0) {
+	    const LINE_KEY *key = &table->keys[*slot];
+	    if (key->hash == hash
+		&& key->length == size
+		&& !memcmp(key->text, text, size))
+		break;
+	    n = (n + 1) & table->mask;
+	}
+	if (*slot < 0) {
+	    LINE_KEY *key = &table->keys[table->used];
+	    key->hash = hash;
+	    key->text = text;
+	    key->length = size;
+	    *slot = (int) table->used++;
+	}
+	result[(*count)++] = *slot;
+	text += size;
+    }
+    return result;
+}
+
+/*
+ * Find the middle snake of the shortest edit script for a[xoff..xlim) and
+ * b[yoff..ylim), using Myers' algorithm from both ends at once.  Diagonals
+ * which are not yet reached hold a point outside the range.
+ */
+static void
+middle_snake(LINE_DIFF * ld, int xoff, int xlim, int yoff, int ylim,
+	     int *px, int *py)
+{
+    const int *a = ld->a;
+    const int *b = ld->b;
+    int *fd = ld->fdiag;
+    int *bd = ld->bdiag;
+    int dmin = xoff - ylim;
+    int dmax = xlim - yoff;
+    int fmid = xoff - yoff;
+    int bmid = xlim - ylim;
+    int fmin = fmid;
+    int fmax = fmid;
+    int bmin = bmid;
+    int bmax = bmid;
+    int odd = (fmid - bmid) & 1;
+
+    fd[fmid] = xoff;
+    bd[bmid] = xlim;
+    for (;;) {
+	int d;
+
+	if (fmin > dmin)
+	    fd[--fmin - 1] = -1;
+	else
+	    ++fmin;
+	if (fmax < dmax)
+	    fd[++fmax + 1] = -1;
+	else
+	    --fmax;
+	for (d = fmax; d >= fmin; d -= 2) {
+	    int lo = fd[d - 1];
+	    int hi = fd[d + 1];
+	    int x = (lo >= hi) ? lo + 1 : hi;
+	    int y = x - d;
+
+	    while (x < xlim && y < ylim && a[x] == b[y]) {
+		++x;
+		++y;
+	    }
+	    fd[d] = x;
+	    if (odd && bmin <= d && d <= bmax && bd[d] <= x) {
+		*px = x;
+		*py = y;
+		return;
+	    }
+	}
+
+	if (bmin > dmin)
+	    bd[--bmin - 1] = xlim + 1;
+	else
+	    ++bmin;
+	if (bmax < dmax)
+	    bd[++bmax + 1] = xlim + 1;
+	else
+	    --bmax;
+	for (d = bmax; d >= bmin; d -= 2) {
+	    int lo = bd[d - 1];
+	    int hi = bd[d + 1];
+	    int x = (lo < hi) ? lo : hi - 1;
+	    int y = x - d;
+
+	    while (x > xoff && y > yoff && a[x - 1] == b[y - 1]) {
+		--x;
+		--y;
+	    }
+	    bd[d] = x;
+	    if (!odd && fmin <= d && d <= fmax && x <= fd[d]) {
+		*px = x;
+		*py = y;
+		return;
+	    }
+	}
+    }
+}
+
+/*
+ * Mark the lines which are deleted from a[] or inserted in b[].
+ */
+static void
+compare_lines(LINE_DIFF * ld, int xoff, int xlim, int yoff, int ylim)
+{
+    while (xoff < xlim && yoff < ylim && ld->a[xoff] == ld->b[yoff]) {
+	++xoff;
+	++yoff;
+    }
+    while (xlim > xoff && ylim > yoff && ld->a[xlim - 1] == ld->b[ylim - 1]) {
+	--xlim;
+	--ylim;
+    }
+    if (xoff == xlim) {
+	while (yoff < ylim)
+	    ld->b_changed[yoff++] = 1;
+    } else if (yoff == ylim) {
+	while (xoff < xlim)
+	    ld->a_changed[xoff++] = 1;
+    } else {
+	int x, y;
+
+	middle_snake(ld, xoff, xlim, yoff, ylim, &x, &y);
+	compare_lines(ld, xoff, x, yoff, y);
+	compare_lines(ld, x, xlim, y, ylim);
+    }
+}
+
+/*
+ * Slide each run of changes in one file over equal lines, to merge it with
+ * the neighboring runs and align it with a run in the other file, as "diff"
+ * does.  Both arrays have a zero before and after the lines.
+ */
+static void
+shift_changes(char *changed, const int *equivs, int i_end,
+	      const char *other_changed)
+{
+    int i = 0;
+    int j = 0;
+
+    for (;;) {
+	int runlength;
+	int start;
+	int corresponding;
+
+	while (i < i_end && !changed[i]) {
+	    while (other_changed[j++])
+		;
+	    i++;
+	}
+	if (i == i_end)
+	    break;
+	start = i;
+	while (changed[++i])
+	    ;
+	while (other_changed[j])
+	    j++;
+
+	do {
+	    runlength = i - start;
+
+	    /* merge with the previous run while the lines allow it */
+	    while (start && equivs[start - 1] == equivs[i - 1]) {
+		changed[--start] = 1;
+		changed[--i] = 0;
+		while (changed[start - 1])
+		    start--;
+		while (other_changed[--j])
+		    ;
+	    }
+
+	    corresponding = other_changed[j - 1] ? i : i_end;
+
+	    /* ...and with the following run */
+	    while (i != i_end && equivs[start] == equivs[i]) {
+		changed[start++] = 0;
+		changed[i++] = 1;
+		while (changed[i])
+		    i++;
+		while (other_changed[++j])
+		    corresponding = i;
+	    }
+	} while (runlength != i - start);
+
+	/* move back to the run in the other file, if there was one */
+	while (corresponding < i) {
+	    changed[--start] = 1;
+	    changed[--i] = 0;
+	    while (other_changed[--j])
+		;
+	}
+    }
+}
+
+static void
+add_hunk(CMP_FILE * f, long inserts, long deletes)
+{
+    if (f->count >= f->size) {
+	f->size = (f->size != 0) ? (f->size * 2) : 4;
+	f->hunks = (long *) realloc(f->hunks, 2 * f->size * sizeof(long));
+	if (f->hunks == NULL)
+	    failed("realloc");
+    }
+    f->hunks[2 * f->count] = inserts;
+    f->hunks[2 * f->count + 1] = deletes;
+    f->count++;
+}
+
+/*
+ * Group the changes into hunks as "diff -u" would, joining those which are
+ * separated by no more than twice the context.
+ */
+static void
+collect_hunks(CMP_FILE * f, const LINE_DIFF * ld, size_t n, size_t m)
+{
+    size_t i = 0;
+    size_t j = 0;
+    size_t same = 0;
+    long inserts = 0;
+    long deletes = 0;
+    int active = 0;
+
+    while (i < n || j < m) {
+	if (i < n && j < m && !ld->a_changed[i] && !ld->b_changed[j]) {
+	    ++i;
+	    ++j;
+	    ++same;
+	} else {
+	    if (active && same > 2 * CMP_CONTEXT) {
+		add_hunk(f, inserts, deletes);
+		inserts = deletes = 0;
+	    }
+	    while (i < n && ld->a_changed[i]) {
+		++i;
+		++deletes;
+	    }
+	    while (j < m && ld->b_changed[j]) {
+		++j;
+		++inserts;
+	    }
+	    active = 1;
+	    same = 0;
+	}
+    }
+    if (active)
+	add_hunk(f, inserts, deletes);
+}
+
+static char *
+tree_name(const char *tree, const char *name)
+{
+    char *result = (char *) xmalloc(strlen(tree) + strlen(name) + 2);
+
+    sprintf(result, "%s%c%s", tree, PATHSEP, name);
+    return result;
+}
+
+/*
+ * Compare the two versions of a file, either of which may be missing.
+ */
+static void
+compare_file(CMP_FILE * f)
+{
+    char *old_name = tree_name(ds->S_option, f->name);
+    char *new_name = tree_name(ds->D_option, f->name);
+    char *old_text = NULL;
+    char *new_text = NULL;
+    size_t old_len = 0;
+    size_t new_len = 0;
+
+    if ((!f->in_old || (old_text = read_text(old_name, &old_len)) != NULL)
+	&& (!f->in_new || (new_text = read_text(new_name, &new_len)) != NULL)) {
+	if ((old_len != 0 && memchr(old_text, EOS, old_len) != NULL)
+	    || (new_len != 0 && memchr(new_text, EOS, new_len) != NULL)) {
+	    f->binary = 1;
+	} else {
+	    LINE_TABLE table;
+	    LINE_DIFF ld;
+	    int *a;
+	    int *b;
+	    size_t n, m;
+
+	    table.used = 0;
+	    table.mask = 1024;
+	    n = count_text_lines(old_text, old_len);
+	    m = count_text_lines(new_text, new_len);
+	    while (table.mask < 2 * (n + m))
+		table.mask *= 2;
+	    table.keys = (LINE_KEY *) xmalloc((n + m + 1) * sizeof(LINE_KEY));
+	    table.slots = (int *) xmalloc(table.mask * sizeof(int));
+	    memset(table.slots, 0xff, table.mask * sizeof(int));
+	    table.mask -= 1;
+
+	    a = number_lines(&table, old_text, old_len, &n);
+	    b = number_lines(&table, new_text, new_len, &m);
+
+	    ld.a = a;
+	    ld.b = b;
+	    ld.a_changed = (char *) xmalloc(n + 2) + 1;
+	    ld.b_changed = (char *) xmalloc(m + 2) + 1;
+	    memset(ld.a_changed - 1, 0, n + 2);
+	    memset(ld.b_changed - 1, 0, m + 2);
+	    ld.fdiag = (int *) xmalloc((n + m + 3) * sizeof(int));
+	    ld.bdiag = (int *) xmalloc((n + m + 3) * sizeof(int));
+	    ld.fdiag += m + 1;
+	    ld.bdiag += m + 1;
+
+	    compare_lines(&ld, 0, (int) n, 0, (int) m);
+	    shift_changes(ld.a_changed, a, (int) n, ld.b_changed);
+	    shift_changes(ld.b_changed, b, (int) m, ld.a_changed);
+	    collect_hunks(f, &ld, n, m);
+
+	    free(ld.fdiag - (m + 1));
+	    free(ld.bdiag - (m + 1));
+	    free(ld.a_changed - 1);
+	    free(ld.b_changed - 1);
+	    free(a);
+	    free(b);
+	    free(table.keys);
+	    free(table.slots);
+	}
+    }
+    free(old_text);
+    free(new_text);
+    free(old_name);
+    free(new_name);
+}
+
+/*
+ * Pair the files of two sorted lists, keeping those which may differ.
+ */
+static CMP_FILE *
+pair_files(MF_LIST * old_list, MF_LIST * new_list, size_t *count)
+{
+    CMP_FILE *result;
+    size_t i = 0;
+    size_t j = 0;
+
+    result = (CMP_FILE *) xmalloc((old_list->count + new_list->count + 1)
+				  * sizeof(CMP_FILE));
+    *count = 0;
+    while (i < old_list->count || j < new_list->count) {
+	CMP_FILE *f = &result[*count];
+	int cmp;
+
+	if (i >= old_list->count) {
+	    cmp = 1;
+	} else if (j >= new_list->count) {
+	    cmp = -1;
+	} else {
+	    cmp = strcmp(old_list->items[i].name, new_list->items[j].name);
+	}
+	memset(f, 0, sizeof(*f));
+	if (cmp <= 0) {
+	    f->name = old_list->items[i++].name;
+	    f->in_old = 1;
+	}
+	if (cmp >= 0) {
+	    if (f->name != NULL)
+		free(new_list->items[j].name);
+	    else
+		f->name = new_list->items[j].name;
+	    ++j;
+	    f->in_new = 1;
+	}
+	if (f->in_old && f->in_new) {
+	    char *old_name = tree_name(ds->S_option, f->name);
+	    char *new_name = tree_name(ds->D_option, f->name);
+	    int same = same_file(old_name, new_name);
+
+	    free(old_name);
+	    free(new_name);
+	    if (same) {
+		free(f->name);
+		continue;
+	    }
+	}
+	++(*count);
+    }
+    return result;
+}
+
+static int
+list_tree(const char *pathname, MF_LIST * list)
+{
+    DIR *dp;
+
+    memset(list, 0, sizeof(*list));
+    if (get_stat(pathname) == S_IFDIR && (dp = opendir(pathname)) != NULL) {
+	PATH_BUF path;
+	IGNORES root;
+
+	init_path(&path, pathname);
+	list_dir(dp, &path, path.used + 1,
+		 root_ignores(pathname, &root), list, 0);
+	closedir(dp);
+	free(path.text);
+	if (list->count != 0)
+	    qsort(list->items, list->count, sizeof(MF_ITEM), compare_mf_items);
+	return 1;
+    }
+    (void) fflush(stdout);
+    fprintf(stderr, "Not a directory:%s\n", pathname);
+    return 0;
+}
+
+#if USE_THREADS
+/*
+ * With threads, the files are compared by a pool of workers, each taking the
+ * next pair from the list.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    CMP_FILE *list;
+    size_t count;		/* number of entries in list[] */
+    size_t next;		/* index of the next entry to compare */
+    DIFFSTAT *context;		/* the context of the thread which started */
+} CMP_POOL;
+
+static void *
+compare_worker(void *arg)
+{
+    CMP_POOL *pool = (CMP_POOL *) arg;
+
+    ds = pool->context;
+    for (;;) {
+	size_t n;
+
+	pthread_mutex_lock(&pool->lock);
+	n = pool->next;
+	if (n < pool->count)
+	    pool->next++;
+	pthread_mutex_unlock(&pool->lock);
+	if (n >= pool->count)
+	    break;
+
+	compare_file(&pool->list[n]);
+    }
+    return NULL;
+}
+
+static void
+thread_compare_files(CMP_FILE * list, size_t count, int workers)
+{
+    CMP_POOL pool;
+    pthread_t *threads;
+    int started;
+    int n;
+
+    if ((size_t) workers > count)
+	workers = (int) count;
+
+    TRACE(("thread_compare_files %lu files with %d threads\n",
+	   (unsigned long) count, workers));
+    memset(&pool, 0, sizeof(pool));
+    pool.list = list;
+    pool.context = ds;
+    pool.count = count;
+    pthread_mutex_init(&pool.lock, NULL);
+
+    /* this thread is the first worker */
+    threads = (pthread_t *) xmalloc((size_t) workers * sizeof(pthread_t));
+    for (started = 1; started < workers; ++started) {
+	if (pthread_create(&threads[started], NULL, compare_worker, &pool) != 0)
+	    break;
+    }
+    (void) compare_worker(&pool);
+    for (n = 1; n < started; ++n) {
+	pthread_join(threads[n], NULL);
+    }
+
+    pthread_mutex_destroy(&pool.lock);
+    free(threads);
+}
+#endif /* USE_THREADS */
+
+/*
+ * Compare the -S and -D trees, adding the files which differ to the data.
+ * The unchanged files are found by summarize(), as for a diff.
+ */
+static int
+compare_trees(void)
+{
+    MF_LIST old_list;
+    MF_LIST new_list;
+    CMP_FILE *list;
+    size_t count;
+    size_t n;
+
+    if (!list_tree(ds->S_option, &old_list)) {
+	return 0;
+    } else if (!list_tree(ds->D_option, &new_list)) {
+	free(old_list.items);
+	return 0;
+    }
+    list = pair_files(&old_list, &new_list, &count);
+    free(old_list.items);
+    free(new_list.items);
+
+#if USE_THREADS
+    if (!ds->trace_opt && count > 1 && walk_threads() > 1) {
+	thread_compare_files(list, count, walk_threads());
+    } else
+#endif
+    {
+	for (n = 0; n < count; ++n)
+	    compare_file(&list[n]);
+    }
+
+    for (n = 0; n < count; ++n) {
+	CMP_FILE *f = &list[n];
+
+	if (f->binary || f->count != 0) {
+	    char *name = tree_name(ds->D_option, f->name);
+	    DATA *p = find_data(NULL, name);
+
+	    if (f->binary) {
+		p->cmt = Binary;
+	    } else {
+		size_t h;
+
+		for (h = 0; h < f->count; ++h) {
+		    long k;
+
+		    for (k = 0; k < f->hunks[2 * h]; ++k)
+			update_chunk(p, cInsert);
+		    for (k = 0; k < f->hunks[2 * h + 1]; ++k)
+			update_chunk(p, cDelete);
+		    finish_chunk(p);
+		}
+	    }
+	    free(name);
+	}
+	free(f->hunks);
+	free(f->name);
+    }
+    free(list);
+    return 1;
+}
+#endif /* HAVE_OPENDIR */
+
+static void
+update_min_name_wide(long longest_name)
+{
+    if (ds->prefix_opt < 0) {
+	if (ds->prefix_len < 0)
+	    ds->prefix_len = 0;
+	if ((longest_name - ds->prefix_len) > ds->min_name_wide)
+	    ds->min_name_wide = (int) (longest_name - ds->prefix_len);
+    }
+
+    if (ds->min_name_wide < 1)
+	ds->min_name_wide = 0;
+    ds->min_name_wide++;		/* make sure it's nonzero */
+}
+
+/*
+ * Keep the prefetching of reference files a few entries ahead of the one for
+ * which count_lines() is called.  The 'lead' parameter tracks how far 'ahead'
+ * is past the current entry.
+ */
+static DATA *
+prefetch_lines(DATA * ahead, int *lead)
+{
+    while (ahead != NULL && *lead < READ_AHEAD) {
+	if (!ignore_data(ahead)) {
+	    char *filename = reference_name(ahead);
+	    will_need(filename);
+	    free(filename);
+	}
+	ahead = ahead->link;
+	*lead += 1;
+    }
+    *lead -= 1;
+    return ahead;
+}
+
+#if USE_IO_URING
+/*
+ * On Linux, io_uring lets a single thread keep many reads of the reference
+ * files in flight.  Each slot holds one file, which is opened, read in blocks
+ * and closed by a chain of requests, each submitted when the previous one is
+ * completed.  The kernel may not support io_uring (or its opcodes), in which
+ * case the caller falls back to threads or the serial loop.
+ */
+#define URING_DEPTH  32		/* number of files read at once */
+
+typedef enum {
+    uOpen = 0
+    ,uRead
+    ,uClose
+} URING_STATE;
+
+typedef struct {
+    int fd;			/* the io_uring instance */
+    void *ring;			/* the submission and completion rings */
+    size_t ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned queued;		/* requests not yet submitted */
+} URING;
+
+typedef struct {
+    URING_STATE state;
+    size_t entry;		/* index in the list of files */
+    char *filename;
+    int fd;			/* the open file, or -1 */
+    int busy;			/* true if a request is in flight */
+    int have_stat;		/* true if sb can be used for the cache */
+    struct stat sb;
+    unsigned long long offset;
+    SCAN scan;
+    char *buffer;
+} URING_SLOT;
+
+static int
+uring_setup(URING * ring, unsigned entries)
+{
+    struct io_uring_params params;
+    size_t sq_size;
+    size_t cq_size;
+    char *base;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    if ((ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params)) < 0)
+	return 0;
+
+    /* the "current position" feature came with the open/read/close opcodes */
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)
+	|| !(params.features & IORING_FEAT_RW_CUR_POS)) {
+	(void) close(ring->fd);
+	return 0;
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+    ring->ring = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+		      MAP_SHARED, ring->fd, (off_t) IORING_OFF_SQ_RING);
+    if (ring->ring == MAP_FAILED) {
+	(void) close(ring->fd);
+	return 0;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *) mmap(NULL, ring->sqes_size,
+					      PROT_READ | PROT_WRITE,
+					      MAP_SHARED, ring->fd,
+					      (off_t) IORING_OFF_SQES);
+    if ((void *) ring->sqes == MAP_FAILED) {
+	(void) munmap(ring->ring, ring->ring_size);
+	(void) close(ring->fd);
+	return 0;
+    }
+
+    base = (char *) ring->ring;
+    ring->sq_tail = (unsigned *) (void *) (base + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (void *) (base + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (void *) (base + params.sq_off.array);
+    ring->cq_head = (unsigned *) (void *) (base + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (void *) (base + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (void *) (base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (void *) (base + params.cq_off.cqes);
+    return 1;
+}
+
+static void
+uring_finish(URING * ring)
+{
+    (void) munmap((void *) ring->sqes, ring->sqes_size);
+    (void) munmap(ring->ring, ring->ring_size);
+    (void) close(ring->fd);
+}
+
+/*
+ * Fill in the next submission-queue entry for the given slot.  Each slot has
+ * at most one request in flight, so the queue cannot overflow.
+ */
+static void
+uring_submit(URING * ring, URING_SLOT * slot, size_t which)
+{
+    unsigned tail = *(ring->sq_tail);
+    unsigned index = tail & *(ring->sq_mask);
+    struct io_uring_sqe *sqe = &(ring->sqes[index]);
+
+    memset(sqe, 0, sizeof(*sqe));
+    switch (slot->state) {
+    case uOpen:
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (unsigned long) slot->filename;
+	sqe->open_flags = O_RDONLY;
+	break;
+    case uRead:
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = slot->fd;
+	sqe->addr = (unsigned long) slot->buffer;
+	sqe->len = COUNT_BLOCK;
+	sqe->off = slot->offset;
+	break;
+    case uClose:
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = slot->fd;
+	break;
+    }
+    sqe->user_data = which;
+    slot->busy = 1;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+}
+
+/*
+ * Start reading the next file which is not found in a manifest or the cache,
+ * returning false if there are no more.
+ */
+static int
+uring_start(URING * ring, URING_SLOT * slot, size_t which,
+	    DATA ** list, int *lines, size_t count, size_t *next)
+{
+    while (*next < count) {
+	size_t entry = (*next)++;
+	char *filename = reference_name(list[entry]);
+
+	if (known_file_lines(filename, &slot->sb, &lines[entry])) {
+	    free(filename);
+	    continue;
+	}
+	slot->state = uOpen;
+	slot->entry = entry;
+	slot->filename = filename;
+	slot->fd = -1;
+	slot->have_stat = (ds->cache_opt != NULL && S_ISREG(slot->sb.st_mode));
+	slot->offset = 0;
+	begin_scan(&slot->scan);
+	uring_submit(ring, slot, which);
+	return 1;
+    }
+    return 0;
+}
+
+/*
+ * After an error, wait for the requests which are still in flight, since the
+ * kernel may yet write into the slots' buffers, and close the files which
+ * were opened.  Return false if the requests could not be waited for.
+ */
+static int
+uring_drain(URING * ring, URING_SLOT * slots)
+{
+    int busy = 0;
+    int ok = 1;
+    int n;
 
-	    unified = 0;
+    for (n = 0; n < URING_DEPTH; ++n)
+	busy += slots[n].busy;
 
-	    if (line_no == 1
-		&& decode_default(buffer,
-				  &old_base, &old_dft,
-				  &new_base, &new_dft)) {
-		TRACE(("DFT %ld,%ld -> %ld,%ld\n",
-		       old_base, old_base + old_dft - 1,
-		       new_base, new_base + new_dft - 1));
-		finish_chunk(that);
-		that = find_data("unknown", "unknown");
-		ok = begin_data(that);
-	    }
-	}
+    while (busy != 0) {
+	unsigned head = *(ring->cq_head);
+	unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
 
-	/*
-	 * If the previous line ended a chunk of a unified diff, we may begin
-	 * another chunk, or begin another type of diff.  If neither, do not
-	 * continue to accumulate counts for the unified diff which has ended.
-	 */
-	if (expect_unify != 0) {
-	    if (expect_unify-- == 1) {
-		if (unified == 0) {
-		    TRACE(("?? did not get chunk\n"));
-		    finish_chunk(that);
-		    that = &dummy;
-		}
+	if (head == tail) {
+	    int rc = (int) syscall(__NR_io_uring_enter, ring->fd, ring->queued,
+				   1, IORING_ENTER_GETEVENTS, NULL, 0);
+	    if (rc < 0) {
+		if (errno == EINTR)
+		    continue;
+		ok = 0;
+		break;
 	    }
+	    ring->queued -= (unsigned) rc;
+	    continue;
 	}
+	while (head != tail) {
+	    struct io_uring_cqe *cqe = &(ring->cqes[head & *(ring->cq_mask)]);
+	    URING_SLOT *slot = &slots[(size_t) cqe->user_data];
+
+	    ++head;
+	    slot->busy = 0;
+	    --busy;
+	    if (slot->state == uOpen && cqe->res >= 0)
+		slot->fd = cqe->res;
+	    else if (slot->state == uClose && cqe->res >= 0)
+		slot->fd = -1;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
 
-	/*
-	 * Override the beginning of the line to simplify the case statement
-	 * below.
-	 */
-	if (marker > 0) {
-	    TRACE(("** have marker=%d, override %s\n", marker, buffer));
-	    (void) memcpy(buffer, "***", (size_t) 3);
+    for (n = 0; n < URING_DEPTH; ++n) {
+	if (slots[n].fd >= 0) {
+	    (void) close(slots[n].fd);
+	    slots[n].fd = -1;
 	}
+    }
+    return ok;
+}
 
-	first_ch = *buffer;
+/*
+ * Count the lines of the reference files using io_uring, returning false if
+ * it cannot be used.
+ */
+static int
+uring_count_lines(DATA ** list, int *lines, size_t count)
+{
+    URING ring;
+    URING_SLOT slots[URING_DEPTH];
+    size_t next = 0;
+    int active = 0;
+    int ok = 1;
+    int drained = 1;
+    int n;
 
-	/*
-	 * GIT binary diffs can contain blocks of data that might be confused
-	 * with the ordinary line-oriented sections in diff output.  Skip the
-	 * case statement if we are processing a GIT binary diff.
-	 */
-	switch (git_diff) {
-	default:
-	    break;
-	case 1:
-	    /* expect "index" */
-	    if (match(buffer, "index") != NULL
-		|| match(buffer, "rename") != NULL
-		|| match(buffer, "similarity") != NULL) {
-		git_diff = 2;
-		continue;
-	    } else {
-		git_diff = 0;
-	    }
-	    break;
-	case 2:
-	    /* perhaps "GIT binary patch" */
-	    if (match(buffer, "GIT binary patch") != NULL) {
-		git_diff = 3;
-		that->cmt = Binary;
-		continue;
-	    } else if (match(buffer, "Binary files ") != NULL) {
-		git_diff = 0;
-		that->cmt = Binary;
-		continue;
-	    }
-	    break;
-	case 3:
-	    /* had "GIT binary patch", wait for next "diff" line */
-	    if (first_ch != 'd')
-		continue;
-	    break;
-	}
+    if (!uring_setup(&ring, URING_DEPTH))
+	return 0;
 
-	/*
-	 * Use the first character of the input line to determine its
-	 * type:
-	 */
-	switch (first_ch) {
-	case 'O':		/* Only */
-	    CASE_TRACE();
-	    if (match(buffer, "Only in ")) {
-		char *path = buffer + 8;
-		int found = 0;
-		for (s = path; *s != EOS; s++) {
-		    if (match(s, ": ")) {
-			found = 1;
-			if ((s - path) >= 2 && s[-1] == PATHSEP) {
-			    while ((s[0] = s[2]) != EOS)
-				s++;
-			} else {
-			    *s++ = PATHSEP;
-			    while ((s[0] = s[1]) != EOS)
-				s++;
-			}
-			break;
-		    }
-		}
-		if (found) {
-		    blip('.');
-		    finish_chunk(that);
-		    that = find_data(NULL, path);
-		    that->cmt = Only;
-		    ok = HAVE_NOTHING;
-		}
-	    }
-	    break;
+    TRACE(("uring_count_lines %lu files\n", (unsigned long) count));
+    memset(slots, 0, sizeof(slots));
+    for (n = 0; n < URING_DEPTH; ++n) {
+	slots[n].fd = -1;
+	slots[n].buffer = xmalloc((size_t) COUNT_BLOCK);
+	if (uring_start(&ring, &slots[n], (size_t) n, list, lines, count, &next))
+	    ++active;
+    }
 
-	    /*
-	     * Several different scripts produce "Index:" lines
-	     * (e.g., "makepatch").  Not all bother to put the
-	     * pathname of the files; some put only the leaf names.
-	     */
-	case 'I':
-	    CASE_TRACE();
-	    if ((s = match(buffer, "Index: ")) != NULL) {
-		s = skip_blanks(s);
-		dequote(s);
-		blip('.');
-		finish_chunk(that);
-		s = do_merging(that, s, &freed);
-		that = find_data(NULL, s);
-		ok = begin_data(that);
-	    }
-	    break;
+    while (active != 0 && ok) {
+	unsigned head;
+	unsigned tail;
+	int rc = (int) syscall(__NR_io_uring_enter, ring.fd, ring.queued, 1,
+			       IORING_ENTER_GETEVENTS, NULL, 0);
 
-	case 'd':		/* diff command trace */
-	    CASE_TRACE();
-	    if ((s = match(buffer, "diff ")) != NULL
-		&& *(s = skip_options(s)) != EOS) {
-		char *original = NULL;
-		char *modified = NULL;
-		char *to_blank = NULL;
-		if (reverse_opt) {
-		    modified = s;
-		    to_blank = skip_filename(s);
-		    original = skip_blanks(to_blank);
-		    *to_blank = EOS;
-		} else {
-		    original = s;
-		    to_blank = skip_filename(s);
-		    s = skip_blanks(to_blank);
-		    modified = s;
-		    *to_blank = EOS;
+	if (rc < 0) {
+	    if (errno != EINTR)
+		ok = 0;
+	    continue;
+	}
+	ring.queued -= (unsigned) rc;
+
+	head = *(ring.cq_head);
+	tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail && ok) {
+	    struct io_uring_cqe *cqe = &(ring.cqes[head & *(ring.cq_mask)]);
+	    size_t which = (size_t) cqe->user_data;
+	    URING_SLOT *slot = &slots[which];
+	    int res = cqe->res;
+
+	    ++head;
+	    slot->busy = 0;
+	    switch (slot->state) {
+	    case uOpen:
+		if (res == -EINVAL) {
+		    ok = 0;	/* the kernel does not know this opcode */
+		    continue;
+		}
+		if (res >= 0) {
+		    slot->fd = res;
+		    slot->state = uRead;
+		    uring_submit(&ring, slot, which);
+		    continue;
+		}
+		lines[slot->entry] = -1;
+		break;
+	    case uRead:
+		if (res > 0) {
+		    add_scan(&slot->scan, slot->buffer, (size_t) res);
+		    slot->offset += (unsigned long long) res;
+		    uring_submit(&ring, slot, which);
+		    continue;
 		}
-		if (match(buffer, "diff --git ") != NULL) {
-		    size_t old_len = strlen(original);
-		    size_t new_len = strlen(modified);
-		    char *temp = xmalloc(old_len + new_len + 1);
-		    git_diff = 1;
-		    if (copy_git_name(temp, original, old_len) != NULL)
-			original = new_string(temp);
-		    if (copy_git_name(temp, modified, new_len) != NULL)
-			modified = new_string(temp);
-		    free(temp);
+		if (res == 0) {
+		    end_scan(&slot->scan);
+		    if (slot->have_stat)
+			store_cached(&slot->sb, &slot->scan);
+		    lines[slot->entry] = (int) slot->scan.data.lines;
 		} else {
-		    git_diff = 0;
-		    dequote(original);
-		    dequote(modified);
+		    lines[slot->entry] = -1;	/* a read error, e.g., EIO */
 		}
-		blip('.');
-		finish_chunk(that);
-		modified = do_merging(that, modified, &freed);
-		that = find_data(original, modified);
-		ok = begin_data(that);
+		slot->state = uClose;
+		uring_submit(&ring, slot, which);
+		continue;
+	    case uClose:
+		slot->fd = -1;
+		break;
 	    }
-	    break;
+	    free(slot->filename);
+	    slot->filename = NULL;
+	    if (!uring_start(&ring, slot, which, list, lines, count, &next))
+		--active;
+	}
+	__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
 
-	case '*':
-	    CASE_TRACE();
-	    if (!(ok & HAVE_PATH)) {
-		int ddd, hour, minute, second;
-		int day, month, year;
-		char yrmon, monday;
-		char *stars = match(buffer, "*** ");
-		char *sp;
-
-		if (stars == NULL)
-		    break;	/* ignore */
-
-		/* check for tab-delimited first, so we can
-		 * accept filenames containing spaces.
-		 */
-		if (((sp = copy_notabs(b_fname, stars, length)) != NULL
-		     && (sp = match(sp, "\t")) != NULL
-		     && (sp = need_nospcs(sp)) != NULL
-		     && (sp = match(sp, " ")) != NULL
-		     && (sp = need_nospcs(sp)) != NULL
-		     && sscanf(sp,
-			       " %d %d:%d:%d %d",
-			       &ddd,
-			       &hour, &minute, &second, &year) == 5)
-		    || ((sp = copy_notabs(b_fname, stars, length)) != NULL
-			&& sscanf(sp,
-				  "\t%d%c%d%c%d %d:%d:%d",
-				  &year, &yrmon, &month, &monday, &day,
-				  &hour, &minute, &second) == 8
-			&& date_delims(yrmon, monday)
-			&& !version_num(b_fname))
-		    || ((sp = copy_notabs(b_fname, stars, length)) != NULL
-			&& (sp = match(sp, "\t")) != NULL
-			&& (sp = need_parens(sp)) != NULL
-			&& (sp = match(sp, "\t")) != NULL
-			&& need_parens(sp) != NULL
-			&& !version_num(b_fname))
-		    || ((sp = copy_notabs(b_fname, stars, length)) != NULL
-			&& (sp = match(sp, "\t")) != NULL
-			&& (sp = need_parens(sp)) != NULL
-			&& (*skip_blanks(sp) == EOS))
-		    || ((sp = copy_graphs(b_fname, stars, length)) != NULL
-			&& (sp = need_blanks(sp)) != NULL
-			&& (sp = need_nospcs(sp)) != NULL
-			&& (sp = match(sp, " ")) != NULL
-			&& (sp = need_nospcs(sp)) != NULL
-			&& sscanf(sp,
-				  " %d %d:%d:%d %d",
-				  &ddd, &hour, &minute, &second, &year) == 5)
-		    || ((sp = copy_graphs(b_fname, stars, length)) != NULL
-			&& (sp = need_blanks(sp)) != NULL
-			&& sscanf(sp,
-				  "%d%c%d%c%d %d:%d:%d",
-				  &year, &yrmon, &month, &monday, &day,
-				  &hour, &minute, &second) == 8
-			&& date_delims(yrmon, monday)
-			&& !version_num(b_fname))
-		    || ((sp = copy_git_name(b_fname, stars, length)) != NULL
-			&& *skip_blanks(sp) == EOS)
-		    || ((sp = copy_graphs(b_fname, stars, length)) != NULL
-			&& (*sp == EOS || *sp == BLANK || *sp == TAB)
-			&& !version_num(b_fname)
-			&& !contain_any(b_fname, "*")
-			&& !edit_range(b_fname))
-		    ) {
-		    const char *git_source = NULL;
-
-		    prev = that;
-		    finish_chunk(that);
-		    dequote(b_fname);
-
-		    /*
-		     * Git diff's may reflect a renamed file.  For this case,
-		     * we want to keep track of the original file, for the
-		     * -S/-D comparison.
-		     */
-		    if ((marker > 1) && git_diff) {
-			char *tt = that->original;
-			if (strlen(tt) > 2
-			    && (!strncmp("a/", tt, 2)
-				|| !strncmp("b/", tt, 2))) {
-			    tt += 2;
-			}
-			git_source = new_string(tt);
-		    }
+    if (!ok)
+	drained = uring_drain(&ring, slots);
+    for (n = 0; n < URING_DEPTH; ++n) {
+	free(slots[n].filename);
+	if (drained)
+	    free(slots[n].buffer);	/* else the kernel may still use it */
+    }
+    uring_finish(&ring);
+    return ok;
+}
+#endif /* USE_IO_URING */
 
-		    s = do_merging(that, b_fname, &freed);
-		    if (freed)
-			prev = NULL;
-		    that = find_data(git_source, s);
-		    ok = begin_data(that);
-		    TRACE(("** after merge:%d:%s\n", ok, s));
-		}
-	    }
-	    break;
+#if USE_THREADS
+/*
+ * With threads, the reference files for the -S/-D options are counted by a
+ * pool of workers, each taking the next file from the list.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    DATA **list;		/* the entries which are not ignored */
+    int *lines;			/* line-count, or -1 if it could not be opened */
+    size_t count;		/* number of entries in list[] */
+    size_t next;		/* index of the next entry to count */
+    DIFFSTAT *context;		/* the context of the thread which started */
+} COUNT_POOL;
 
-	case '=':
-	    CASE_TRACE();
-	    if (!(ok & HAVE_PATH)) {
-		int rev;
-		char *bars, *sp;
-
-		if ((bars = match(buffer, "==== ")) != NULL
-		    && (bars = copy_p4_name(b_fname, bars, length)) != NULL
-		    && (bars = match(bars, "#")) != NULL
-		    && (bars = copy_integer(&rev, bars)) != NULL
-		    && (((sp = match(bars, " - ")) != NULL
-			 && need_graphs(sp) != NULL)
-			|| (((sp = match(bars, " ")) != NULL
-			     && (sp = need_parens(sp)) != NULL
-			     && (sp = match(sp, " - ")) != NULL
-			     && need_graphs(sp) != NULL)))
-		    && !version_num(b_fname)
-		    && !contain_any(b_fname, "*")
-		    && !edit_range(b_fname)) {
-		    TRACE(("** found p4-diff\n"));
-		    prev = that;
-		    finish_chunk(that);
-		    dequote(b_fname);
-		    s = do_merging(that, b_fname, &freed);
-		    if (freed)
-			prev = NULL;
-		    that = find_data(NULL, s);
-		    ok = begin_data(that);
-		    TRACE(("** after merge:%d:%s\n", ok, s));
-		}
-	    }
-	    break;
+static void *
+count_worker(void *arg)
+{
+    COUNT_POOL *pool = (COUNT_POOL *) arg;
 
-	case '+':
-	    /* FALL-THRU */
-	case '>':
-	    CASE_TRACE();
-	    if (ok) {
-		update_chunk(that, cInsert);
-	    }
+    ds = pool->context;
+    for (;;) {
+	size_t n;
+	char *filename;
+
+	pthread_mutex_lock(&pool->lock);
+	n = pool->next;
+	if (n < pool->count)
+	    pool->next++;
+	pthread_mutex_unlock(&pool->lock);
+	if (n >= pool->count)
 	    break;
 
-	case '-':
-	    if (!ok) {
-		CASE_TRACE();
-		break;
-	    }
-	    if (!unified && !strcmp(buffer, "---")) {
-		CASE_TRACE();
-		break;
-	    }
-	    /* fall-thru */
-	case '<':
-	    CASE_TRACE();
-	    if (ok) {
-		update_chunk(that, cDelete);
-	    }
-	    break;
+	filename = reference_name(pool->list[n]);
+	pool->lines[n] = count_file_lines(filename, &pool->list[n]->estimated);
+	free(filename);
+    }
+    return NULL;
+}
 
-	case '!':
-	    CASE_TRACE();
-	    if (ok) {
-		update_chunk(that, cModify);
-	    }
+static void
+thread_count_lines(DATA ** list, int *lines, size_t count, int workers)
+{
+    COUNT_POOL pool;
+    pthread_t *threads;
+    int started;
+    int n;
+
+    if ((size_t) workers > count)
+	workers = (int) count;
+
+    TRACE(("thread_count_lines %lu files with %d threads\n",
+	   (unsigned long) count, workers));
+    memset(&pool, 0, sizeof(pool));
+    pool.list = list;
+    pool.context = ds;
+    pool.lines = lines;
+    pool.count = count;
+    pthread_mutex_init(&pool.lock, NULL);
+
+    /* this thread is the first worker */
+    threads = (pthread_t *) xmalloc((size_t) workers * sizeof(pthread_t));
+    for (started = 1; started < workers; ++started) {
+	if (pthread_create(&threads[started], NULL, count_worker, &pool) != 0)
 	    break;
+    }
+    (void) count_worker(&pool);
+    for (n = 1; n < started; ++n) {
+	pthread_join(threads[n], NULL);
+    }
 
-	    /* Expecting "Files XXX and YYY differ" */
-	case 'F':		/* FALL-THRU */
-	case 'f':
-	    CASE_TRACE();
-	    if ((s = match(buffer + 1, "iles ")) != NULL) {
-		char *first = skip_blanks(s);
-		/* blindly assume the first filename does not contain " and " */
-		char *at_and = strstr(s, " and ");
-		s = strrchr(buffer, BLANK);
-		if ((at_and != NULL) && !strcmp(s, " differ")) {
-		    char *second = skip_blanks(at_and + 5);
-
-		    if (reverse_opt) {
-			*at_and = EOS;
-			s = first;
-		    } else {
-			*s = EOS;
-			s = second;
-		    }
-		    blip('.');
-		    finish_chunk(that);
-		    that = find_data(NULL, s);
-		    that->cmt = Either;
-		    ok = HAVE_NOTHING;
-		    either = 1;
-		}
+    pthread_mutex_destroy(&pool.lock);
+    free(threads);
+}
+#endif /* USE_THREADS */
+
+#if USE_IO_URING || USE_THREADS
+/*
+ * Count the lines of the reference files for all entries which are not
+ * ignored, returning an array of counts in list-order.  Return null if
+ * neither io_uring nor threads are used, leaving the counting to summarize().
+ */
+static int *
+count_all_lines(void)
+{
+    DATA **list;
+    int *lines;
+    DATA *p;
+    size_t count = 0;
+    int done = 0;
+
+    if (ds->trace_opt)
+	return NULL;
+
+    for (p = ds->all_data; p != NULL; p = p->link) {
+	if (!ignore_data(p))
+	    count++;
+    }
+    if (count < 2)
+	return NULL;
+
+    list = (DATA **) xmalloc(count * sizeof(DATA *));
+    lines = (int *) xmalloc(count * sizeof(int));
+    count = 0;
+    for (p = ds->all_data; p != NULL; p = p->link) {
+	if (!ignore_data(p))
+	    list[count++] = p;
+    }
+
+#if USE_IO_URING
+    if (!ds->estimate_opt)
+	done = uring_count_lines(list, lines, count);
+#endif
+#if USE_THREADS
+    if (!done && walk_threads() > 1) {
+	thread_count_lines(list, lines, count, walk_threads());
+	done = 1;
+    }
+#endif
+    free(list);
+    if (!done) {
+	free(lines);
+	lines = NULL;
+    }
+    return lines;
+}
+#else
+#define count_all_lines() NULL
+#endif
+
+static void
+summarize(void)
+{
+    DATA *p;
+    DATA *ahead;
+    int lead = 0;
+    long total_ins = 0;
+    long total_del = 0;
+    long total_mod = 0;
+    long total_eql = 0;
+    long files_equal = 0;
+    long temp;
+    int num_files = 0, shortest_name = -1, longest_name = -1;
+    int need_names;
+    int *counted = NULL;
+    size_t which = 0;
+
+    /*
+     * The name-widths are not needed for the summary, but the common prefix
+     * is used for finding the files for the -S/-D options.
+     */
+    need_names = !ds->summary_only || (ds->path_opt != NULL);
+
+    ds->plot_scale = 0;
+    for (p = ds->all_data; p != NULL && need_names; p = p->link) {
+	int len = columns_of(p->modified);
+
+	if (ignore_data(p))
+	    continue;
+
+	/*
+	 * If "-pX" option is given, prefix_opt is positive.
+	 *
+	 * "-p0" gives the whole pathname unmodified.  "-p1" strips
+	 * through the first path-separator, etc.
+	 */
+	if (ds->prefix_opt >= 0) {
+	    /* p->base has been computed at node creation */
+	    if (ds->min_name_wide < (len - p->base))
+		ds->min_name_wide = (len - p->base);
+	} else {
+	    /*
+	     * If "-pX" option is not given, strip off any prefix which is
+	     * shared by all of the names.
+	     */
+	    if (len < ds->prefix_len || ds->prefix_len < 0)
+		ds->prefix_len = len;
+	    while (ds->prefix_len > 0) {
+		if (p->modified[ds->prefix_len - 1] != PATHSEP)
+		    ds->prefix_len--;
+		else if (strncmp(ds->all_data->modified,
+				 p->modified,
+				 (size_t) ds->prefix_len))
+		    ds->prefix_len--;
+		else
+		    break;
 	    }
-	    break;
-	    /* Expecting "Binary files XXX and YYY differ" */
-	case 'B':		/* FALL-THRU */
-	case 'b':
-	    CASE_TRACE();
-	    if ((s = match(buffer + 1, "inary files ")) != NULL) {
-		char *first = skip_blanks(s);
-		/* blindly assume the first filename does not contain " and " */
-		char *at_and = strstr(s, " and ");
-		s = strrchr(buffer, BLANK);
-		if ((at_and != NULL) && !strcmp(s, " differ")) {
-		    char *second = skip_blanks(at_and + 5);
-
-		    if (reverse_opt) {
-			*at_and = EOS;
-			s = first;
-		    } else {
-			*s = EOS;
-			s = second;
-		    }
-		    blip('.');
-		    finish_chunk(that);
-		    that = find_data(NULL, s);
-		    that->cmt = Binary;
-		    ok = HAVE_NOTHING;
+
+	    if (len > longest_name)
+		longest_name = len;
+	    if (len < shortest_name || shortest_name < 0)
+		shortest_name = len;
+	}
+    }
+
+    /*
+     * Get additional counts for files where we cannot count lines changed.
+     */
+    if (ds->count_files) {
+	for (p = ds->all_data; p; p = p->link) {
+	    switch (p->cmt) {
+	    case Binary:
+		ds->files_binary++;
+		break;
+	    case Only:
+		switch (resolve_only(p)) {
+		case OnlyRight:
+		    p->cmt = OnlyRight;
+		    ds->files_added++;
+		    break;
+		case OnlyLeft:
+		    p->cmt = OnlyLeft;
+		    ds->files_removed++;
+		    break;
+		default:
+		    /* ignore - we could not guess */
+		    break;
 		}
+	    default:
+		break;
 	    }
-	    break;
 	}
     }
-    blip('\n');
 
-    finish_chunk(that);
-    finish_chunk(&dummy);
+    /*
+     * Use a separate loop after computing prefix_len so we can apply the "-S"
+     * or "-D" options to find files that we can use as reference for the
+     * unchanged-count.
+     */
+    if (ds->path_opt != NULL)
+	counted = count_all_lines();
+    for (p = ds->all_data, ahead = ds->all_data; p; p = p->link) {
+	if (ds->path_opt != NULL && counted == NULL && !ds->estimate_opt)
+	    ahead = prefetch_lines(ahead, &lead);
+	if (!ignore_data(p)) {
+	    EqlOf(p) = 0;
+	    if (ds->reverse_opt) {
+		long save_ins = InsOf(p);
+		long save_del = DelOf(p);
+		InsOf(p) = save_del;
+		DelOf(p) = save_ins;
+	    }
+	    if (ds->path_opt != NULL) {
+		int count;
 
-    if (either) {
-	int pass;
-	int fixup_diffs = 0;
+		/* if the file was not opened, count_lines() reports it */
+		if (counted == NULL || (count = counted[which++]) < 0)
+		    count = count_lines(p);
 
-	for (pass = 0; pass < 2; ++pass) {
-	    DATA *p;
-	    for (p = all_data; p; p = p->link) {
-		switch (p->cmt) {
-		default:
-		    break;
-		case Normal:
-		    fixup_diffs = 1;
-		    break;
-		case Either:
-		    if (pass) {
-			if (fixup_diffs) {
-			    p->cmt = Binary;
-			} else {
-			    p->cmt = Differs;
-			}
+		if (count >= 0) {
+		    EqlOf(p) = count - ModOf(p);
+		    if (ds->path_dest != 0) {
+			EqlOf(p) -= InsOf(p);
+		    } else {
+			EqlOf(p) -= DelOf(p);
 		    }
-		    break;
+		    if (EqlOf(p) < 0)
+			EqlOf(p) = 0;
 		}
 	    }
+	    num_files++;
+	    total_ins += InsOf(p);
+	    total_del += DelOf(p);
+	    total_mod += ModOf(p);
+	    total_eql += EqlOf(p);
+	    temp = TotalOf(p);
+	    if (temp > ds->plot_scale)
+		ds->plot_scale = temp;
+	}
+    }
+
+    free(counted);
+    update_min_name_wide(longest_name);
+
+#ifdef HAVE_OPENDIR
+    if (ds->S_option != NULL && ds->D_option != NULL && !ds->only_listed) {
+	ds->unchanged = (ds->all_data == NULL);
+	init_listed();
+	walk_unmodified_files(ds->D_option, &files_equal, &total_eql);
+	free_listed();
+	if (ds->unchanged) {
+	    for (p = ds->all_data; p; p = p->link) {
+		int len = columns_of(p->modified);
+		if (longest_name < len)
+		    longest_name = len;
+		temp = TotalOf(p);
+		if (temp > ds->plot_scale)
+		    ds->plot_scale = temp;
+	    }
+	    update_min_name_wide(longest_name);
 	}
     }
+#endif
 
-    free(buffer);
-    free(b_fname);
-}
+    ds->estimated = 0;
+    for (p = ds->all_data; p != NULL && ds->estimate_opt; p = p->link) {
+	if (p->estimated && !ignore_data(p)) {
+	    ds->estimated = 1;
+	    break;
+	}
+    }
 
-static void
-show_color(int color)
-{
-    if (color >= 0)
-	printf("\033[%dm", color + 30);
-    else
-	printf("\033[0;39m");
+    ds->totals.name = NULL;
+    ds->totals.status = DIFFSTAT_TEXT;
+    ds->totals.inserted = total_ins;
+    ds->totals.deleted = total_del;
+    ds->totals.modified = total_mod;
+    ds->totals.unchanged = total_eql;
+    ds->num_files = num_files;
 }
 
-static long
-plot_bar(long count, int c, int color)
+/*
+ * Write the histogram or table, and the summary line.
+ */
+static void
+show_report(void)
 {
-    long result = count;
-
-    if (show_colors && result != 0)
-	show_color(color);
+    DATA *p;
 
-    while (--count >= 0)
-	(void) putchar(c);
+    if (ds->totals_only && (ds->table_opt == 1 || ds->names_only))
+	return;			/* there is no summary line to show */
+
+    ds->plot_width = (ds->max_width - ds->min_name_wide - 8);
+    if (ds->plot_width < 10)
+	ds->plot_width = 10;
+
+    if (ds->plot_scale < ds->plot_width)
+	ds->plot_scale = ds->plot_width;	/* 1:1 */
+
+    if (ds->commits_opt && ds->table_opt != 1) {
+	if (ds->commits_shown)
+	    fputc('\n', ds->output);
+	if (ds->commit_hash != NULL)
+	    fprintf(ds->output, "%s%scommit %s\n",
+		    ds->comment_opt, *ds->comment_opt ? " " : "",
+		    ds->commit_hash);
+	if (ds->commit_author != NULL)
+	    fprintf(ds->output, "%s%sAuthor: %s\n",
+		    ds->comment_opt, *ds->comment_opt ? " " : "",
+		    ds->commit_author);
+    }
 
-    if (show_colors && result != 0)
-	show_color(-1);
+    if (ds->table_opt == 1 && ds->commits_shown) {
+	;			/* the heading was written for the first commit */
+    } else if (ds->table_opt == 1) {
+	if (ds->commits_opt)
+	    fprintf(ds->output, "COMMIT,AUTHOR,");
+	if (!ds->names_only) {
+	    fprintf(ds->output, "INSERTED,DELETED,MODIFIED,");
+	    if (ds->path_opt)
+		fprintf(ds->output, "UNCHANGED,");
+	    if (ds->count_files && !ds->reverse_opt)
+		fprintf(ds->output, "FILE-ADDED,FILE-DELETED,FILE-BINARY,");
+	}
+	fprintf(ds->output, "FILENAME\n");
+    } else if (ds->table_opt == 2 && !ds->summary_only) {
+	long largest = 0;
+	for (p = ds->all_data; p; p = p->link) {
+	    if (ds->path_opt)
+		largest = maximum(largest, EqlOf(p));
+	    largest = maximum(largest, InsOf(p));
+	    largest = maximum(largest, DelOf(p));
+	    largest = maximum(largest, ModOf(p));
+	}
+	ds->number_len = 0;
+	while (largest > 0) {
+	    ds->number_len++;
+	    largest /= 10;
+	}
+	ds->number_len = maximum(ds->number_len, 3);
+    }
+    if (ds->summary_only) {
+	;			/* show_data() would print nothing */
+    } else
+#ifdef HAVE_TSEARCH
+    if (ds->use_tsearch) {
+	twalk(ds->sorted_data, show_tsearch);
+    } else
+#endif
+	for (p = ds->all_data; p; p = p->link) {
+	    show_data(p);
+	}
 
-    return result;
+    if ((ds->table_opt != 1) && !ds->names_only) {
+#define PLURAL(n) n, n != 1 ? "s" : ""
+	if (ds->num_files > 0 || !ds->quiet) {
+	    fprintf(ds->output, "%s %d file%s changed",
+		    ds->comment_opt, PLURAL(ds->num_files));
+	    if (ds->totals.inserted)
+		fprintf(ds->output, ", %ld insertion%s(+)", PLURAL(ds->totals.inserted));
+	    if (ds->totals.deleted)
+		fprintf(ds->output, ", %ld deletion%s(-)", PLURAL(ds->totals.deleted));
+	    if (ds->totals.modified)
+		fprintf(ds->output, ", %ld modification%s(!)", PLURAL(ds->totals.modified));
+	    if (ds->totals.unchanged && ds->path_opt != NULL)
+		fprintf(ds->output, ", %s%ld unchanged line%s(=)",
+		       ds->estimated ? "~" : "", PLURAL(ds->totals.unchanged));
+	    if (ds->count_files) {
+		if (ds->files_added)
+		    fprintf(ds->output, ", %ld file%s added", PLURAL(ds->files_added));
+		if (ds->files_removed)
+		    fprintf(ds->output, ", %ld file%s removed", PLURAL(ds->files_removed));
+		if (ds->files_binary)
+		    fprintf(ds->output, ", %ld binary file%s", PLURAL(ds->files_binary));
+	    }
+	    (void) fputc('\n', ds->output);
+	}
+    }
+    if (ds->commits_opt)
+	ds->commits_shown++;
 }
 
-/*
- * Each call to 'plot_num()' prints a scaled bar of 'c' characters.  The
- * 'extra' parameter is used to keep the accumulated error in the bar's total
- * length from getting large.
- */
-static long
-plot_num(long num_value, int c, int color, long *extra)
+#ifdef HAVE_POPEN
+static const char *
+get_program(const char *name, const char *dft)
 {
-    long result = 0;
-
-    /* the value to plot */
-    /* character to display in the bar */
-    /* accumulated error in the bar */
-    if (num_value) {
-	long product = (plot_width * num_value);
-	result = ((product + *extra) / plot_scale);
-	*extra = product - (result * plot_scale) - *extra;
-	plot_bar(result, c, color);
-    }
+    const char *result = getenv(name);
+    if (result == NULL || *result == EOS)
+	result = dft;
+    TRACE(("get_program(%s) = %s\n", name, result));
     return result;
 }
+#define GET_PROGRAM(name) get_program("DIFFSTAT_" #name, name)
 
-static long
-plot_round1(const long num[MARKS])
+static char *
+decompressor(Decompress which, const char *name)
 {
-    long result = 0;
-    long scaled[MARKS];
-    long remain[MARKS];
-    long want = 0;
-    long have = 0;
-    long half = (plot_scale / 2);
-    int i;
-
-    memset(scaled, 0, sizeof(scaled));
-    memset(remain, 0, sizeof(remain));
+    const char *verb = NULL;
+    const char *opts = "";
+    char *result = NULL;
 
-    for_each_mark(i) {
-	long product = (plot_width * num[i]);
-	scaled[i] = (product / plot_scale);
-	remain[i] = (product % plot_scale);
-	want += product;
-	have += product - remain[i];
-    }
-    while (want > have) {
-	int j = -1;
-	for_each_mark(i) {
-	    if (remain[i] != 0
-		&& (remain[i] > (j >= 0 ? remain[j] : half))) {
-		j = i;
-	    }
+    switch (which) {
+    case dcBzip:
+	verb = GET_PROGRAM(BZCAT_PATH);
+	if (*verb == EOS) {
+	    verb = GET_PROGRAM(BZIP2_PATH);
+	    opts = "-dc";
 	}
-	if (j >= 0) {
-	    have += remain[j];
-	    remain[j] = 0;
-	    scaled[j] += 1;
-	} else {
-	    break;
+	break;
+    case dcCompress:
+	verb = GET_PROGRAM(ZCAT_PATH);
+	if (*verb == EOS) {
+	    verb = GET_PROGRAM(UNCOMPRESS_PATH);
+	    opts = "-c";
+	    if (*verb == EOS) {
+		/* not all compress's recognize the options, test this last */
+		verb = GET_PROGRAM(COMPRESS_PATH);
+		opts = "-dc";
+	    }
 	}
+	break;
+    case dcGzip:
+	verb = GET_PROGRAM(GZIP_PATH);
+	opts = "-dc";
+	break;
+    case dcLzma:
+	verb = GET_PROGRAM(LZCAT_PATH);
+	opts = "-dc";
+	break;
+    case dcPack:
+	verb = GET_PROGRAM(PCAT_PATH);
+	break;
+    case dcXz:
+	verb = GET_PROGRAM(XZ_PATH);
+	opts = "-dc";
+	break;
+    case dcZstd:
+	verb = GET_PROGRAM(ZSTD_PATH);
+	opts = "-qdcf";
+	break;
+    case dcEmpty:
+	/* FALLTHRU */
+    case dcNone:
+	break;
     }
-    for_each_mark(i) {
-	plot_bar(scaled[i], marks[i], colors[i]);
-	result += scaled[i];
+    if (verb != NULL && *verb != EOS) {
+	result = (char *) xmalloc(strlen(verb) + 10 + strlen(name));
+	sprintf(result, "%s %s", verb, opts);
+	if (*name != EOS) {
+	    sprintf(result + strlen(result), " \"%s\"", name);
+	}
     }
     return result;
 }
 
-/*
- * Print a scaled bar of characters, where c[0] is for insertions, c[1]
- * for deletions and c[2] for modifications. The num array contains the
- * count for each type of change, in the same order.
- */
-static long
-plot_round2(const long num[MARKS])
+static char *
+is_compressed(const char *name)
 {
-    long result = 0;
-    long scaled[MARKS];
-    long remain[MARKS];
-    long total = 0;
-    int i;
-
-    for (i = 0; i < MARKS; i++)
-	total += num[i];
-
-    if (total == 0)
-	return result;
+    size_t len = strlen(name);
+    Decompress which;
 
-    total = (total * plot_width + (plot_scale / 2)) / plot_scale;
-    /* display at least one character */
-    if (total == 0)
-	total++;
+#define CHKEND(end) \
+    (len > (sizeof(end) - 1) && \
+     !strcmp(name + len - (sizeof(end) - 1), end))
 
-    for_each_mark(i) {
-	scaled[i] = num[i] * plot_width / plot_scale;
-	remain[i] = num[i] * plot_width - scaled[i] * plot_scale;
-	total -= scaled[i];
+    if (CHKEND(".Z")) {
+	which = dcCompress;
+    } else if (CHKEND(".z")) {
+	which = dcPack;
+    } else if (CHKEND(".gz")) {
+	which = dcGzip;
+    } else if (CHKEND(".bz2")) {
+	which = dcBzip;
+    } else if (CHKEND(".lzma")) {
+	which = dcLzma;
+    } else if (CHKEND(".xz")) {
+	which = dcXz;
+    } else if (CHKEND(".zst")) {
+	which = dcZstd;
+    } else {
+	which = dcNone;
     }
+    return decompressor(which, name);
+}
 
-    /* assign the missing chars using the largest remainder algo */
-    while (total) {
-	int largest, largest_count;	/* largest is a bit field */
-	long max_remain;
-
-	/* search for the largest remainder */
-	largest = largest_count = 0;
-	max_remain = 0;
-	for_each_mark(i) {
-	    if (remain[i] > max_remain) {
-		largest = 1 << i;
-		largest_count = 1;
-		max_remain = remain[i];
-	    } else if (remain[i] == max_remain) {	/* ex aequo */
-		largest |= 1 << i;
-		largest_count++;
-	    }
-	}
-
-	/* if there are more greatest remainders than characters
-	   missing, don't assign them at all */
-	if (total < largest_count)
-	    break;
-
-	/* allocate the extra characters */
-	for_each_mark(i) {
-	    if (largest & (1 << i)) {
-		scaled[i]++;
-		total--;
-		remain[i] -= plot_width;
-	    }
+#ifdef HAVE_MKDTEMP
+#define MY_MKDTEMP(path) mkdtemp(path)
+#else
+/*
+ * mktemp is supposedly marked obsolete at the same point that mkdtemp is
+ * introduced.
+ */
+static char *
+my_mkdtemp(char *path)
+{
+    char *result = mktemp(path);
+    if (result != 0) {
+	if (MKDIR(result, 0700) < 0) {
+	    result = 0;
 	}
     }
-
-    for_each_mark(i) {
-	result += plot_bar(scaled[i], marks[i], colors[i]);
-    }
-
-    return result;
+    return path;
 }
+#define MY_MKDTEMP(path) my_mkdtemp(path)
+#endif
 
-static void
-plot_numbers(const DATA * p)
+static char *
+copy_stdin(INPUT * ip, char **dirpath)
 {
-    long temp = 0;
-    int i;
+    const char *tmp = getenv("TMPDIR");
+    char *result = NULL;
+    if (tmp == NULL)
+	tmp = "/tmp/";
+    *dirpath = xmalloc(strlen(tmp) + 12);
 
-    printf("%5ld ", TotalOf(p));
+    strcpy(*dirpath, tmp);
+    strcat(*dirpath, "/diffXXXXXX");
 
-    if (format_opt & FMT_VERBOSE) {
-	printf("%5ld ", InsOf(p));
-	printf("%5ld ", DelOf(p));
-	printf("%5ld ", ModOf(p));
-	if (path_opt)
-	    printf("%5ld ", EqlOf(p));
-    }
+    if (MY_MKDTEMP(*dirpath) != NULL) {
+	FILE *fp;
 
-    if (format_opt == FMT_CONCISE) {
-	for_each_mark(i) {
-	    printf("\t%ld %c", p->count[i], marks[i]);
+	result = xmalloc(strlen(*dirpath) + 10);
+	sprintf(result, "%s/stdin", *dirpath);
+
+	if ((fp = fopen(result, "wb")) != NULL) {
+	    /* the sniffed data is still in the buffer */
+	    do {
+		(void) fwrite(ip->data + ip->next,
+			      sizeof(char),
+			      ip->used - ip->next,
+			      fp);
+		ip->next = ip->used;
+	    } while (more_input(ip) != 0);
+	    (void) fclose(fp);
+	} else {
+	    free(result);
+	    result = NULL;
+	    rmdir(*dirpath);	/* Assume that the /stdin file was not created */
+	    free(*dirpath);
+	    *dirpath = NULL;
 	}
     } else {
-	long used = 0;
+	free(*dirpath);
+	*dirpath = NULL;
+    }
+    return result;
+}
 
-	switch (round_opt) {
-	default:
-	    for_each_mark(i) {
-		used += plot_num(p->count[i], marks[i], colors[i], &temp);
+/*
+ * Check the beginning of the buffered input for a magic number which tells
+ * how it was compressed.
+ */
+static Decompress
+sniff_input(const INPUT * ip)
+{
+    const char *sniff = ip->data + ip->next;
+    size_t got = ip->used - ip->next;
+    Decompress which = dcEmpty;
+
+    if (got != 0) {
+	which = dcNone;
+	switch (UC(sniff[0])) {
+	case 'B':		/* perhaps bzip2 (poor magic design...) */
+	    if (got >= 5
+		&& !strncmp(sniff, "BZh", (size_t) 3)
+		&& isdigit(UC(sniff[3]))
+		&& isdigit(UC(sniff[4]))) {
+		which = dcBzip;
 	    }
 	    break;
-	case 1:
-	    used = plot_round1(p->count);
+	case ']':		/* perhaps lzma */
+	    if (got >= 4
+		&& !memcmp(sniff, "]\0\0\200", (size_t) 4)) {
+		which = dcLzma;
+	    }
 	    break;
-
-	case 2:
-	    used = plot_round2(p->count);
+	case 0xfd:		/* perhaps xz */
+	    if (got >= 6
+		&& !memcmp(sniff, "\3757zXZ\0", (size_t) 6)) {
+		which = dcXz;
+	    }
+	    break;
+	case 0x22:		/* perhaps zstd */
+	case 0x23:
+	case 0x24:
+	case 0x25:
+	case 0x26:
+	case 0x27:
+	case 0x28:
+	    if (got >= 4	/* vi:{ */
+		&& !memcmp(sniff + 1, "\265/\375", (size_t) 3)) {
+		which = dcZstd;
+	    }
+	    break;
+	case '\037':		/* perhaps compress, etc. */
+	    if (got >= 2) {
+		switch (UC(sniff[1])) {
+		case 0213:
+		    which = dcGzip;
+		    break;
+		case 0235:
+		    which = dcCompress;
+		    break;
+		case 0036:
+		    which = dcPack;
+		    break;
+		}
+	    }
 	    break;
-	}
-
-	if ((format_opt & FMT_FILLED) != 0) {
-	    if (used > plot_width)
-		printf("%ld", used - plot_width);	/* oops */
-	    else
-		plot_bar(plot_width - used, '.', 0);
 	}
     }
+    return which;
 }
+#endif
 
-static int
-columns_of(const char *value)
+/*
+ * If the input is a pipe, ask for a larger capacity so that the writer can
+ * get further ahead of us, and each read() returns more data.
+ */
+static void
+resize_pipe(int fd)
 {
-    int result;
-    int n;
-    int ch;
-#ifdef HAVE_MBSTOWCWIDTH
-    int fixup = 0;
-    for (n = 0; (ch = UC(value[n])) != EOS; ++n) {
-	if (ch >= DEL || ch < BLANK) {
-	    fixup = 1;
-	    break;
-	}
-    }
-    result = (int) strlen(value);
-    if (fixup) {
-	size_t needed;
-	mbstate_t state;
-	const char *source;
-	size_t length = strlen(value);
+#ifdef F_SETPIPE_SZ
+    struct stat sb;
 
-	memset(&state, 0, sizeof(state));
-	source = value;
-	needed = mbsrtowcs(NULL, &source, length, &state);
-	if (needed != (size_t) (-1)) {
-	    wchar_t *target = calloc(1 + needed, sizeof(wchar_t));
-	    memset(&state, 0, sizeof(state));
-	    if (mbsrtowcs(target, &value, needed, &state) == needed) {
-		size_t n2;
-		result = 0;
-		for (n2 = 0; n2 < needed; ++n2) {
-		    int nw = wcwidth(target[n2]);
-		    if (nw > 0)
-			result += nw;
-		    else if (target[n2] < BLANK || target[n2] == DEL)
-			result += 2;
-		    else
-			result += 4;	/* show as octal */
-		}
-	    }
-	    free(target);
+    if (fstat(fd, &sb) == 0 && S_ISFIFO(sb.st_mode)) {
+	if (fcntl(fd, F_SETPIPE_SZ, PIPE_BLOCK) < 0) {
+	    TRACE(("cannot resize pipe: %s\n", strerror(errno)));
 	}
     }
 #else
-    result = (int) strlen(value);
-    for (n = 0; (ch = UC(value[n])) != EOS; ++n) {
-	if (ch == DEL || ch < BLANK) {
-	    result += 1;
-	} else if (ch > DEL) {
-	    result += 3;	/* show as octal */
-	}
-    }
+    (void) fd;
 #endif
-    return result;
 }
 
-#define adjustwide(width,name) width += (int) strlen(name) - columns_of(name)
+/*
+ * A tar archive, which may be compressed, can be given to the -S or -D option
+ * in place of a directory.  It is read once, counting the lines of each file
+ * and computing its digest, and the results are used as a manifest.  If the
+ * members are all in one top-level directory, as is usual for a source
+ * archive, that directory is omitted from their names unless the archive
+ * was made from "." (the names begin with "./").
+ */
+#define TAR_BLOCK	512
+#define TAR_NAME	0	/* offsets within a header */
+#define TAR_SIZE	124
+#define TAR_CHKSUM	148
+#define TAR_TYPE	156
+#define TAR_LINKNAME	157
+#define TAR_MAGIC	257
+#define TAR_PREFIX	345
+
+#define TAR_MAX_TEXT	(1024 * 1024)	/* limit for long names, pax headers */
+
+typedef struct {
+    char *name;			/* the name of the hard link */
+    char *target;		/* the member which it names */
+} TAR_LINK;
 
-static void
-show_quoted(const char *value)
+static int
+bad_archive(const char *path, const char *why)
 {
-    int ch;
-
-    putchar(DQUOTE);
-    while ((ch = UC(*value++)) != EOS) {
-	if (ch == DQUOTE)
-	    putchar(DQUOTE);
-	putchar(ch);
-    }
-    putchar(DQUOTE);
+    (void) fflush(stdout);
+    fprintf(stderr, "Archive %s: %s\n", path, why);
+    return 0;
 }
 
-static void
-show_unquoted(const char *value, int limit)
+/*
+ * Numbers in a header are octal, or for large values in GNU tar, base-256.
+ */
+static long
+tar_number(const unsigned char *field, size_t length)
 {
-    int ch;
-    while ((ch = UC(*value++)) != EOS) {
-	if (ch < BLANK) {
-	    if (strchr("\b\n\r\t\\\"", ch) != NULL) {
-		putchar(BACKSL);
-		switch (ch) {
-		case '\b':
-		    ch = 'b';
-		    break;
-		case '\n':
-		    ch = 'n';
-		    break;
-		case '\r':
-		    ch = 'r';
-		    break;
-		case '\t':
-		    ch = 't';
-		    break;
-		}
-	    } else {
-		putchar('^');
-		ch |= '@';
-	    }
-	} else if (ch == DEL) {
-	    putchar('^');
-	    ch = '?';
-	}
-#ifndef HAVE_MBSTOWCWIDTH
-	else if (ch > DEL) {
-	    char temp[5];
-	    sprintf(temp, "\\%03o", ch & 0xff);
-	    ch = temp[3];
-	    temp[3] = EOS;
-	    fputs(temp, stdout);
-	}
-#endif
-	putchar(ch);
-	--limit;
-    }
-    while (limit-- > 0) {
-	putchar(BLANK);
+    long result = 0;
+    size_t n = 0;
+
+    if (field[0] & 0x80) {
+	result = field[n++] & 0x3f;
+	while (n < length)
+	    result = (result << 8) | field[n++];
+    } else {
+	while (n < length && field[n] == ' ')
+	    ++n;
+	while (n < length && field[n] >= '0' && field[n] <= '7')
+	    result = (result << 3) + (field[n++] - '0');
     }
+    return result;
 }
 
-#define changed(p) (!merge_names \
-		    || (p)->cmt != Normal \
-		    || (TotalOf(p)) != 0)
+static char *
+tar_string(const unsigned char *field, size_t length)
+{
+    size_t len = 0;
+    char *result;
+
+    while (len < length && field[len] != EOS)
+	++len;
+    result = xmalloc(len + 1);
+    memcpy(result, field, len);
+    result[len] = EOS;
+    return result;
+}
 
-static void
-show_data(const DATA * p)
+/*
+ * The checksum of a header is the sum of its bytes, counting the checksum
+ * field itself as blanks.
+ */
+static int
+tar_header(const unsigned char *block)
 {
-    const char *name = data_filename(p);
+    long sum = 0;
+    int n;
 
-    if (summary_only) {
-	;
-    } else if (!changed(p)) {
-	;
-    } else if (p->cmt == Binary && suppress_binary == 1) {
-	;
-    } else if (table_opt == 1) {
-	if (names_only) {
-	    show_quoted(name);
-	} else {
-	    printf("%ld,%ld,%ld,",
-		   InsOf(p),
-		   DelOf(p),
-		   ModOf(p));
-	    if (path_opt)
-		printf("%ld,", EqlOf(p));
-	    if (count_files && !reverse_opt)
-		printf("%d,%d,%d,",
-		       (p->cmt == OnlyRight),
-		       (p->cmt == OnlyLeft),
-		       (p->cmt == Binary));
-	    show_quoted(name);
-	}
-	printf("\n");
-    } else if (names_only) {
-	printf("%s\n", name);
-    } else {
-	int width;
+    for (n = 0; n < TAR_BLOCK; ++n) {
+	sum += ((n >= TAR_CHKSUM && n < TAR_CHKSUM + 8)
+		? ' '
+		: block[n]);
+    }
+    return (sum == tar_number(block + TAR_CHKSUM, (size_t) 8));
+}
 
-	printf("%s ", comment_opt);
-	if (max_name_wide > 0
-	    && max_name_wide < min_name_wide
-	    && max_name_wide < ((width = (int) columns_of(name)))) {
-	    printf("%.*s", max_name_wide, name + (width - max_name_wide));
-	} else {
-	    width = ((max_name_wide > 0 && max_name_wide < min_name_wide)
-		     ? max_name_wide
-		     : min_name_wide);
-	    adjustwide(width, name);
-	    show_unquoted(name, width);
-	}
-	if (table_opt == 2) {
-	    putchar('|');
-	    if (path_opt)
-		printf("%*ld ", number_len, EqlOf(p));
-	    printf("%*ld ", number_len, InsOf(p));
-	    printf("%*ld ", number_len, DelOf(p));
-	    printf("%*ld", number_len, ModOf(p));
-	}
-	putchar('|');
-	switch (p->cmt) {
-	default:
-	case Normal:
-	    plot_numbers(p);
-	    break;
-	case Binary:
-	    printf("binary");
-	    break;
-	case Differs:
-	    printf("differ");
-	    break;
-	case Only:
-	    printf("only");
-	    break;
-	case OnlyLeft:
-	    printf(count_files ? "deleted" : "only");
-	    break;
-	case OnlyRight:
-	    printf(count_files ? "added" : "only");
+/*
+ * Read the data of a member, which is padded to a whole number of blocks,
+ * scanning it or collecting it as text.  The size is from the header, so it
+ * is checked before allocating memory for the text.  Return false if the
+ * archive is corrupt.
+ */
+static int
+tar_data(FILE *fp, const char *path, long size, SCAN * scan, char **text)
+{
+    char buffer[COUNT_BLOCK];
+    long left = size;
+    size_t used = 0;
+    int ok = 1;
+
+    if (size < 0)
+	return bad_archive(path, "corrupt header");
+    if (text != NULL && size > TAR_MAX_TEXT)
+	return bad_archive(path, "extended header is too large");
+    if (text != NULL) {
+	free(*text);
+	*text = xmalloc((size_t) size + 1);
+    }
+    while (left > 0) {
+	size_t want = (left > (long) sizeof(buffer)) ? sizeof(buffer) : (size_t) left;
+	size_t padded = (want + TAR_BLOCK - 1) & ~(size_t) (TAR_BLOCK - 1);
+
+	if (fread(buffer, (size_t) 1, padded, fp) != padded) {
+	    ok = bad_archive(path, "unexpected end of file");
 	    break;
 	}
-	printf("\n");
+	if (scan != NULL)
+	    add_scan(scan, buffer, want);
+	if (text != NULL)
+	    memcpy(*text + used, buffer, want);
+	used += want;
+	left -= (long) want;
     }
+    if (text != NULL)
+	(*text)[used] = EOS;
+    return ok;
 }
 
-#ifdef HAVE_TSEARCH
-static void
-show_tsearch(const void *nodep, const VISIT which, const int depth)
+/*
+ * Find the value of a keyword in a pax extended header, whose records look
+ * like "length keyword=value\n".
+ */
+static char *
+pax_value(const char *text, const char *keyword)
 {
-    const DATA *p = *(DATA * const *) nodep;
-    (void) depth;
-    if (which == postorder || which == leaf)
-	show_data(p);
+    size_t want = strlen(keyword);
+    char *result = NULL;
+
+    while (*text != EOS) {
+	char *next;
+	long length = strtol(text, &next, 10);
+	const char *s = next;
+
+	if (length <= 0 || *s++ != ' ')
+	    break;
+	if (!strncmp(s, keyword, want) && s[want] == '=') {
+	    const char *value = s + want + 1;
+	    const char *end = text + length - 1;
+
+	    free(result);
+	    result = xmalloc((size_t) (end - value) + 1);
+	    memcpy(result, value, (size_t) (end - value));
+	    result[end - value] = EOS;
+	}
+	text += length;
+    }
+    return result;
 }
-#endif
 
-static int
-ignore_data(DATA * p)
+/*
+ * Omit "./" and "/" from the beginning of a member's name.
+ */
+static char *
+tar_member(char *name, int *dotted)
 {
-    return ((!changed(p))
-	    || (p->cmt == Binary && suppress_binary));
+    char *s = name;
+
+    for (;;) {
+	if (*s == PATHSEP) {
+	    ++s;
+	} else if (s[0] == '.' && s[1] == PATHSEP) {
+	    *dotted = 1;
+	    s += 2;
+	} else {
+	    break;
+	}
+    }
+    if (s != name)
+	memmove(name, s, strlen(s) + 1);
+    return name;
 }
 
 /*
- * Return the length of any directory-prefix from the given path.
+ * If every name is below the same top-level directory, return the length of
+ * that directory's name with its separator.
  */
 static size_t
-path_length(const char *path)
+tar_top_level(const MF_LIST * list, const TAR_LINK * links, size_t num_links)
 {
+    const char *first = NULL;
     size_t result = 0;
-    const char *mark = strrchr(path, PATHSEP);
-    if (mark != NULL && mark != path)
-	result = (size_t) (mark + 1 - path);
+    size_t n;
+
+    if (list->count != 0) {
+	const char *s;
+
+	first = list->items[0].name;
+	if ((s = strchr(first, PATHSEP)) != NULL)
+	    result = (size_t) (s + 1 - first);
+    }
+    for (n = 1; n < list->count && result != 0; ++n) {
+	if (strncmp(list->items[n].name, first, result))
+	    result = 0;
+    }
+    for (n = 0; n < num_links && result != 0; ++n) {
+	if (strncmp(links[n].name, first, result)
+	    || strncmp(links[n].target, first, result))
+	    result = 0;
+    }
     return result;
 }
 
 /*
- * If we have an "only" filename, we can guess whether it was added or removed
- * by looking at its directory and comparing that to other files' directories.
- *
- * TODO: -K -R combination is not yet supported because that relies on storing
- * both left-/right-paths for each file; only the right-path is currently used.
+ * Check if a member is in a version-control directory.
  */
-static Comment
-resolve_only(const DATA * p)
+static int
+vcs_member(const char *name)
 {
-    Comment result = p->cmt;
-    if (result == Only && !reverse_opt) {
-	const DATA *q;
-	size_t len1 = path_length(p->modified);
-	if (len1 != 0) {
-	    for (q = all_data; q; q = q->link) {
-		result = OnlyLeft;
-		if (q->cmt == Normal || q->cmt == Binary) {
-		    size_t len2 = path_length(q->modified);
-		    if (len2 >= len1) {
-			if (!strncmp(p->modified, q->modified, len1)) {
-			    result = OnlyRight;
-			    break;
-			}
-		    }
-		}
-	    }
+    char *temp = new_string(name);
+    char *s;
+    char *next;
+    int result = 0;
+
+    for (s = temp; (next = strchr(s, PATHSEP)) != NULL; s = next + 1) {
+	*next = EOS;
+	if (is_vcs_dir(s)) {
+	    result = 1;
+	    break;
 	}
     }
+    free(temp);
     return result;
 }
 
-#ifdef HAVE_OPENDIR
 static void
-count_unmodified_files(const char *pathname, long *files, long *lines)
+strip_name(char *name, size_t length)
 {
-    DATA *p;
-    char *name;
+    memmove(name, name + length, strlen(name + length) + 1);
+}
 
-    TRACE(("count_unmodified_files \"%s\"\n", pathname));
-    if (is_dir(pathname)) {
-	DIR *dp = opendir(pathname);
+/*
+ * Load a tar archive, returning 1 if it was loaded, 0 if the file is not an
+ * archive, or -1 if it is corrupt.
+ */
+static int
+load_tar(const char *path, MANIFEST ** result)
+{
+    int status = 0;
+    FILE *fp;
+#ifdef HAVE_POPEN
+    char *command = NULL;
+    int fd;
+#endif
 
-	if (dp != NULL) {
-	    const struct dirent *de;
+    *result = NULL;
+#ifdef HAVE_POPEN
+
+    /* check the magic number, since suffixes such as ".tgz" are common */
+    if ((fd = open(path, O_RDONLY)) >= 0) {
+	INPUT input;
+
+	init_input(&input, fd);
+	while (input.used < MAX_SNIFF && more_input(&input) != 0) {
+	    ;
+	}
+	command = decompressor(sniff_input(&input), path);
+	free_input(&input);
+	(void) close(fd);
+    }
+    if (command != NULL) {
+	fp = popen(command, "r");
+    } else
+#endif
+	fp = fopen(path, "rb");
+
+    if (fp != NULL) {
+	unsigned char block[TAR_BLOCK];
+	MF_LIST list;
+	TAR_LINK *links = NULL;
+	size_t num_links = 0;
+	char *long_name = NULL;
+	char *long_link = NULL;
+	char *pax_text = NULL;
+	long pax_size = -1;
+	int dotted = 0;
+	int headers = 0;
+	int ok = 1;
+	size_t length;
+	size_t have;
+	size_t n;
+
+	memset(&list, 0, sizeof(list));
+	while (ok) {
+	    long size;
+	    int type;
+	    char *name;
+
+	    if ((n = fread(block, (size_t) 1, sizeof(block), fp)) != sizeof(block)) {
+		if (n != 0 && headers != 0)
+		    ok = bad_archive(path, "unexpected end of file");
+		break;
+	    }
+	    type = block[TAR_TYPE];
+	    for (n = 0; n < sizeof(block) && block[n] == 0; ++n) {
+		;
+	    }
+	    if (n == sizeof(block))
+		break;		/* end of archive */
+	    if (!tar_header(block)) {
+		if (headers != 0)
+		    ok = bad_archive(path, "corrupt header");
+		break;
+	    }
+	    ++headers;
+	    size = (pax_size >= 0) ? pax_size : tar_number(block + TAR_SIZE, 12);
 
-	    while ((de = readdir(dp)) != NULL) {
-		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+	    switch (type) {
+	    case 'L':
+		ok = tar_data(fp, path, size, NULL, &long_name);
+		continue;
+	    case 'K':
+		ok = tar_data(fp, path, size, NULL, &long_link);
+		continue;
+	    case 'x':
+		if (!(ok = tar_data(fp, path, size, NULL, &pax_text)))
 		    continue;
-		name = xmalloc(strlen(pathname) + 2 + strlen(de->d_name));
-		sprintf(name, "%s%c%s", pathname, PATHSEP, de->d_name);
-		if ((strcmp(de->d_name, ".git")
-		     && strcmp(de->d_name, ".svn")
-		     && strcmp(de->d_name, "CVS")
-		     && strcmp(de->d_name, "RCS")) || !is_dir(name)) {
-		    count_unmodified_files(name, files, lines);
+		if ((name = pax_value(pax_text, "path")) != NULL) {
+		    free(long_name);
+		    long_name = name;
 		}
-		free(name);
+		if ((name = pax_value(pax_text, "linkpath")) != NULL) {
+		    free(long_link);
+		    long_link = name;
+		}
+		if ((name = pax_value(pax_text, "size")) != NULL) {
+		    pax_size = atol(name);
+		    free(name);
+		}
+		continue;
 	    }
-	    closedir(dp);
-	}
-    } else if (is_file(pathname)) {
-	/*
-	 * Given the pathname from the (-D) source directory, derive a
-	 * corresponding path for the source directory.  Then check if
-	 * that path appears in the list of modified files.
-	 */
-	const char *ref_name = ((all_data && !unchanged)
-				? all_data->modified
-				: pathname);
-	char *source = NULL;
-
-	if (ref_name == NULL)
-	    return;
 
-	if (prefix_opt >= 0) {
-	    int level_s = count_prefix(path_opt);
-	    int base_s = 0;
-	    int base_d = 0;
-
-	    (void) skip_prefix(pathname, level_s + 1, &base_s);
-	    (void) skip_prefix(ref_name, level_s + 1, &base_d);
-	    name = xmalloc(2 + strlen(pathname) + strlen(ref_name));
-	    sprintf(name, "%.*s%s", base_d, ref_name, base_s + pathname);
-	    source = xmalloc(strlen(ref_name) + 2 + strlen(pathname) +
-			     strlen(S_option));
-	    sprintf(source, "%s%c%s",
-		    S_option,
-		    PATHSEP,
-		    base_s + pathname);
-	} else {
-	    const char *mark = unchanged ? ref_name : data_filename(all_data);
-	    int skip = 1 + (int) strlen(path_opt);
-
-	    name = xmalloc(strlen(ref_name) + 2 + strlen(pathname));
-	    sprintf(name, "%.*s%s",
-		    (int) (mark - ref_name),
-		    ref_name,
-		    pathname + skip);
-	    source = xmalloc(strlen(ref_name) + 2 + strlen(pathname) +
-			     strlen(S_option));
-	    sprintf(source, "%s%c%.*s%s",
-		    S_option,
-		    PATHSEP,
-		    (int) (mark - ref_name),
-		    ref_name,
-		    pathname + skip);
-	}
-
-	if (same_file(source, pathname)) {
-	    int found = 0;
+	    if (long_name != NULL) {
+		name = long_name;
+		long_name = NULL;
+	    } else if (!memcmp(block + TAR_MAGIC, "ustar", (size_t) 5)
+		       && block[TAR_PREFIX] != EOS) {
+		char *prefix = tar_string(block + TAR_PREFIX, (size_t) 155);
+		char *leaf = tar_string(block + TAR_NAME, (size_t) 100);
+
+		name = xmalloc(strlen(prefix) + strlen(leaf) + 2);
+		sprintf(name, "%s%c%s", prefix, PATHSEP, leaf);
+		free(prefix);
+		free(leaf);
+	    } else {
+		name = tar_string(block + TAR_NAME, (size_t) 100);
+	    }
+	    tar_member(name, &dotted);
 
-	    for (p = all_data; p != NULL && !found; p = p->link) {
-		if (!strcmp(name, p->modified)) {
-		    found = 1;
+	    if (*name == EOS || vcs_member(name)) {
+		free(name);
+		ok = tar_data(fp, path, (type == '5') ? 0 : size, NULL, NULL);
+	    } else if (type == '0' || type == EOS || type == '7') {
+		SCAN scan;
+
+		begin_scan(&scan);
+		scan.digesting = 1;
+		if ((ok = tar_data(fp, path, size, &scan, NULL)) != 0) {
+		    end_scan(&scan);
+		    add_mf_item(&list, name, &scan.data);
+		} else {
+		    free(name);
 		}
+	    } else if (type == '1') {
+		links = (TAR_LINK *) realloc(links,
+					     (num_links + 1) * sizeof(TAR_LINK));
+		if (links == NULL)
+		    failed("realloc");
+		links[num_links].name = name;
+		links[num_links].target = ((long_link != NULL)
+					   ? long_link
+					   : tar_string(block + TAR_LINKNAME,
+							(size_t) 100));
+		tar_member(links[num_links].target, &dotted);
+		long_link = NULL;
+		++num_links;
+	    } else {
+		free(name);
+		ok = tar_data(fp, path, (type == '5') ? 0 : size, NULL, NULL);
+	    }
+	    free(long_link);
+	    long_link = NULL;
+	    pax_size = -1;
+	}
+#ifdef HAVE_POPEN
+	if (command != NULL) {
+	    (void) pclose(fp);
+	    free(command);
+	} else
+#endif
+	    (void) fclose(fp);
+	free(long_name);
+	free(long_link);
+	free(pax_text);
+
+	if (!ok) {
+	    for (n = 0; n < num_links; ++n) {
+		free(links[n].name);
+		free(links[n].target);
+	    }
+	    status = -1;
+	}
+	if (ok && headers != 0) {
+	    size_t top = dotted ? 0 : tar_top_level(&list, links, num_links);
+
+	    for (n = 0; n < list.count && top != 0; ++n) {
+		strip_name(list.items[n].name, top);
 	    }
-	    if (!found) {
-		p = find_data(NULL, name);
-		*files += 1;
-		EqlOf(p) = count_lines(p);
-		*lines += EqlOf(p);
 
-		if (unchanged) {
-		    int len = columns_of(p->modified);
-		    if (min_name_wide < (len - p->base))
-			min_name_wide = (len - p->base);
+	    /* a hard link has the contents of the member which it names */
+	    have = list.count;
+	    if (num_links != 0 && have != 0) {
+		qsort(list.items, have, sizeof(MF_ITEM), compare_mf_items);
+	    }
+	    for (n = 0; n < num_links; ++n) {
+		MF_ITEM find;
+		const MF_ITEM *item;
+
+		strip_name(links[n].name, top);
+		strip_name(links[n].target, top);
+		find.name = links[n].target;
+		if (have != 0
+		    && (item = (const MF_ITEM *) bsearch(&find,
+							 list.items,
+							 have,
+							 sizeof(MF_ITEM),
+							 compare_mf_items)) != NULL) {
+		    CONTENTS data = item->data;
+		    add_mf_item(&list, links[n].name, &data);
+		} else {
+		    free(links[n].name);
 		}
+		free(links[n].target);
 	    }
+
+	    *result = (MANIFEST *) xmalloc(sizeof(MANIFEST));
+	    (*result)->path = path;
+	    (*result)->count = (unsigned long) list.count;
+	    (*result)->data = manifest_image(&list, &length);
+	    (*result)->length = length;
+	    (*result)->mapped = 0;
+	    (*result)->entries = ((const unsigned char *) (*result)->data
+				  + MF_HEADER);
+	    (*result)->names = ((const char *) (*result)->entries
+				+ ((*result)->count * MF_ENTRY));
+	    TRACE(("loaded archive %s with %lu files\n", path, (*result)->count));
+	    status = 1;
+	} else {
+	    for (n = 0; n < list.count; ++n)
+		free(list.items[n].name);
+	    free(list.items);
 	}
-	free(name);
-	free(source);
+	free(links);
     }
+    return status;
 }
-#endif
 
-static void
-update_min_name_wide(long longest_name)
+/*
+ * Check the directory, manifest or archive given for -S or -D, returning
+ * false if it cannot be used.
+ */
+static int
+set_path_opt(char *value, int destination)
 {
-    if (prefix_opt < 0) {
-	if (prefix_len < 0)
-	    prefix_len = 0;
-	if ((longest_name - prefix_len) > min_name_wide)
-	    min_name_wide = (int) (longest_name - prefix_len);
+    MANIFEST *manifest;
+    int status;
+
+    ds->path_opt = value;
+    ds->path_dest = destination;
+    if (*ds->path_opt != 0) {
+	if (is_dir(ds->path_opt)) {
+	    ds->num_marks = 4;
+	} else if ((status = load_manifest(ds->path_opt, &manifest)) != 0
+		   || (status = load_tar(ds->path_opt, &manifest)) != 0) {
+	    if (status < 0)
+		return 0;
+	    ds->num_marks = 4;
+	    if (destination)
+		ds->D_manifest = manifest;
+	    else
+		ds->S_manifest = manifest;
+	} else {
+	    (void) fflush(stdout);
+	    fprintf(stderr, "Not a directory:%s\n", ds->path_opt);
+	    return 0;
+	}
     }
-
-    if (min_name_wide < 1)
-	min_name_wide = 0;
-    min_name_wide++;		/* make sure it's nonzero */
+    return 1;
 }
 
-static void
-summarize(void)
-{
-    DATA *p;
-    long total_ins = 0;
-    long total_del = 0;
-    long total_mod = 0;
-    long total_eql = 0;
-    long files_added = 0;
-    long files_equal = 0;
-    long files_binary = 0;
-    long files_removed = 0;
-    long temp;
-    int num_files = 0, shortest_name = -1, longest_name = -1;
-
-    plot_scale = 0;
-    for (p = all_data; p; p = p->link) {
-	int len = columns_of(p->modified);
+/******************************************************************************/
 
-	if (ignore_data(p))
-	    continue;
+/*
+ * Apply the options before reading the first diff, returning false if they
+ * could not be applied.
+ */
+static int
+start_diffstat(void)
+{
+    if (ds->started)
+	return !ds->broken;
+    ds->started = 1;
 
-	/*
-	 * If "-pX" option is given, prefix_opt is positive.
-	 *
-	 * "-p0" gives the whole pathname unmodified.  "-p1" strips
-	 * through the first path-separator, etc.
-	 */
-	if (prefix_opt >= 0) {
-	    /* p->base has been computed at node creation */
-	    if (min_name_wide < (len - p->base))
-		min_name_wide = (len - p->base);
+    /*
+     * The numbers from -S/-D options will only be useful if the merge option
+     * is added.
+     */
+    if ((ds->S_option && !set_path_opt(ds->S_option, 0))
+	|| (ds->D_option && !set_path_opt(ds->D_option, 1))) {
+	ds->broken = 1;
+	ds->path_opt = NULL;
+    }
+    if (ds->path_opt)
+	ds->merge_opt = 1;
+    if (ds->cache_opt != NULL) {
+	if (ds->path_opt != NULL) {
+	    load_cache();
 	} else {
-	    /*
-	     * If "-pX" option is not given, strip off any prefix which is
-	     * shared by all of the names.
-	     */
-	    if (len < prefix_len || prefix_len < 0)
-		prefix_len = len;
-	    while (prefix_len > 0) {
-		if (p->modified[prefix_len - 1] != PATHSEP)
-		    prefix_len--;
-		else if (strncmp(all_data->modified, p->modified, (size_t) prefix_len))
-		    prefix_len--;
-		else
-		    break;
-	    }
-
-	    if (len > longest_name)
-		longest_name = len;
-	    if (len < shortest_name || shortest_name < 0)
-		shortest_name = len;
+	    free(ds->cache_opt);
+	    ds->cache_opt = NULL;
 	}
     }
 
+    ds->show_progress = ds->verbose && (!isatty(fileno(stdout))
+					&& isatty(fileno(stderr)));
+
     /*
-     * Get additional counts for files where we cannot count lines changed.
+     * The summary does not depend on the order of the data, so we need not
+     * sort it.
      */
-    if (count_files) {
-	for (p = all_data; p; p = p->link) {
-	    switch (p->cmt) {
-	    case Binary:
-		files_binary++;
-		break;
-	    case Only:
-		switch (resolve_only(p)) {
-		case OnlyRight:
-		    p->cmt = OnlyRight;
-		    files_added++;
-		    break;
-		case OnlyLeft:
-		    p->cmt = OnlyLeft;
-		    files_removed++;
-		    break;
-		default:
-		    /* ignore - we could not guess */
-		    break;
-		}
-	    default:
-		break;
-	    }
-	}
+    if (ds->summary_only && ds->sort_names && ds->merge_names) {
+	ds->use_hashing = 1;
     }
+#ifdef HAVE_TSEARCH
+    ds->use_tsearch = (ds->sort_names && ds->merge_names && !ds->use_hashing);
+#endif
+    return !ds->broken;
+}
 
-    /*
-     * Use a separate loop after computing prefix_len so we can apply the "-S"
-     * or "-D" options to find files that we can use as reference for the
-     * unchanged-count.
-     */
-    for (p = all_data; p; p = p->link) {
-	if (!ignore_data(p)) {
-	    EqlOf(p) = 0;
-	    if (reverse_opt) {
-		long save_ins = InsOf(p);
-		long save_del = DelOf(p);
-		InsOf(p) = save_del;
-		DelOf(p) = save_ins;
-	    }
-	    if (path_opt != NULL) {
-		int count = count_lines(p);
+static int
+option_value(const char *value, int *result)
+{
+    char *next = NULL;
+    long number;
 
-		if (count >= 0) {
-		    EqlOf(p) = count - ModOf(p);
-		    if (path_dest != 0) {
-			EqlOf(p) -= InsOf(p);
-		    } else {
-			EqlOf(p) -= DelOf(p);
-		    }
-		    if (EqlOf(p) < 0)
-			EqlOf(p) = 0;
-		}
-	    }
-	    num_files++;
-	    total_ins += InsOf(p);
-	    total_del += DelOf(p);
-	    total_mod += ModOf(p);
-	    total_eql += EqlOf(p);
-	    temp = TotalOf(p);
-	    if (temp > plot_scale)
-		plot_scale = temp;
-	}
+    if (value == NULL)
+	return 0;
+    number = strtol(value, &next, 0);
+    if (next == NULL || *next != EOS) {
+	(void) fflush(stdout);
+	fprintf(stderr, "expected a number, have '%s'\n", value);
+	return 0;
     }
+    *result = (int) number;
+    return 1;
+}
 
-    update_min_name_wide(longest_name);
+static int
+option_string(char **target, const char *value)
+{
+    if (value == NULL)
+	return 0;
+    free(*target);
+    *target = new_string(value);
+    return 1;
+}
 
-#ifdef HAVE_OPENDIR
-    if (S_option != NULL && D_option != NULL) {
-	unchanged = (all_data == NULL);
-	count_unmodified_files(D_option, &files_equal, &total_eql);
-	if (unchanged) {
-	    for (p = all_data; p; p = p->link) {
-		int len = columns_of(p->modified);
-		if (longest_name < len)
-		    longest_name = len;
-		temp = TotalOf(p);
-		if (temp > plot_scale)
-		    plot_scale = temp;
+/*
+ * Read a diff from the named file, decompressing it if needed.
+ */
+static int
+read_named(const char *name)
+{
+    FILE *fp;
+#ifdef HAVE_POPEN
+    char *command = is_compressed(name);
+
+    if (command != NULL) {
+	if ((fp = popen(command, "r")) != NULL) {
+	    if (ds->show_progress) {
+		(void) fflush(stdout);
+		(void) fprintf(stderr, "%s\n", name);
+		(void) fflush(stderr);
 	    }
-	    update_min_name_wide(longest_name);
+	    do_stream(fp, name);
+	    (void) pclose(fp);
 	}
-    }
+	free(command);
+    } else
 #endif
+    if ((fp = fopen(name, "rb")) != NULL) {
+	if (ds->show_progress) {
+	    (void) fflush(stdout);
+	    (void) fprintf(stderr, "%s\n", name);
+	    (void) fflush(stderr);
+	}
+	do_stream(fp, name);
+	(void) fclose(fp);
+    } else {
+	perror(name);
+	return 0;
+    }
+    return 1;
+}
 
-    plot_width = (max_width - min_name_wide - 8);
-    if (plot_width < 10)
-	plot_width = 10;
+/*
+ * Read a diff from the standard input, decompressing it if needed.
+ */
+static void
+read_stdin(void)
+{
+    INPUT input;
 
-    if (plot_scale < plot_width)
-	plot_scale = plot_width;	/* 1:1 */
+    init_input(&input, fileno(stdin));
+    resize_pipe(input.fd);
+#ifdef HAVE_POPEN
+    {
+	Decompress which;
+	char *stdin_dir = NULL;
+	char *myfile;
 
-    if (table_opt == 1) {
-	if (!names_only) {
-	    printf("INSERTED,DELETED,MODIFIED,");
-	    if (path_opt)
-		printf("UNCHANGED,");
-	    if (count_files && !reverse_opt)
-		printf("FILE-ADDED,FILE-DELETED,FILE-BINARY,");
-	}
-	printf("FILENAME\n");
-    } else if (table_opt == 2) {
-	long largest = 0;
-	for (p = all_data; p; p = p->link) {
-	    if (path_opt)
-		largest = maximum(largest, EqlOf(p));
-	    largest = maximum(largest, InsOf(p));
-	    largest = maximum(largest, DelOf(p));
-	    largest = maximum(largest, ModOf(p));
-	}
-	number_len = 0;
-	while (largest > 0) {
-	    number_len++;
-	    largest /= 10;
+	while (input.used < MAX_SNIFF && more_input(&input) != 0) {
+	    ;			/* a pipe may deliver only a few bytes at first */
 	}
-	number_len = maximum(number_len, 3);
+	which = sniff_input(&input);
+	if (which != dcNone
+	    && which != dcEmpty
+	    && (myfile = copy_stdin(&input, &stdin_dir)) != NULL) {
+	    FILE *fp;
+	    char *command;
+
+	    /* open pipe to decompress temporary file */
+	    command = decompressor(which, myfile);
+	    if ((fp = popen(command, "r")) != NULL) {
+		do_stream(fp, "stdin");
+		(void) pclose(fp);
+	    }
+	    free(command);
+
+	    unlink(myfile);
+	    free(myfile);
+	    myfile = NULL;
+	    rmdir(stdin_dir);
+	    free(stdin_dir);
+	    stdin_dir = NULL;
+	} else if (which != dcEmpty)
+	    do_file(&input, "stdin");
     }
-#ifdef HAVE_TSEARCH
-    if (use_tsearch) {
-	twalk(sorted_data, show_tsearch);
-    } else
+#else
+    do_file(&input, "stdin");
 #endif
-	for (p = all_data; p; p = p->link) {
-	    show_data(p);
-	}
+    free_input(&input);
+}
 
-    if ((table_opt != 1) && !names_only) {
-#define PLURAL(n) n, n != 1 ? "s" : ""
-	if (num_files > 0 || !quiet) {
-	    printf("%s %d file%s changed", comment_opt, PLURAL(num_files));
-	    if (total_ins)
-		printf(", %ld insertion%s(+)", PLURAL(total_ins));
-	    if (total_del)
-		printf(", %ld deletion%s(-)", PLURAL(total_del));
-	    if (total_mod)
-		printf(", %ld modification%s(!)", PLURAL(total_mod));
-	    if (total_eql && path_opt != NULL)
-		printf(", %ld unchanged line%s(=)", PLURAL(total_eql));
-	    if (count_files) {
-		if (files_added)
-		    printf(", %ld file%s added", PLURAL(files_added));
-		if (files_removed)
-		    printf(", %ld file%s removed", PLURAL(files_removed));
-		if (files_binary)
-		    printf(", %ld binary file%s", PLURAL(files_binary));
-	    }
-	    (void) putchar('\n');
-	}
+#ifdef HAVE_TSEARCH
+/*
+ * Relink the list of data in the order of the tree, for diffstat_next().
+ */
+static void
+link_tsearch(const void *nodep, const VISIT which, const int depth)
+{
+    DATA *p = *(DATA * const *) nodep;
+    (void) depth;
+    if (which == postorder || which == leaf) {
+	p->link = NULL;
+	if (ds->cursor != NULL)
+	    ds->cursor->link = p;
+	else
+	    ds->all_data = p;
+	ds->cursor = p;
     }
 }
+#endif
 
-#ifdef HAVE_POPEN
-static const char *
-get_program(const char *name, const char *dft)
+/*
+ * Make a new context, with the same defaults as the diffstat program.
+ */
+DIFFSTAT *
+diffstat_new(void)
 {
-    const char *result = getenv(name);
-    if (result == NULL || *result == EOS)
-	result = dft;
-    TRACE(("get_program(%s) = %s\n", name, result));
+    DIFFSTAT *result = (DIFFSTAT *) xmalloc(sizeof(DIFFSTAT));
+
+    memset(result, 0, sizeof(*result));
+    result->comment_opt = "";
+    result->format_opt = FMT_NORMAL;
+    result->max_width = 80;
+    result->merge_names = 1;
+    result->num_marks = 3;
+    result->prefix_opt = -1;
+    result->sort_names = 1;
+    result->number_len = 5;
+    result->prefix_len = -1;
+    result->output = stdout;
     return result;
 }
-#define GET_PROGRAM(name) get_program("DIFFSTAT_" #name, name)
 
-static char *
-decompressor(Decompress which, const char *name)
+/*
+ * Set an option, given its character or long-option code, and its value if
+ * it has one.  Return false if the option or its value is not valid.  Options
+ * must be set before reading any diff.
+ */
+int
+diffstat_option(DIFFSTAT * context, int code, const char *value)
 {
-    const char *verb = NULL;
-    const char *opts = "";
-    char *result = NULL;
+    int ok = 1;
 
-    switch (which) {
-    case dcBzip:
-	verb = GET_PROGRAM(BZCAT_PATH);
-	if (*verb == EOS) {
-	    verb = GET_PROGRAM(BZIP2_PATH);
-	    opts = "-dc";
-	}
+    ds = context;
+    switch (code) {
+    case 'b':
+	ds->suppress_binary = 1;
 	break;
-    case dcCompress:
-	verb = GET_PROGRAM(ZCAT_PATH);
-	if (*verb == EOS) {
-	    verb = GET_PROGRAM(UNCOMPRESS_PATH);
-	    opts = "-c";
-	    if (*verb == EOS) {
-		/* not all compress's recognize the options, test this last */
-		verb = GET_PROGRAM(COMPRESS_PATH);
-		opts = "-dc";
-	    }
-	}
+    case 'c':
+	ds->comment_opt = "#";
 	break;
-    case dcGzip:
-	verb = GET_PROGRAM(GZIP_PATH);
-	opts = "-dc";
+    case 'C':
+	ds->show_colors = 1;
 	break;
-    case dcLzma:
-	verb = GET_PROGRAM(LZCAT_PATH);
-	opts = "-dc";
+#if OPT_TRACE
+    case 'd':
+	ds->trace_opt = 1;
 	break;
-    case dcPack:
-	verb = GET_PROGRAM(PCAT_PATH);
+#endif
+    case 'D':
+	ok = option_string(&ds->D_option, value);
 	break;
-    case dcXz:
-	verb = GET_PROGRAM(XZ_PATH);
-	opts = "-dc";
+    case 'E':
+	ds->trim_escapes = 1;
 	break;
-    case dcZstd:
-	verb = GET_PROGRAM(ZSTD_PATH);
-	opts = "-qdcf";
+    case 'f':
+	ok = option_value(value, &ds->format_opt);
 	break;
-    case dcEmpty:
-	/* FALLTHRU */
-    case dcNone:
+    case 'k':
+	ds->merge_names = 0;
+	break;
+    case 'K':
+	ds->count_files = 1;
+	break;
+    case 'l':
+	ds->names_only = 1;
+	break;
+    case 'm':
+	ds->merge_opt = 1;
+	break;
+    case 'n':
+	ok = option_value(value, &ds->min_name_wide);
+	break;
+    case 'N':
+	ok = option_value(value, &ds->max_name_wide);
+	break;
+    case 'O':
+	ds->only_listed = 1;
+	break;
+    case 'p':
+	ok = option_value(value, &ds->prefix_opt);
+	break;
+    case 'r':
+	ok = option_value(value, &ds->round_opt);
+	break;
+    case 'R':
+	ds->reverse_opt = 1;
+	break;
+    case 's':
+	ds->summary_only = 1;
+	break;
+    case 'S':
+	ok = option_string(&ds->S_option, value);
+	break;
+    case 't':
+	ds->table_opt = 1;
+	break;
+    case 'T':
+	ds->table_opt = 2;
+	break;
+    case 'u':
+	ds->sort_names = 0;
+	break;
+    case 'v':
+	ds->verbose = 1;
+	break;
+    case 'w':
+	ok = option_value(value, &ds->max_width);
+	break;
+    case 'q':
+	ds->quiet = 1;
+	break;
+    case optCache:
+	ok = option_string(&ds->cache_opt, value);
+	break;
+    case optCommits:
+	ds->commits_opt = 1;
+	break;
+    case optEstimate:
+	ds->estimate_opt = 1;
+	break;
+    case optExclude:
+	ok = (value != NULL && add_pattern(&ds->exclude_opt, value));
+	break;
+    case optGitignore:
+	ds->gitignore_opt = 1;
+	break;
+    case optIgnoreFile:
+#ifdef HAVE_OPENDIR
+	if (value == NULL || !load_ignores(value, &ds->ignore_opt)) {
+	    if (value != NULL)
+		perror(value);
+	    ok = 0;
+	}
+#endif
+	break;
+    case optInclude:
+	ok = (value != NULL && add_pattern(&ds->include_opt, value));
+	break;
+    case optJobs:
+	ok = option_value(value, &ds->jobs_opt);
+	break;
+    default:
+	ok = 0;
 	break;
     }
-    if (verb != NULL && *verb != EOS) {
-	result = (char *) xmalloc(strlen(verb) + 10 + strlen(name));
-	sprintf(result, "%s %s", verb, opts);
-	if (*name != EOS) {
-	    sprintf(result + strlen(result), " \"%s\"", name);
+    return ok;
+}
+
+/*
+ * Read diffs from the given files, or from the standard input if there are
+ * none.  Return false if a file cannot be opened.
+ */
+int
+diffstat_input(DIFFSTAT * context, int count, char *const *names)
+{
+    int ahead = 0;
+    int n;
+
+    ds = context;
+    if (!start_diffstat())
+	return 0;
+    if (count <= 0) {
+	read_stdin();
+    } else {
+	for (n = 0; n < count; ++n) {
+	    /* start reading the next few files while we parse this one */
+	    while (ahead < count && ahead < n + READ_AHEAD) {
+		will_need(names[ahead++]);
+	    }
+	    if (!read_named(names[n]))
+		return 0;
+	}
+    }
+    return 1;
+}
+
+/*
+ * Read a diff from an open stream, which is not closed.
+ */
+int
+diffstat_stream(DIFFSTAT * context, FILE *fp, const char *name)
+{
+    ds = context;
+    if (!start_diffstat())
+	return 0;
+    do_stream(fp, name);
+    return 1;
+}
+
+/*
+ * Begin a diff which will be given in pieces, naming it for the case where it
+ * has no filename header.  This is optional; the name is otherwise "stdin".
+ */
+void
+diffstat_push_begin(DIFFSTAT * context, const char *name)
+{
+    diffstat_push_end(context);
+    start_diffstat();
+    ds->pushed_name = new_string(name ? name : "stdin");
+    ds->pushed = (PARSER *) xmalloc(sizeof(PARSER));
+    begin_parse(ds->pushed, ds->pushed_name);
+    init_input(&ds->pushed_input, -1);
+}
+
+/*
+ * Parse a piece of a diff, which may end anywhere, even within a line.  The
+ * incomplete line is kept until the next piece is given, and the parser's
+ * state is kept until diffstat_push_end().
+ */
+int
+diffstat_push(DIFFSTAT * context, const void *data, size_t length)
+{
+    INPUT *ip = &context->pushed_input;
+
+    if (context->pushed == NULL)
+	diffstat_push_begin(context, NULL);
+    ds = context;
+    if (ds->broken)
+	return 0;
+    if (ip->next != 0) {
+	ip->used -= ip->next;
+	memmove(ip->data, ip->data + ip->next, ip->used);
+	ip->next = 0;
+    }
+    if (ip->used + length > ip->size) {
+	while (ip->used + length > ip->size)
+	    ip->size *= 2;
+	adjust_buffer(&ip->data, ip->size);
+    }
+    memcpy(ip->data + ip->used, data, length);
+    ip->used += length;
+
+    while (take_line(ds->pushed, ip, 0)) {
+	parse_line(ds->pushed, ip);
+    }
+    return 1;
+}
+
+/*
+ * Parse any incomplete line given to diffstat_push(), and finish that diff.
+ */
+void
+diffstat_push_end(DIFFSTAT * context)
+{
+    ds = context;
+    if (ds->pushed != NULL) {
+	INPUT *ip = &ds->pushed_input;
+
+	while (take_line(ds->pushed, ip, 1)) {
+	    parse_line(ds->pushed, ip);
+	}
+	end_parse(ds->pushed);
+	free(ds->pushed);
+	ds->pushed = NULL;
+	free(ds->pushed_name);
+	ds->pushed_name = NULL;
+	free_input(ip);
+    }
+}
+
+/*
+ * Get the counts so far for a file, including those for a chunk which is not
+ * finished.  Return false if there is nothing to show for the file yet.
+ */
+static int
+partial_counts(const DATA * p, DIFFSTAT_FILE * item)
+{
+    long ins = InsOf(p) + p->chunk[cInsert];
+    long del = DelOf(p) + p->chunk[cDelete];
+    long mod = ModOf(p) + p->chunk[cModify];
+
+    if (ds->merge_opt && p->chunk[cInsert] && p->chunk[cDelete]) {
+	long change = ((p->chunk[cInsert] > p->chunk[cDelete])
+		       ? p->chunk[cDelete]
+		       : p->chunk[cInsert]);
+	ins -= change;
+	del -= change;
+	mod += change;
+    }
+    item->name = p->modified + (ds->prefix_opt >= 0 ? p->base : 0);
+    item->status = (p->cmt == Either) ? DIFFSTAT_DIFFERS : (int) p->cmt;
+    item->inserted = ds->reverse_opt ? del : ins;
+    item->deleted = ds->reverse_opt ? ins : del;
+    item->modified = mod;
+    item->unchanged = 0;
+    return ((ins + del + mod) != 0 || p->cmt != Normal)
+	&& !(p->cmt == Binary && ds->suppress_binary);
+}
+
+/*
+ * Get the totals for the data read so far, without finishing it, returning
+ * the number of files.  The names are not trimmed of their common prefix, and
+ * the unchanged lines are not counted.  This also rewinds the list used by
+ * diffstat_partial_next().
+ */
+long
+diffstat_partial(DIFFSTAT * context, DIFFSTAT_FILE * totals)
+{
+    long result = 0;
+    DIFFSTAT_FILE item;
+    DATA *p;
+
+    ds = context;
+    memset(totals, 0, sizeof(*totals));
+    for (p = ds->all_data; p != NULL; p = p->link) {
+	if (partial_counts(p, &item)) {
+	    ++result;
+	    totals->inserted += item.inserted;
+	    totals->deleted += item.deleted;
+	    totals->modified += item.modified;
 	}
     }
+    ds->partial = ds->all_data;
     return result;
 }
 
-static char *
-is_compressed(const char *name)
+/*
+ * Get the counts so far for the next file, returning false after the last.
+ * The name is valid only until more data is given.
+ */
+int
+diffstat_partial_next(DIFFSTAT * context, DIFFSTAT_FILE * item)
 {
-    size_t len = strlen(name);
-    Decompress which;
+    DATA *p;
 
-#define CHKEND(end) \
-    (len > (sizeof(end) - 1) && \
-     !strcmp(name + len - (sizeof(end) - 1), end))
+    ds = context;
+    while ((p = ds->partial) != NULL) {
+	ds->partial = p->link;
+	if (partial_counts(p, item))
+	    return 1;
+    }
+    return 0;
+}
 
-    if (CHKEND(".Z")) {
-	which = dcCompress;
-    } else if (CHKEND(".z")) {
-	which = dcPack;
-    } else if (CHKEND(".gz")) {
-	which = dcGzip;
-    } else if (CHKEND(".bz2")) {
-	which = dcBzip;
-    } else if (CHKEND(".lzma")) {
-	which = dcLzma;
-    } else if (CHKEND(".xz")) {
-	which = dcXz;
-    } else if (CHKEND(".zst")) {
-	which = dcZstd;
-    } else {
-	which = dcNone;
+/*
+ * Compare the -S and -D directories rather than reading a diff.
+ */
+int
+diffstat_compare(DIFFSTAT * context)
+{
+    int ok = 0;
+
+    ds = context;
+    if (ds->S_option == NULL || ds->D_option == NULL) {
+	(void) fflush(stdout);
+	fprintf(stderr, "The --compare option needs both -S and -D\n");
+    } else if (start_diffstat()) {
+#ifdef HAVE_OPENDIR
+	ok = compare_trees();
+#endif
+    }
+    return ok;
+}
+
+/*
+ * Write a manifest of the given directory to the standard output.
+ */
+int
+diffstat_manifest(DIFFSTAT * context, const char *pathname)
+{
+    ds = context;
+#ifdef HAVE_OPENDIR
+    return (build_manifest(pathname) == EXIT_SUCCESS);
+#else
+    (void) pathname;
+    return 0;
+#endif
+}
+
+/*
+ * Summarize the data which has been read, counting the unchanged lines for
+ * the -S/-D options, and updating the cache.
+ */
+void
+diffstat_finish(DIFFSTAT * context)
+{
+    ds = context;
+    start_diffstat();
+    diffstat_push_end(context);
+    if (!ds->finished) {
+	ds->finished = 1;
+	summarize();
+	if (ds->cache_opt != NULL)
+	    save_cache();
+#ifdef HAVE_TSEARCH
+	if (ds->use_tsearch) {
+	    ds->cursor = NULL;
+	    ds->all_data = NULL;
+	    twalk(ds->sorted_data, link_tsearch);
+	}
+#endif
     }
-    return decompressor(which, name);
+    ds->cursor = ds->all_data;
 }
 
-#ifdef HAVE_MKDTEMP
-#define MY_MKDTEMP(path) mkdtemp(path)
-#else
 /*
- * mktemp is supposedly marked obsolete at the same point that mkdtemp is
- * introduced.
+ * Get the counts for the next file in the report, returning false after the
+ * last one.  The name is valid until the context is freed.
  */
-static char *
-my_mkdtemp(char *path)
+int
+diffstat_next(DIFFSTAT * context, DIFFSTAT_FILE * item)
 {
-    char *result = mktemp(path);
-    if (result != 0) {
-	if (MKDIR(result, 0700) < 0) {
-	    result = 0;
+    DATA *p;
+
+    if (!context->finished)
+	diffstat_finish(context);
+    ds = context;
+    while ((p = ds->cursor) != NULL) {
+	ds->cursor = p->link;
+	if (!ignore_data(p)) {
+	    item->name = data_filename(p);
+	    item->status = (int) p->cmt;
+	    item->inserted = InsOf(p);
+	    item->deleted = DelOf(p);
+	    item->modified = ModOf(p);
+	    item->unchanged = EqlOf(p);
+	    return 1;
 	}
     }
-    return path;
+    return 0;
 }
-#define MY_MKDTEMP(path) my_mkdtemp(path)
-#endif
 
-static char *
-copy_stdin(char **dirpath)
+/*
+ * Get the totals for the summary line, returning the number of files.
+ */
+long
+diffstat_totals(DIFFSTAT * context, DIFFSTAT_FILE * item)
 {
-    const char *tmp = getenv("TMPDIR");
-    char *result = NULL;
-    if (tmp == NULL)
-	tmp = "/tmp/";
-    *dirpath = xmalloc(strlen(tmp) + 12);
-
-    strcpy(*dirpath, tmp);
-    strcat(*dirpath, "/diffXXXXXX");
-
-    if (MY_MKDTEMP(*dirpath) != NULL) {
-	FILE *fp;
+    if (!context->finished)
+	diffstat_finish(context);
+    *item = context->totals;
+    return context->num_files;
+}
 
-	result = xmalloc(strlen(*dirpath) + 10);
-	sprintf(result, "%s/stdin", *dirpath);
+/*
+ * Add the summary of one context to another, which then reports only the
+ * sum, e.g., for a cumulative total of several diffs.
+ */
+void
+diffstat_add_totals(DIFFSTAT * target, DIFFSTAT * source)
+{
+    if (!source->finished)
+	diffstat_finish(source);
+    ds = target;
+    start_diffstat();
+    target->finished = 1;
+    target->totals_only = 1;
+    target->totals.inserted += source->totals.inserted;
+    target->totals.deleted += source->totals.deleted;
+    target->totals.modified += source->totals.modified;
+    target->totals.unchanged += source->totals.unchanged;
+    target->estimated |= source->estimated;
+    target->num_files += source->num_files;
+    target->files_added += source->files_added;
+    target->files_binary += source->files_binary;
+    target->files_removed += source->files_removed;
+}
 
-	if ((fp = fopen(result, "w")) != NULL) {
-	    int ch;
+/*
+ * Set the stream for the reports which --commits writes while reading.
+ */
+void
+diffstat_output(DIFFSTAT * context, FILE *fp)
+{
+    context->output = fp;
+}
 
-	    while ((ch = MY_GETC(stdin)) != EOF) {
-		fputc(ch, fp);
-	    }
-	    (void) fclose(fp);
-	} else {
-	    free(result);
-	    result = NULL;
-	    rmdir(*dirpath);	/* Assume that the /stdin file was not created */
-	    free(*dirpath);
-	    *dirpath = NULL;
-	}
-    } else {
-	free(*dirpath);
-	*dirpath = NULL;
-    }
-    return result;
+/*
+ * Write the report, as the diffstat program would.
+ */
+void
+diffstat_report(DIFFSTAT * context, FILE *fp)
+{
+    if (!context->finished)
+	diffstat_finish(context);
+    ds = context;
+    ds->output = fp;
+    show_report();
 }
-#endif
 
-static void
-set_path_opt(char *value, int destination)
+void
+diffstat_free(DIFFSTAT * context)
 {
-    path_opt = value;
-    path_dest = destination;
-    if (*path_opt != 0) {
-	if (is_dir(path_opt)) {
-	    num_marks = 4;
-	} else {
-	    (void) fflush(stdout);
-	    fprintf(stderr, "Not a directory:%s\n", path_opt);
-	    exit(EXIT_FAILURE);
-	}
+    if (context == NULL)
+	return;
+    ds = context;
+    diffstat_push_end(context);
+    free_cache();
+    free_ref_dirs();
+    free_manifest(ds->S_manifest);
+    free_manifest(ds->D_manifest);
+    while (ds->all_data != 0) {
+	delink(ds->all_data);
     }
+    free(ds->hashed_data);
+    free(ds->excluded.original);
+    free(ds->excluded.modified);
+    free_patterns(&ds->include_opt);
+    free_patterns(&ds->exclude_opt);
+#ifdef HAVE_OPENDIR
+    free_ignore_rules(ds->ignore_opt);
+#endif
+    free(ds->S_option);
+    free(ds->D_option);
+    free(ds->cache_opt);
+    free(ds->commit_hash);
+    free(ds->commit_author);
+    free(ds);
+    ds = NULL;
 }
 
+#ifndef DIFFSTAT_LIBRARY
+/******************************************************************************/
+
 static void
 usage(FILE *fp)
 {
@@ -3336,166 +8847,645 @@ usage(FILE *fp)
 	"  -v      show progress if output is redirected to a file",
 	"  -V      prints the version number",
 	"  -w NUM  specify maximum width of the output (default: 80)",
+	"",
+	"Long options:",
+	"  --batch              report each input file separately",
+	"  --batch-list=FILE    like --batch, reading the input names from FILE",
+	"  --batch-total        like --batch, adding a cumulative summary",
+	"  --build-manifest=DIR write a manifest of DIR for use by -S/-D",
+	"  --cache=FILE         remember line-counts of -S/-D files in FILE",
+#if USE_SERVER
+	"  --client=SOCKET      run with the options which follow, using a server",
+#endif
+	"  --commits            report each commit of \"git log -p\" or a mailbox",
+	"  --compare            compare the -S and -D trees rather than read a diff",
+	"  --estimate-unchanged estimate -S/-D line-counts from the start of each file",
+	"  --exclude=PATTERN    ignore files whose pathname matches PATTERN",
+	"  --gitignore          skip files in -D matched by its .gitignore files",
+	"  --help               print this message",
+	"  --ignore-file=FILE   skip files in -D matched by rules in FILE",
+	"  --include=PATTERN    count only files whose pathname matches PATTERN",
+	"  --jobs=NUM           use NUM threads to compare -S/-D files (default: auto)",
+#if USE_SERVER
+	"  --serve=SOCKET       run as a server for --client on the named SOCKET",
+#endif
+	"  --version            prints the version number",
     };
     unsigned j;
     for (j = 0; j < sizeof(msg) / sizeof(msg[0]); j++)
 	fprintf(fp, "%s\n", msg[j]);
 }
 
-/* Wrapper around getopt that also parses "--help" and "--version".
- * argc, argv, opts, return value, and globals optarg, optind,
- * opterr, and optopt are as in getopt().  help and version designate
- * what should be returned if --help or --version are encountered. */
+/*
+ * Long options, which are not all available as single-character options.
+ * Their codes are defined in diffstat.h.
+ */
+
+typedef struct {
+    const char *name;
+    int code;
+    int param;			/* true if the option has a parameter */
+} LONG_OPTION;
+
+static const LONG_OPTION long_options[] =
+{
+    {"batch", optBatch, 0},
+    {"batch-list", optBatchList, 1},
+    {"batch-total", optBatchTotal, 0},
+    {"build-manifest", optBuildManifest, 1},
+    {"cache", optCache, 1},
+#if USE_SERVER
+    {"client", optClient, 1},
+#endif
+    {"commits", optCommits, 0},
+    {"compare", optCompare, 0},
+    {"estimate-unchanged", optEstimate, 0},
+    {"exclude", optExclude, 1},
+    {"gitignore", optGitignore, 0},
+    {"help", 'h', 0},
+    {"ignore-file", optIgnoreFile, 1},
+    {"include", optInclude, 1},
+    {"jobs", optJobs, 1},
+#if USE_SERVER
+    {"serve", optServe, 1},
+#endif
+    {"version", 'V', 0},
+};
+
+/* Wrapper around getopt that also parses long options such as "--help" and
+ * "--version".  argc, argv, opts, return value, and globals optarg, optind,
+ * opterr, and optopt are as in getopt().  A long option's parameter may be
+ * given after "=" or as the next argument.  If getopt_long() is available,
+ * use that, so that long options may follow the filenames just as the other
+ * options can when getopt() reorders the arguments.  */
 static int
-getopt_helper(int argc, char *const argv[], const char *opts,
-	      int help, int version)
+getopt_helper(int argc, char *const argv[], const char *opts)
 {
-    if (optind < argc && argv[optind] != NULL) {
-	if (strcmp(argv[optind], "--help") == 0) {
-	    optind++;
-	    return help;
-	} else if (strcmp(argv[optind], "--version") == 0) {
-	    optind++;
-	    return version;
+#ifdef HAVE_GETOPT_LONG
+#define NUM_LONG_OPTS (sizeof(long_options) / sizeof(long_options[0]))
+    static struct option table[NUM_LONG_OPTS + 1];
+
+    if (table[0].name == NULL) {
+	unsigned n;
+
+	for (n = 0; n < NUM_LONG_OPTS; ++n) {
+	    table[n].name = long_options[n].name;
+	    table[n].has_arg = (long_options[n].param
+				? required_argument
+				: no_argument);
+	    table[n].flag = NULL;
+	    table[n].val = long_options[n].code;
+	}
+    }
+    return getopt_long(argc, argv, opts, table, NULL);
+#else
+    if (optind < argc
+	&& argv[optind] != NULL
+	&& !strncmp(argv[optind], "--", (size_t) 2)
+	&& argv[optind][2] != EOS) {
+	char *name = argv[optind] + 2;
+	char *value = strchr(name, '=');
+	size_t length = (value != NULL) ? (size_t) (value - name) : strlen(name);
+	unsigned n;
+
+	for (n = 0; n < sizeof(long_options) / sizeof(long_options[0]); ++n) {
+	    const LONG_OPTION *p = &long_options[n];
+	    if (strlen(p->name) == length && !strncmp(p->name, name, length)) {
+		optind++;
+		if (p->param) {
+		    if (value != NULL) {
+			optarg = value + 1;
+		    } else if (optind < argc) {
+			optarg = argv[optind++];
+		    } else {
+			(void) fflush(stdout);
+			fprintf(stderr, "option requires a parameter: --%s\n",
+				p->name);
+			return '?';
+		    }
+		} else if (value != NULL) {
+		    (void) fflush(stdout);
+		    fprintf(stderr, "option takes no parameter: --%s\n",
+			    p->name);
+		    return '?';
+		}
+		return p->code;
+	    }
 	}
     }
     return getopt(argc, argv, opts);
+#endif
 }
 
+#define OPTIONS "\
+b\
+cC\
+dD:\
+e:E\
+f:\
+h\
+kK\
+l\
+m\
+n:N:\
+o:O\
+p:\
+q\
+r:R\
+sS:\
+tT\
+uv\
+Vw:"
+
+/*
+ * The options which were given to the program's context, to repeat for each
+ * context used by --batch.
+ */
+typedef struct {
+    int code;
+    const char *value;
+} SAVED_OPTION;
+
+typedef struct {
+    SAVED_OPTION *list;
+    size_t count;
+    size_t size;
+} SAVED_OPTIONS;
+
 static int
-getopt_value(void)
+set_option(DIFFSTAT * context,
+	   SAVED_OPTIONS * saved,
+	   int code,
+	   const char *value)
 {
-    char *next = NULL;
-    long value = strtol(optarg, &next, 0);
-    if (next == NULL || *next != EOS) {
-	(void) fflush(stdout);
-	fprintf(stderr, "expected a number, have '%s'\n", optarg);
-	exit(EXIT_FAILURE);
+    if (saved->count >= saved->size) {
+	saved->size = (saved->size != 0) ? (saved->size * 2) : 16;
+	saved->list = (SAVED_OPTION *) realloc(saved->list,
+					       saved->size * sizeof(SAVED_OPTION));
+	if (saved->list == NULL)
+	    failed("realloc");
+    }
+    saved->list[saved->count].code = code;
+    saved->list[saved->count].value = value;
+    saved->count++;
+    return diffstat_option(context, code, value);
+}
+
+/*
+ * The inputs for --batch, each with its own context and report.  The reports
+ * are written to temporary files so that several can be made at once, and
+ * copied to the standard output in the order of the inputs.  Only a few
+ * inputs past the last one copied are read, to limit the open files.
+ */
+typedef struct {
+    char *name;			/* the input, or null for the standard input */
+    char *prefix;		/* the -p value from a quilt series, if any */
+    int reverse;		/* true for -R in a quilt series */
+    FILE *report;		/* the report, until it is copied */
+    int ok;			/* false if the input could not be read */
+    int done;			/* true once the report is written */
+} BATCH_ITEM;
+
+typedef struct {
+    BATCH_ITEM *items;
+    size_t count;
+    size_t size;
+    size_t next;		/* index of the next input to read */
+    size_t copied;		/* number of reports copied to the output */
+    size_t window;		/* limit on inputs read past those copied */
+    SAVED_OPTIONS *options;
+    DIFFSTAT *total;		/* the cumulative total, for --batch-total */
+    int rejected;		/* true if a series line was not used */
+#if USE_THREADS
+    pthread_mutex_t lock;
+    pthread_cond_t ready;	/* signaled when a report is done */
+#endif
+} BATCH;
+
+static BATCH_ITEM *
+add_batch_item(BATCH * batch, char *name)
+{
+    if (batch->count >= batch->size) {
+	batch->size = (batch->size != 0) ? (batch->size * 2) : 64;
+	batch->items = (BATCH_ITEM *) realloc(batch->items,
+					      batch->size * sizeof(BATCH_ITEM));
+	if (batch->items == NULL)
+	    failed("realloc");
+    }
+    memset(&batch->items[batch->count], 0, sizeof(BATCH_ITEM));
+    batch->items[batch->count].name = name;
+    return &batch->items[batch->count++];
+}
+
+static char *
+batch_path(const char *dir, size_t length, const char *leaf)
+{
+    char *result = (char *) xmalloc(length + strlen(leaf) + 2);
+
+    sprintf(result, "%.*s%s%s", (int) length, dir,
+	    (length != 0 && dir[length - 1] != PATHSEP) ? "/" : "",
+	    leaf);
+    return result;
+}
+
+static int
+compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/*
+ * Add the *.patch files in a directory, in the order of their names.
+ */
+static void
+add_batch_dir(BATCH * batch, const char *path)
+{
+#ifdef HAVE_OPENDIR
+    DIR *dp;
+
+    if ((dp = opendir(path)) != NULL) {
+	struct dirent *de;
+	char **names = NULL;
+	size_t count = 0;
+	size_t size = 0;
+	size_t n;
+
+	while ((de = readdir(dp)) != NULL) {
+	    size_t len = strlen(de->d_name);
+
+	    if (len > 6 && !strcmp(de->d_name + len - 6, ".patch")) {
+		if (count >= size) {
+		    size = (size != 0) ? (size * 2) : 64;
+		    names = (char **) realloc(names, size * sizeof(char *));
+		    if (names == NULL)
+			failed("realloc");
+		}
+		names[count++] = batch_path(path, strlen(path), de->d_name);
+	    }
+	}
+	closedir(dp);
+	if (count != 0)
+	    qsort(names, count, sizeof(char *), compare_names);
+	for (n = 0; n < count; ++n)
+	    add_batch_item(batch, names[n]);
+	free(names);
+    } else {
+	perror(path);
+    }
+#else
+    (void) fflush(stdout);
+    fprintf(stderr, "cannot read directory %s\n", path);
+    (void) batch;
+#endif
+}
+
+/*
+ * Call the function for each line of the file, less its newline.  The name
+ * "-" is the standard input.
+ */
+static int
+each_line(const char *path, void (*func) (BATCH *, const char *, char *),
+	  BATCH * batch)
+{
+    FILE *fp = strcmp(path, "-") ? fopen(path, "r") : stdin;
+    INPUT input;
+    char *buffer = NULL;
+    size_t length = BUFSIZ;
+
+    if (fp == NULL) {
+	perror(path);
+	return 0;
+    }
+    init_input(&input, fileno(fp));
+    fixed_buffer(&buffer, length);
+    while (get_line(&buffer, &length, &input)) {
+	char *s = buffer + strlen(buffer);
+
+	while (s != buffer && (s[-1] == '\n' || s[-1] == '\r'))
+	    *--s = EOS;
+	func(batch, path, buffer);
+    }
+    free(buffer);
+    free_input(&input);
+    if (fp != stdin)
+	(void) fclose(fp);
+    return 1;
+}
+
+/*
+ * Return the next blank-separated word of a line, or null at its end.
+ */
+static char *
+next_word(char **line)
+{
+    char *s = skip_blanks(*line);
+    char *t = s;
+
+    if (*s == EOS)
+	return NULL;
+    while (*t != EOS && !isspace(UC(*t)))
+	++t;
+    if (*t != EOS)
+	*t++ = EOS;
+    *line = t;
+    return s;
+}
+
+/*
+ * A quilt "series" file names a patch on each line, relative to the file's
+ * directory, followed by options for patch.  The -p and -R options apply to
+ * that patch's report.  A line with other options is not used, since the
+ * report might not match what quilt does.
+ */
+static void
+series_line(BATCH * batch, const char *path, char *line)
+{
+    const char *leaf = strrchr(path, PATHSEP);
+    size_t length = leaf ? (size_t) (leaf - path) : 0;
+    char *name = next_word(&line);
+    char *prefix = NULL;
+    char *word;
+    int reverse = 0;
+    BATCH_ITEM *item;
+
+    if (name == NULL || *name == '#')
+	return;
+    while ((word = next_word(&line)) != NULL && *word != '#') {
+	if (!strncmp(word, "-p", (size_t) 2)) {
+	    prefix = (word[2] != EOS) ? (word + 2) : next_word(&line);
+	    if (prefix == NULL || *prefix == EOS
+		|| strspn(prefix, "0123456789") != strlen(prefix)) {
+		(void) fflush(stdout);
+		fprintf(stderr, "%s: expected a number for -p: %s\n", path, name);
+		batch->rejected = 1;
+		return;
+	    }
+	} else if (!strcmp(word, "-R")) {
+	    reverse = 1;
+	} else {
+	    (void) fflush(stdout);
+	    fprintf(stderr, "%s: unsupported option %s: %s\n", path, word, name);
+	    batch->rejected = 1;
+	    return;
+	}
+    }
+    item = add_batch_item(batch, batch_path(path, length, name));
+    item->prefix = (prefix != NULL) ? new_string(prefix) : NULL;
+    item->reverse = reverse;
+}
+
+/*
+ * Add an input for --batch: a directory gives its *.patch files, and a quilt
+ * "series" file gives the patches which it lists.
+ */
+static void
+add_batch_input(BATCH * batch, const char *name)
+{
+    const char *leaf = strrchr(name, PATHSEP);
+    struct stat sb;
+
+    leaf = leaf ? leaf + 1 : name;
+    if (stat(name, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+	add_batch_dir(batch, name);
+    } else if (!strcmp(leaf, "series") && S_ISREG(sb.st_mode)) {
+	(void) each_line(name, series_line, batch);
+    } else {
+	add_batch_item(batch, new_string(name));
+    }
+}
+
+/*
+ * A --batch-list file names an input on each line.
+ */
+static void
+list_line(BATCH * batch, const char *path, char *line)
+{
+    (void) path;
+    if (*line != EOS)
+	add_batch_input(batch, line);
+}
+
+static void
+batch_report(BATCH * batch, BATCH_ITEM * item)
+{
+    DIFFSTAT *context = diffstat_new();
+    size_t n;
+
+    for (n = 0; n < batch->options->count; ++n) {
+	(void) diffstat_option(context,
+			       batch->options->list[n].code,
+			       batch->options->list[n].value);
+    }
+    if (item->prefix != NULL)
+	(void) diffstat_option(context, 'p', item->prefix);
+    if (item->reverse)
+	(void) diffstat_option(context, 'R', NULL);
+    if ((item->report = tmpfile()) == NULL)
+	failed("tmpfile");
+    diffstat_output(context, item->report);
+    if ((item->ok = diffstat_input(context, (item->name != NULL),
+				   &item->name)) != 0)
+	diffstat_report(context, item->report);
+
+#if USE_THREADS
+    pthread_mutex_lock(&batch->lock);
+#endif
+    if (item->ok && batch->total != NULL)
+	diffstat_add_totals(batch->total, context);
+    item->done = 1;
+#if USE_THREADS
+    pthread_cond_broadcast(&batch->ready);
+    pthread_mutex_unlock(&batch->lock);
+#endif
+    diffstat_free(context);
+}
+
+/*
+ * Copy a report to the standard output, after a heading if given, and a blank
+ * line if it is not the first.  Nothing is written for an empty report.
+ */
+static void
+batch_output(FILE *report, const char *heading, int first)
+{
+    char buffer[BUFSIZ];
+    size_t got;
+
+    if (heading != NULL || ftell(report) > 0) {
+	if (!first)
+	    (void) fputc('\n', stdout);
+	if (heading != NULL)
+	    printf("%s:\n", heading);
+	rewind(report);
+	while ((got = fread(buffer, sizeof(char), sizeof(buffer), report)) != 0)
+	    (void) fwrite(buffer, sizeof(char), got, stdout);
+    }
+    (void) fclose(report);
+}
+
+#if USE_THREADS
+static void *
+batch_worker(void *arg)
+{
+    BATCH *batch = (BATCH *) arg;
+
+    for (;;) {
+	size_t n;
+
+	pthread_mutex_lock(&batch->lock);
+	while (batch->next < batch->count
+	       && batch->next >= batch->copied + batch->window)
+	    pthread_cond_wait(&batch->ready, &batch->lock);
+	n = batch->next;
+	if (n < batch->count)
+	    batch->next++;
+	pthread_mutex_unlock(&batch->lock);
+	if (n >= batch->count)
+	    break;
+
+	batch_report(batch, &batch->items[n]);
+    }
+    return NULL;
+}
+#endif
+
+/*
+ * Read each input with a separate context, writing the reports in the order
+ * of the inputs, while other threads read the inputs which follow.
+ */
+static int
+run_batch(BATCH * batch, int workers)
+{
+    int ok = !batch->rejected;
+    int shown = 0;
+    size_t n;
+#if USE_THREADS
+    pthread_t *threads = NULL;
+    int started = 0;
+
+    if ((size_t) workers > batch->count)
+	workers = (int) batch->count;
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_cond_init(&batch->ready, NULL);
+    batch->window = 2 * (size_t) workers;
+    if (workers > 1) {
+	threads = (pthread_t *) xmalloc((size_t) workers * sizeof(pthread_t));
+	for (started = 0; started < workers; ++started) {
+	    if (pthread_create(&threads[started], NULL, batch_worker, batch) != 0)
+		break;
+	}
+    }
+#else
+    (void) workers;
+#endif
+
+    for (n = 0; n < batch->count; ++n) {
+	BATCH_ITEM *item = &batch->items[n];
+
+#if USE_THREADS
+	if (started != 0) {
+	    pthread_mutex_lock(&batch->lock);
+	    while (!item->done)
+		pthread_cond_wait(&batch->ready, &batch->lock);
+	    pthread_mutex_unlock(&batch->lock);
+	} else
+#endif
+	    batch_report(batch, item);
+	if (item->ok) {
+	    batch_output(item->report,
+			 item->name ? item->name : "stdin",
+			 !shown++);
+	} else {
+	    (void) fclose(item->report);
+	    ok = 0;
+	}
+#if USE_THREADS
+	if (started != 0) {
+	    pthread_mutex_lock(&batch->lock);
+	    batch->copied = n + 1;
+	    pthread_cond_broadcast(&batch->ready);
+	    pthread_mutex_unlock(&batch->lock);
+	}
+#endif
+    }
+
+#if USE_THREADS
+    while (started > 0)
+	pthread_join(threads[--started], NULL);
+    free(threads);
+    pthread_cond_destroy(&batch->ready);
+    pthread_mutex_destroy(&batch->lock);
+#endif
+
+    if (batch->total != NULL) {
+	FILE *report;
+
+	if ((report = tmpfile()) == NULL)
+	    failed("tmpfile");
+	diffstat_report(batch->total, report);
+	batch_output(report, NULL, !shown);
     }
-    return (int) value;
+    return ok;
 }
 
-#define OPTIONS "\
-b\
-cC\
-dD:\
-e:E\
-f:\
-h\
-kK\
-l\
-m\
-n:N:\
-o:\
-p:\
-q\
-r:R\
-sS:\
-tT\
-uv\
-Vw:"
+static void
+free_batch(BATCH * batch)
+{
+    size_t n;
 
-int
-main(int argc, char *argv[])
+    for (n = 0; n < batch->count; ++n) {
+	free(batch->items[n].name);
+	free(batch->items[n].prefix);
+    }
+    free(batch->items);
+}
+
+/*
+ * Run the program with the given arguments, returning its exit-status.
+ */
+static int
+run_diffstat(int argc, char *argv[])
 {
+    DIFFSTAT *context = diffstat_new();
+    SAVED_OPTIONS saved;
+    BATCH batch;
+    const char *batch_list = NULL;
+    const char *build_manifest_opt = NULL;
+    int batch_opt = 0;
+    int batch_total = 0;
+    int commits_opt = 0;
+    int compare_opt = 0;
+    int jobs = 0;
+    int ok;
     int j;
     char version[80];
+    char width[20];
+
+    memset(&saved, 0, sizeof(saved));
+    memset(&batch, 0, sizeof(batch));
 
 #if defined(HAVE_TCGETATTR) && defined(TIOCGWINSZ)
     if (isatty(fileno(stdout))) {
 	struct winsize data;
 	if (ioctl(fileno(stdout), TIOCGWINSZ, &data) == 0) {
-	    max_width = data.ws_col;
+	    sprintf(width, "%d", data.ws_col);
+	    (void) set_option(context, &saved, 'w', width);
 	}
     }
 #endif
 
-#ifdef HAVE_MBSTOWCWIDTH
-    setlocale(LC_CTYPE, "");
-#endif
-
-    while ((j = getopt_helper(argc, argv, OPTIONS, 'h', 'V'))
-	   != -1) {
+    while ((j = getopt_helper(argc, argv, OPTIONS)) != -1) {
 	switch (j) {
-	case 'b':
-	    suppress_binary = 1;
-	    break;
-	case 'c':
-	    comment_opt = "#";
-	    break;
-	case 'C':
-	    show_colors = 1;
-	    break;
-#if OPT_TRACE
-	case 'd':
-	    trace_opt = 1;
-	    break;
-#endif
-	case 'D':
-	    D_option = optarg;
-	    break;
 	case 'e':
 	    if (freopen(optarg, "w", stderr) == NULL)
 		failed(optarg);
 	    break;
-	case 'E':
-	    trim_escapes = 1;
-	    break;
-	case 'f':
-	    format_opt = getopt_value();
-	    break;
 	case 'h':
 	    usage(stdout);
 	    return (EXIT_SUCCESS);
-	case 'k':
-	    merge_names = 0;
-	    break;
-	case 'K':
-	    count_files = 1;
-	    break;
-	case 'l':
-	    names_only = 1;
-	    break;
-	case 'm':
-	    merge_opt = 1;
-	    break;
-	case 'n':
-	    min_name_wide = getopt_value();
-	    break;
-	case 'N':
-	    max_name_wide = getopt_value();
-	    break;
 	case 'o':
 	    if (freopen(optarg, "w", stdout) == NULL)
 		failed(optarg);
 	    break;
-	case 'p':
-	    prefix_opt = getopt_value();
-	    break;
-	case 'r':
-	    round_opt = getopt_value();
-	    break;
-	case 'R':
-	    reverse_opt = 1;
-	    break;
-	case 's':
-	    summary_only = 1;
-	    break;
-	case 'S':
-	    S_option = optarg;
-	    break;
-	case 't':
-	    table_opt = 1;
-	    break;
-	case 'T':
-	    table_opt = 2;
-	    break;
-	case 'u':
-	    sort_names = 0;
-	    break;
-	case 'v':
-	    verbose = 1;
-	    break;
 	case 'V':
 #ifndef	NO_IDENT
 	    if (!sscanf(Id, "%*s %*s %30s", version))
@@ -3503,180 +9493,496 @@ main(int argc, char *argv[])
 		(void) strcpy(version, "?");
 	    printf("diffstat version %s\n", version);
 	    return (EXIT_SUCCESS);
-	case 'w':
-	    max_width = getopt_value();
+	case optBatch:
+	    batch_opt = 1;
 	    break;
-	case 'q':
-	    quiet = 1;
+	case optBatchList:
+	    batch_opt = 1;
+	    batch_list = optarg;
 	    break;
-	default:
-	    usage(stderr);
+	case optBatchTotal:
+	    batch_opt = 1;
+	    batch_total = 1;
+	    break;
+	case optBuildManifest:
+	    build_manifest_opt = optarg;
+	    break;
+	case optCompare:
+	    compare_opt = 1;
+	    break;
+	case optClient:
+	case optServe:
+	    /* these are recognized only as the first option, by main() */
+	    (void) fflush(stdout);
+	    fprintf(stderr, "--client or --serve must be the first option\n");
 	    return (EXIT_FAILURE);
+	default:
+	    if (!set_option(context, &saved, j, optarg)) {
+		if (j == '?')
+		    usage(stderr);
+		return (EXIT_FAILURE);
+	    }
+	    if (j == optJobs)
+		jobs = atoi(optarg);
+	    else if (j == optCommits)
+		commits_opt = 1;
+	    break;
 	}
     }
 
-    /*
-     * The numbers from -S/-D options will only be useful if the merge option
-     * is added.
-     */
-    if (S_option)
-	set_path_opt(S_option, 0);
-    if (D_option)
-	set_path_opt(D_option, 1);
-    if (path_opt)
-	merge_opt = 1;
+    if (batch_total && commits_opt) {
+	fprintf(stderr, "--batch-total cannot be used with --commits\n");
+	return (EXIT_FAILURE);
+    }
+    if (batch_opt && (compare_opt || build_manifest_opt != NULL)) {
+	fprintf(stderr, "--batch cannot be used with %s\n",
+		compare_opt ? "--compare" : "--build-manifest");
+	return (EXIT_FAILURE);
+    }
+
+    if (build_manifest_opt != NULL) {
+	ok = diffstat_manifest(context, build_manifest_opt);
+    } else if (batch_opt) {
+	for (j = optind; j < argc; ++j)
+	    add_batch_input(&batch, argv[j]);
+	if (batch_list != NULL)
+	    ok = each_line(batch_list, list_line, &batch);
+	else
+	    ok = 1;
+	if (batch.count == 0 && optind == argc && batch_list == NULL)
+	    add_batch_item(&batch, NULL);
+#if defined(HAVE_SYSCONF) && defined(_SC_NPROCESSORS_ONLN)
+	if (jobs <= 0)
+	    jobs = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	batch.options = &saved;
+	batch.total = batch_total ? context : NULL;
+	if (!run_batch(&batch, jobs))
+	    ok = 0;
+	free_batch(&batch);
+    } else {
+	if (compare_opt)
+	    ok = diffstat_compare(context);
+	else
+	    ok = diffstat_input(context, argc - optind, argv + optind);
+	if (ok)
+	    diffstat_report(context, stdout);
+    }
+#if defined(NO_LEAKS)
+    diffstat_free(context);
+#endif
+    free(saved.list);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#if USE_SERVER
+/*
+ * A request to the server is a header, followed by "count" null-terminated
+ * strings: the client's working directory, and its arguments.  The client's
+ * standard input, output and error are passed with the header, so that the
+ * server reads and writes those directly.  The reply is the exit-status, as
+ * a single byte.
+ *
+ * The header is a magic string, ending with the protocol's version, and the
+ * count and total length of the strings, as 32-bit big-endian values.
+ */
+typedef struct {
+    unsigned count;		/* number of strings */
+    unsigned length;		/* total size of the strings */
+} REQUEST;
 
-    show_progress = verbose && (!isatty(fileno(stdout))
-				&& isatty(fileno(stderr)));
+#define RQ_MAGIC	"dsr1"
+#define RQ_HEADER	12	/* size of header */
 
-#ifdef HAVE_TSEARCH
-    use_tsearch = (sort_names && merge_names);
+#define RQ_COUNT	4	/* offsets within the header */
+#define RQ_LENGTH	8
+
+#define MAX_REQUEST (1024 * 1024)
+
+/*
+ * Check for --serve or --client as the first option, returning the number of
+ * arguments used, or zero if not found.
+ */
+static int
+socket_option(int argc, char *argv[], const char *name, const char **path)
+{
+    int result = 0;
+    size_t len = strlen(name);
+
+    if (argc > 1
+	&& !strncmp(argv[1], "--", (size_t) 2)
+	&& !strncmp(argv[1] + 2, name, len)) {
+	const char *value = argv[1] + 2 + len;
+
+	if (*value == '=') {
+	    *path = value + 1;
+	    result = 1;
+	} else if (*value == EOS && argc > 2) {
+	    *path = argv[2];
+	    result = 2;
+	}
+    }
+    return result;
+}
+
+static int
+socket_address(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+	(void) fflush(stdout);
+	fprintf(stderr, "socket name is too long: %s\n", path);
+	return 0;
+    }
+    strcpy(addr->sun_path, path);
+    return 1;
+}
+
+static int
+read_fully(int fd, void *buffer, size_t length)
+{
+    char *data = (char *) buffer;
+
+    while (length != 0) {
+	ssize_t got = read(fd, data, length);
+	if (got <= 0) {
+	    if (got < 0 && errno == EINTR)
+		continue;
+	    return 0;
+	}
+	data += got;
+	length -= (size_t) got;
+    }
+    return 1;
+}
+
+static int
+write_fully(int fd, const void *buffer, size_t length)
+{
+    const char *data = (const char *) buffer;
+
+    while (length != 0) {
+	ssize_t put = write(fd, data, length);
+	if (put <= 0) {
+	    if (put < 0 && errno == EINTR)
+		continue;
+	    return 0;
+	}
+	data += put;
+	length -= (size_t) put;
+    }
+    return 1;
+}
+
+/*
+ * Send the header for a request, with the standard file descriptors.
+ */
+static int
+send_header(int conn, REQUEST * header)
+{
+    static const int fds[3] =
+    {0, 1, 2};
+    union {
+	struct cmsghdr align;
+	char space[CMSG_SPACE(sizeof(fds))];
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    unsigned char wire[RQ_HEADER];
+    ssize_t put;
+
+    memcpy(wire, RQ_MAGIC, (size_t) RQ_COUNT);
+    put_mf32(wire + RQ_COUNT, (unsigned long) header->count);
+    put_mf32(wire + RQ_LENGTH, (unsigned long) header->length);
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = (void *) wire;
+    iov.iov_len = sizeof(wire);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    do {
+	put = sendmsg(conn, &msg, 0);
+    } while (put < 0 && errno == EINTR);
+    return (put == (ssize_t) sizeof(wire));
+}
+
+/*
+ * Receive the header for a request, with the client's file descriptors.
+ */
+static int
+recv_header(int conn, REQUEST * header, int *fds)
+{
+    union {
+	struct cmsghdr align;
+	char space[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    unsigned char wire[RQ_HEADER];
+    ssize_t got;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void *) wire;
+    iov.iov_len = sizeof(wire);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+    do {
+	got = recvmsg(conn, &msg, 0);
+    } while (got < 0 && errno == EINTR);
+    if (got != (ssize_t) sizeof(wire)
+	|| memcmp(wire, RQ_MAGIC, (size_t) RQ_COUNT)
+	|| (cmsg = CMSG_FIRSTHDR(&msg)) == NULL
+	|| cmsg->cmsg_level != SOL_SOCKET
+	|| cmsg->cmsg_type != SCM_RIGHTS
+	|| cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+	return 0;
+    memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+    header->count = (unsigned) get_mf32(wire + RQ_COUNT);
+    header->length = (unsigned) get_mf32(wire + RQ_LENGTH);
+    return 1;
+}
+
+/*
+ * Handle one request, in a child process of the server.
+ */
+static int
+serve_request(int conn)
+{
+    REQUEST header;
+    int fds[3];
+    char *data;
+    char *next = NULL;
+    char **args;
+    int code = EXIT_FAILURE;
+    int argc = 0;
+    int n;
+    unsigned char status;
+
+    if (!recv_header(conn, &header, fds)
+	|| header.count < 2
+	|| header.length > MAX_REQUEST)
+	return code;
+    for (n = 0; n < 3; ++n) {
+	(void) dup2(fds[n], n);
+	if (fds[n] > 2)
+	    (void) close(fds[n]);
+    }
+
+    data = (char *) xmalloc((size_t) header.length + 1);
+    args = (char **) xmalloc((header.count + 1) * sizeof(char *));
+    if (read_fully(conn, data, (size_t) header.length)) {
+	data[header.length] = EOS;
+	for (next = data;
+	     next < data + header.length && argc < (int) header.count;
+	     next += strlen(next) + 1) {
+	    args[argc++] = next;
+	}
+	args[argc] = NULL;
+    }
+    if (argc != (int) header.count || next < data + header.length) {
+	fprintf(stderr, "incomplete request\n");
+    } else if (chdir(args[0]) != 0) {
+	perror(args[0]);
+    } else {
+	optind = 1;
+	code = run_diffstat(argc - 1, args + 1);
+	(void) fflush(stdout);
+	(void) fflush(stderr);
+    }
+    status = (unsigned char) code;
+    (void) write_fully(conn, &status, sizeof(status));
+    free(args);
+    free(data);
+    return code;
+}
+
+/*
+ * Check that the client is run by the same user as the server.  The socket is
+ * created without permissions for other users, but some systems ignore those.
+ * Linux has no getpeereid(), but gives the peer's credentials as SO_PEERCRED.
+ */
+static int
+same_user(int conn)
+{
+#if defined(HAVE_GETPEEREID)
+    uid_t uid;
+    gid_t gid;
+
+    return (getpeereid(conn, &uid, &gid) == 0 && uid == geteuid());
+#elif defined(HAVE_SO_PEERCRED) && defined(SO_PEERCRED)
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    return (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0
+	    && len == sizeof(cred)
+	    && cred.uid == geteuid());
+#else
+    (void) conn;
+    return 1;
 #endif
+}
 
-    if (optind < argc) {
-	while (optind < argc) {
-	    FILE *fp;
-	    const char *name = argv[optind++];
-#ifdef HAVE_POPEN
-	    char *command = is_compressed(name);
-	    if (command != NULL) {
-		if ((fp = popen(command, "r")) != NULL) {
-		    if (show_progress) {
-			(void) fflush(stdout);
-			(void) fprintf(stderr, "%s\n", name);
-			(void) fflush(stderr);
-		    }
-		    do_file(fp, name);
-		    (void) pclose(fp);
-		}
-		free(command);
-	    } else
+/*
+ * Accept requests on the named socket, running each in a new process, which
+ * has a copy of the server's state without repeating its initialization.
+ */
+static int
+serve_diffstat(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat sb;
+    mode_t mask;
+    int listener;
+    int ok;
+
+    if (!socket_address(&addr, path))
+	return EXIT_FAILURE;
+#ifdef S_ISSOCK
+    if (do_stat(path, &sb) == 0 && S_ISSOCK(sb.st_mode)) {
+	/* do not take the socket from a server which is still running */
+	if ((listener = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+	    failed("socket");
+	ok = (connect(listener, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+	(void) close(listener);
+	if (ok) {
+	    (void) fflush(stdout);
+	    fprintf(stderr, "A server is already using %s\n", path);
+	    return EXIT_FAILURE;
+	}
+	(void) unlink(path);	/* left by an earlier server */
+    }
 #endif
-	    if ((fp = fopen(name, "rb")) != NULL) {
-		if (show_progress) {
-		    (void) fflush(stdout);
-		    (void) fprintf(stderr, "%s\n", name);
-		    (void) fflush(stderr);
-		}
-		do_file(fp, name);
-		(void) fclose(fp);
-	    } else {
-		failed(name);
-	    }
+    mask = umask(077);		/* only this user may connect */
+    ok = ((listener = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0
+	  && bind(listener, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+    (void) umask(mask);
+    if (!ok || listen(listener, SOMAXCONN) != 0)
+	failed(path);
+
+    (void) signal(SIGCHLD, SIG_IGN);	/* do not wait for the children */
+    for (;;) {
+	int conn = accept(listener, NULL, NULL);
+
+	if (conn < 0) {
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    failed("accept");
 	}
-    } else {
-#ifdef HAVE_POPEN
-	Decompress which = dcEmpty;
-	char *stdin_dir = NULL;
-	char *myfile;
-	char sniff[8];
-	int ch;
-	unsigned got = 0;
-
-	if ((ch = MY_GETC(stdin)) != EOF) {
-	    which = dcNone;
-	    if (ch == 'B') {	/* perhaps bzip2 (poor magic design...) */
-		sniff[got++] = (char) ch;
-		while (got < 5) {
-		    if ((ch = MY_GETC(stdin)) == EOF)
-			break;
-		    sniff[got++] = (char) ch;
-		}
-		if (got == 5
-		    && !strncmp(sniff, "BZh", (size_t) 3)
-		    && isdigit(UC(sniff[3]))
-		    && isdigit(UC(sniff[4]))) {
-		    which = dcBzip;
-		}
-	    } else if (ch == ']') {	/* perhaps lzma */
-		sniff[got++] = (char) ch;
-		while (got < 4) {
-		    if ((ch = MY_GETC(stdin)) == EOF)
-			break;
-		    sniff[got++] = (char) ch;
-		}
-		if (got == 4
-		    && !memcmp(sniff, "]\0\0\200", (size_t) 4)) {
-		    which = dcLzma;
-		}
-	    } else if (ch == 0xfd) {	/* perhaps xz */
-		sniff[got++] = (char) ch;
-		while (got < 6) {
-		    if ((ch = MY_GETC(stdin)) == EOF)
-			break;
-		    sniff[got++] = (char) ch;
-		}
-		if (got == 6
-		    && !memcmp(sniff, "\3757zXZ\0", (size_t) 6)) {
-		    which = dcXz;
-		}
-	    } else if (ch >= 0x22 && ch <= 0x28) {	/* perhaps zstd */
-		sniff[got++] = (char) ch;
-		while (got < 4) {
-		    if ((ch = MY_GETC(stdin)) == EOF)
-			break;
-		    sniff[got++] = (char) ch;
-		}
-		if (got == 4	/* vi:{ */
-		    && !memcmp(sniff + 1, "\265/\375", (size_t) 3)) {
-		    which = dcZstd;
-		}
-	    } else if (ch == '\037') {	/* perhaps compress, etc. */
-		sniff[got++] = (char) ch;
-		if ((ch = MY_GETC(stdin)) != EOF) {
-		    sniff[got++] = (char) ch;
-		    switch (ch) {
-		    case 0213:
-			which = dcGzip;
-			break;
-		    case 0235:
-			which = dcCompress;
-			break;
-		    case 0036:
-			which = dcPack;
-			break;
-		    }
-		}
-	    } else {
-		sniff[got++] = (char) ch;
-	    }
+	if (!same_user(conn)) {
+	    (void) close(conn);
+	    continue;
 	}
-	/*
-	 * The C standard only guarantees one ungetc;
-	 * virtually everyone allows more.
-	 */
-	while (got != 0) {
-	    ungetc((unsigned char) sniff[--got], stdin);
+	(void) fflush(stdout);
+	(void) fflush(stderr);
+	switch (fork()) {
+	case -1:
+	    perror("fork");
+	    break;
+	case 0:
+	    (void) close(listener);
+	    (void) signal(SIGCHLD, SIG_DFL);	/* for pclose() */
+	    exit(serve_request(conn));
+	default:
+	    break;
 	}
-	if (which != dcNone
-	    && which != dcEmpty
-	    && (myfile = copy_stdin(&stdin_dir)) != NULL) {
-	    FILE *fp;
-	    char *command;
+	(void) close(conn);
+    }
+}
 
-	    /* open pipe to decompress temporary file */
-	    command = decompressor(which, myfile);
-	    if ((fp = popen(command, "r")) != NULL) {
-		do_file(fp, "stdin");
-		(void) pclose(fp);
+/*
+ * Send the arguments to the server, which reads and writes this process's
+ * standard input, output and error, and returns the exit-status.  If there is
+ * no server, run the program here.
+ */
+static int
+client_diffstat(const char *path, int argc, char *argv[])
+{
+    struct sockaddr_un addr;
+    REQUEST header;
+    char *cwd = NULL;
+    size_t have = 256;
+    int conn = -1;
+    int code = -1;
+    int n;
+
+    for (;;) {
+	cwd = (char *) xmalloc(have);
+	if (getcwd(cwd, have) != NULL)
+	    break;
+	free(cwd);
+	cwd = NULL;
+	if (errno != ERANGE)
+	    break;
+	have *= 2;
+    }
+
+    if (cwd != NULL
+	&& socket_address(&addr, path)
+	&& (conn = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0
+	&& connect(conn, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+	header.count = (unsigned) argc + 1;
+	header.length = (unsigned) strlen(cwd) + 1;
+	for (n = 0; n < argc; ++n)
+	    header.length += (unsigned) strlen(argv[n]) + 1;
+	if (send_header(conn, &header)
+	    && write_fully(conn, cwd, strlen(cwd) + 1)) {
+	    unsigned char status;
+
+	    for (n = 0; n < argc; ++n) {
+		if (!write_fully(conn, argv[n], strlen(argv[n]) + 1))
+		    break;
 	    }
-	    free(command);
+	    code = (n == argc && read_fully(conn, &status, (size_t) 1)
+		    ? (int) status
+		    : EXIT_FAILURE);
+	}
+    }
+    if (conn >= 0)
+	(void) close(conn);
+    free(cwd);
+    if (code < 0)
+	code = run_diffstat(argc, argv);
+    return code;
+}
+#endif /* USE_SERVER */
 
-	    unlink(myfile);
-	    free(myfile);
-	    myfile = NULL;
-	    rmdir(stdin_dir);
-	    free(stdin_dir);
-	    stdin_dir = NULL;
-	} else if (which != dcEmpty)
+int
+main(int argc, char *argv[])
+{
+#if USE_SERVER
+    const char *path = NULL;
+    int used;
 #endif
-	    do_file(stdin, "stdin");
-    }
-    summarize();
-#if defined(NO_LEAKS)
-    while (all_data != 0) {
-	delink(all_data);
+
+#ifdef HAVE_MBSTOWCWIDTH
+    setlocale(LC_CTYPE, "");
+#endif
+
+#if USE_SERVER
+    if ((used = socket_option(argc, argv, "serve", &path)) != 0) {
+	if (argc > used + 1) {
+	    usage(stderr);
+	    return (EXIT_FAILURE);
+	}
+	return serve_diffstat(path);
+    } else if ((used = socket_option(argc, argv, "client", &path)) != 0) {
+	argv[used] = argv[0];
+	return client_diffstat(path, argc - used, argv + used);
     }
 #endif
-    return (EXIT_SUCCESS);
+    return run_diffstat(argc, argv);
 }
+#endif /* DIFFSTAT_LIBRARY */
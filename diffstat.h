@@ -0,0 +1,101 @@
+/* $Id: diffstat.h,v 1.6 2026/10/19 00:00:00 tom Exp $ */
+
+/*
+ * Interface to libdiffstat, which parses diffs and summarizes them in the
+ * same way as the diffstat program.
+ *
+ * Each run uses its own context, made by diffstat_new() and released by
+ * diffstat_free().  Contexts are independent, and different threads may use
+ * different contexts at the same time.  A given context should be used by
+ * only one thread at a time.
+ *
+ * The usual sequence is
+ *	diffstat_new()
+ *	diffstat_option(), for each option
+ *	diffstat_input() or diffstat_stream(), for each diff,
+ *	or diffstat_push_begin(), diffstat_push() for each piece of a diff,
+ *	and diffstat_push_end()
+ *	diffstat_finish()
+ *	diffstat_next() for each file, and/or diffstat_report()
+ *	diffstat_free()
+ *
+ * While reading a diff, diffstat_partial() and diffstat_partial_next() give
+ * the counts so far.
+ *
+ * With the --commits option, the report for each commit but the last is
+ * written while reading, to the stream given by diffstat_output().
+ */
+#ifndef DIFFSTAT_H
+#define DIFFSTAT_H 1
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _diffstat DIFFSTAT;
+
+/*
+ * Options are given to diffstat_option() using the same characters as the
+ * diffstat program, e.g., 'm' for "-m", or these codes for the long options.
+ */
+typedef enum {
+    DIFFSTAT_OPT_BATCH = 256,
+    DIFFSTAT_OPT_BATCH_LIST,
+    DIFFSTAT_OPT_BATCH_TOTAL,
+    DIFFSTAT_OPT_BUILD_MANIFEST,
+    DIFFSTAT_OPT_CACHE,
+    DIFFSTAT_OPT_CLIENT,
+    DIFFSTAT_OPT_COMMITS,
+    DIFFSTAT_OPT_COMPARE,
+    DIFFSTAT_OPT_ESTIMATE,
+    DIFFSTAT_OPT_EXCLUDE,
+    DIFFSTAT_OPT_GITIGNORE,
+    DIFFSTAT_OPT_IGNORE_FILE,
+    DIFFSTAT_OPT_INCLUDE,
+    DIFFSTAT_OPT_JOBS,
+    DIFFSTAT_OPT_SERVE
+} DIFFSTAT_OPTS;
+
+/* values for DIFFSTAT_FILE.status */
+#define DIFFSTAT_TEXT		0	/* lines were counted */
+#define DIFFSTAT_ONLY		1	/* "Only in", not known if added */
+#define DIFFSTAT_REMOVED	2	/* the file was removed */
+#define DIFFSTAT_ADDED		3	/* the file was added */
+#define DIFFSTAT_BINARY		4	/* binary files differ */
+#define DIFFSTAT_DIFFERS	5	/* files differ, without details */
+
+typedef struct {
+    const char *name;		/* pathname, less the prefix which is stripped */
+    int status;			/* one of the DIFFSTAT_xxx values */
+    long inserted;
+    long deleted;
+    long modified;		/* with the -m option */
+    long unchanged;		/* with the -S or -D options */
+} DIFFSTAT_FILE;
+
+extern DIFFSTAT *diffstat_new(void);
+extern int diffstat_option(DIFFSTAT *, int code, const char *value);
+extern int diffstat_input(DIFFSTAT *, int count, char *const *names);
+extern int diffstat_stream(DIFFSTAT *, FILE *fp, const char *name);
+extern void diffstat_push_begin(DIFFSTAT *, const char *name);
+extern int diffstat_push(DIFFSTAT *, const void *data, size_t length);
+extern void diffstat_push_end(DIFFSTAT *);
+extern long diffstat_partial(DIFFSTAT *, DIFFSTAT_FILE *totals);
+extern int diffstat_partial_next(DIFFSTAT *, DIFFSTAT_FILE *item);
+extern int diffstat_compare(DIFFSTAT *);
+extern int diffstat_manifest(DIFFSTAT *, const char *pathname);
+extern void diffstat_finish(DIFFSTAT *);
+extern int diffstat_next(DIFFSTAT *, DIFFSTAT_FILE *item);
+extern long diffstat_totals(DIFFSTAT *, DIFFSTAT_FILE *item);
+extern void diffstat_add_totals(DIFFSTAT *target, DIFFSTAT *source);
+extern void diffstat_output(DIFFSTAT *, FILE *fp);
+extern void diffstat_report(DIFFSTAT *, FILE *fp);
+extern void diffstat_free(DIFFSTAT *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DIFFSTAT_H */
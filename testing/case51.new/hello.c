@@ -0,0 +1,9 @@
+#include <stdio.h>
+#include "lib/util.h"
+
+int
+main(void)
+{
+    greet("hello");
+    return 0;
+}
@@ -0,0 +1,7 @@
+#include "util.h"
+
+int
+thrice(int n)
+{
+    return 3 * n;
+}
@@ -0,0 +1,14 @@
+#include <stdio.h>
+#include "util.h"
+
+void
+greet(const char *who)
+{
+    printf("%s, world\n", who);
+}
+
+int
+twice(int n)
+{
+    return 2 * n;
+}
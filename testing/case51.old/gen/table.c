@@ -0,0 +1,3 @@
+int table[] = {
+    1, 2, 3
+};
@@ -0,0 +1,14 @@
+#include <stdio.h>
+#include "util.h"
+
+void
+greet(const char *who)
+{
+    printf("%s\n", who);
+}
+
+int
+twice(int n)
+{
+    return n + n;
+}
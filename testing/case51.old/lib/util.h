@@ -0,0 +1,5 @@
+#ifndef UTIL_H
+#define UTIL_H 1
+extern void greet(const char *);
+extern int twice(int);
+#endif
@@ -0,0 +1,58 @@
+#!/bin/sh
+# $Id: pipe_test.sh,v 1.1 2026/10/19 00:00:00 tom Exp $
+# Check that diffstat reads several named pipes given as inputs, giving the
+# same report as for the files which are written to them.
+
+if [ $# != 2 ]
+then
+	echo "usage: $0 file1 file2"
+	exit 1
+fi
+PATH=`cd ..;pwd`:$PATH; export PATH
+
+TEST=pipe_test
+PIPE1=$TEST.1
+PIPE2=$TEST.2
+rm -f $PIPE1 $PIPE2 $TEST.ref $TEST.out
+mkfifo $PIPE1 $PIPE2 2>/dev/null || {
+	echo "** skip: $TEST (no mkfifo)"
+	rm -f $PIPE1 $PIPE2
+	exit 0
+}
+
+diffstat -o $TEST.ref "$1" "$2"
+
+cat "$1" >$PIPE1 &
+WRITE1=$!
+cat "$2" >$PIPE2 &
+WRITE2=$!
+diffstat -o $TEST.out $PIPE1 $PIPE2 &
+PID=$!
+
+# do not wait forever if diffstat blocks on a pipe
+WAIT=0
+while kill -0 $PID 2>/dev/null
+do
+	if [ $WAIT -ge 10 ]
+	then
+		kill $PID
+		break
+	fi
+	sleep 1
+	WAIT=`expr $WAIT + 1`
+done
+wait $PID 2>/dev/null
+
+# stop any writer which is still waiting for a reader
+kill $WRITE1 $WRITE2 2>/dev/null
+wait
+
+if [ -f $TEST.out ] && cmp -s $TEST.ref $TEST.out
+then
+	echo "** ok: $TEST"
+	rm -f $PIPE1 $PIPE2 $TEST.ref $TEST.out
+else
+	echo "?? fail: $TEST"
+	rm -f $PIPE1 $PIPE2
+	exit 1
+fi
@@ -0,0 +1,124 @@
+/*
+ * $Id: push_test.c,v 1.1 2026/10/19 00:00:00 tom Exp $
+ *
+ * Check that libdiffstat gives the same report for a diff which is given in
+ * pieces with diffstat_push() as for the same diff read by diffstat_stream().
+ * Each file is pushed a byte at a time, and in pieces of a few odd sizes, so
+ * that lines and chunks are split in different places.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <diffstat.h>
+
+static const size_t sizes[] =
+{1, 3, 61, 509, 4093};
+
+static char *
+read_all(FILE *fp, size_t *length)
+{
+    size_t have = BUFSIZ;
+    size_t used = 0;
+    size_t got;
+    char *result = malloc(have);
+
+    while (result != NULL
+	   && (got = fread(result + used, (size_t) 1, have - used, fp)) != 0) {
+	used += got;
+	if (used == have) {
+	    have *= 2;
+	    result = realloc(result, have);
+	}
+    }
+    if (result == NULL) {
+	perror("malloc");
+	exit(EXIT_FAILURE);
+    }
+    *length = used;
+    return result;
+}
+
+/*
+ * Finish the diff, returning the report as a string.
+ */
+static char *
+get_report(DIFFSTAT * context, size_t *length)
+{
+    FILE *fp = tmpfile();
+    char *result;
+
+    if (fp == NULL) {
+	perror("tmpfile");
+	exit(EXIT_FAILURE);
+    }
+    diffstat_report(context, fp);
+    rewind(fp);
+    result = read_all(fp, length);
+    fclose(fp);
+    diffstat_free(context);
+    return result;
+}
+
+static int
+push_test(const char *name)
+{
+    FILE *fp;
+    DIFFSTAT *context;
+    char *data;
+    char *want;
+    char *have;
+    size_t length;
+    size_t want_len;
+    size_t have_len;
+    size_t n;
+    int ok = 1;
+
+    if ((fp = fopen(name, "rb")) == NULL) {
+	perror(name);
+	return 0;
+    }
+    data = read_all(fp, &length);
+    rewind(fp);
+    context = diffstat_new();
+    diffstat_stream(context, fp, name);
+    fclose(fp);
+    want = get_report(context, &want_len);
+
+    for (n = 0; n < sizeof(sizes) / sizeof(sizes[0]); ++n) {
+	size_t at;
+
+	context = diffstat_new();
+	diffstat_push_begin(context, name);
+	for (at = 0; at < length; at += sizes[n]) {
+	    size_t size = (length - at < sizes[n]) ? (length - at) : sizes[n];
+	    diffstat_push(context, data + at, size);
+	}
+	diffstat_push_end(context);
+	have = get_report(context, &have_len);
+	if (have_len != want_len || memcmp(have, want, want_len)) {
+	    printf("?? fail: push %s in pieces of %lu bytes\n",
+		   name, (unsigned long) sizes[n]);
+	    ok = 0;
+	}
+	free(have);
+    }
+    if (ok)
+	printf("** ok: push %s\n", name);
+    free(want);
+    free(data);
+    return ok;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int ok = 1;
+    int n;
+
+    for (n = 1; n < argc; ++n) {
+	if (!push_test(argv[n]))
+	    ok = 0;
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,5 +1,5 @@
 #!/bin/sh
-# $Id: run_test.sh,v 1.15 2012/01/03 10:18:14 tom Exp $
+# $Id: run_test.sh,v 1.16 2026/10/19 00:00:00 tom Exp $
 # Test-script for DIFFSTAT
 
 # change this for ad hoc testing of compression
@@ -16,36 +16,73 @@ fi
 PATH=`cd ..;pwd`:$PATH; export PATH
 # Sanity check, remembering that not every system has `which'.
 (which diffstat) >/dev/null 2>/dev/null && echo "Checking `which diffstat`"
+HERE=`pwd`
+
+# Run diffstat with the options, and compare the output with the ".ref" file
+# whose name is the test's name with the suffix.
+check_case() {
+	SUFFIX="$1"
+	OPTS="$2"
+	TEST=`basename $NAME`$SUFFIX
+	if [ -f $NAME.opt ]
+	then
+		# options may name files in the test-directory
+		( cd `dirname $NAME` && eval diffstat \
+			-e \"\$HERE/\$TEST.err\" \
+			-o \"\$HERE/\$TEST.out\" \
+			$OPTS `basename $DATA` </dev/null )
+	else
+		diffstat -e $TEST.err -o $TEST.out $OPTS $DATA
+	fi
+	if [ -f $NAME$SUFFIX.ref ]
+	then
+		diff -b $NAME$SUFFIX.ref $TEST.out >check.out
+		if test -s check.out
+		then
+			echo "?? fail: $TEST"
+			ls -l check.out
+			cat check.out
+		else
+			echo "** ok: $TEST"
+			rm -f $TEST.out
+			rm -f $TEST.err
+		fi
+	else
+		echo "** save: $TEST"
+		mv $TEST.out $NAME$SUFFIX.ref
+		rm -f $TEST.err
+	fi
+}
 
 for item in $*
 do
 	echo "testing `basename $item $TYPE`"
+	NAME=`echo $item | sed -e 's/'$TYPE'$//'`
+	DATA=${NAME}${TYPE}
+	if [ -f $NAME.opt ]
+	then
+		# each line of the ".opt" file gives a suffix and options, or
+		# "-" for no suffix.
+		while read SUFFIX OPTS
+		do
+			case "$SUFFIX" in
+			\#*|"")
+				continue
+				;;
+			-)
+				SUFFIX=
+				;;
+			esac
+			check_case "$SUFFIX" "$OPTS"
+		done <$NAME.opt
+		continue
+	fi
 	for OPTS in "" "-p1" "-p9" "-f0" "-u" "-k" "-r1" "-r2" "-b" "-R" "-Rp0"
 	do
-		NAME=`echo $item | sed -e 's/'$TYPE'$//'`
-		DATA=${NAME}${TYPE}
+		SUFFIX=
 		if [ ".$OPTS" != "." ] ; then
-			NAME=$NAME`echo ./$OPTS|sed -e 's@./-@@'`
-		fi
-		TEST=`basename $NAME`
-		diffstat -e $TEST.err -o $TEST.out $OPTS $DATA
-		if [ -f $NAME.ref ]
-		then
-			diff -b $NAME.ref $TEST.out >check.out
-			if test -s check.out
-			then
-				echo "?? fail: $TEST"
-				ls -l check.out
-				cat check.out
-			else
-				echo "** ok: $TEST"
-				rm -f $TEST.out
-				rm -f $TEST.err
-			fi
-		else
-			echo "** save: $TEST"
-			mv $TEST.out $NAME.ref
-			rm -f $TEST.err
+			SUFFIX=`echo ./$OPTS|sed -e 's@./-@@'`
 		fi
+		check_case "$SUFFIX" "$OPTS"
 	done
 done